@@ -0,0 +1,149 @@
+// Helpers for benchmark/run.js, built as build/Release/bench.node when
+// binding.gyp is configured with -Dpathwatcher_benchmarks=true.
+//
+// The file system operations of a storm run on the thread pool, so the main
+// thread is free to take the events as they come and the time of every
+// operation is recorded on the clock process.hrtime.bigint() reads.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include <string>
+#include <vector>
+
+#include "nan.h"
+using namespace v8;
+
+namespace {
+
+enum StormKind {
+  STORM_CREATE,
+  STORM_MODIFY,
+  STORM_DELETE,
+};
+
+class Storm : public Nan::AsyncWorker {
+ public:
+  Storm(Nan::Callback* callback,
+        const std::string& dir,
+        StormKind kind,
+        uint32_t count,
+        uint32_t interval_us)
+      : Nan::AsyncWorker(callback, "pathwatcher:bench"),
+        dir_(dir),
+        kind_(kind),
+        count_(count),
+        interval_us_(interval_us) {}
+
+  void Execute() {
+    times_.reserve(count_);
+    for (uint32_t i = 0; i < count_; ++i) {
+      char name[32];
+      snprintf(name, sizeof(name), "/file-%u", i);
+      std::string path = dir_ + name;
+
+      int result = 0;
+      times_.push_back(static_cast<double>(uv_hrtime()));
+      switch (kind_) {
+        case STORM_CREATE:
+        case STORM_MODIFY: {
+          int flags = kind_ == STORM_CREATE ? O_CREAT | O_EXCL | O_WRONLY : O_WRONLY | O_APPEND;
+          int fd = open(path.c_str(), flags | O_CLOEXEC, 0644);
+          result = fd == -1 || write(fd, "x", 1) != 1 ? -1 : 0;
+          if (fd != -1)
+            close(fd);
+          break;
+        }
+        case STORM_DELETE:
+          result = unlink(path.c_str());
+          break;
+      }
+      if (result == -1) {
+        SetErrorMessage((path + ": " + strerror(errno)).c_str());
+        return;
+      }
+
+      if (interval_us_ > 0)
+        usleep(interval_us_);
+    }
+  }
+
+ protected:
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    Local<ArrayBuffer> buffer = ArrayBuffer::New(v8::Isolate::GetCurrent(),
+                                                 times_.size() * sizeof(double));
+    Local<Float64Array> times = Float64Array::New(buffer, 0, times_.size());
+    Local<v8::Context> context = Nan::GetCurrentContext();
+    for (size_t i = 0; i < times_.size(); ++i)
+      times->Set(context, i, Nan::New<Number>(times_[i])).FromJust();
+
+    Local<Value> argv[] = { Nan::Null(), times };
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  std::string dir_;
+  StormKind kind_;
+  uint32_t count_;
+  uint32_t interval_us_;
+  std::vector<double> times_;
+};
+
+// storm(dir, kind, count, intervalMicroseconds, callback) creates, appends to
+// or deletes `dir/file-0` up to `dir/file-<count - 1>` off the main thread and
+// calls back with the uv_hrtime() of each operation.
+NAN_METHOD(StartStorm) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString() || !info[1]->IsString() || !info[2]->IsUint32() ||
+      !info[3]->IsUint32() || !info[4]->IsFunction())
+    return Nan::ThrowTypeError("storm(dir, kind, count, interval, callback)");
+
+  String::Utf8Value kind_value(v8::Isolate::GetCurrent(), info[1]);
+  StormKind kind;
+  if (strcmp(*kind_value, "create") == 0)
+    kind = STORM_CREATE;
+  else if (strcmp(*kind_value, "modify") == 0)
+    kind = STORM_MODIFY;
+  else if (strcmp(*kind_value, "delete") == 0)
+    kind = STORM_DELETE;
+  else
+    return Nan::ThrowTypeError("kind must be create, modify or delete");
+
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  String::Utf8Value dir(v8::Isolate::GetCurrent(), info[0]);
+  Nan::Callback* callback = new Nan::Callback(info[4].As<Function>());
+  Nan::AsyncQueueWorker(new Storm(callback, *dir, kind,
+                                  info[2]->Uint32Value(context).FromJust(),
+                                  info[3]->Uint32Value(context).FromJust()));
+}
+
+// Bytes allocated with malloc and not freed yet, -1 where that can't be told.
+// Unlike RSS it doesn't move with pages the allocator keeps around.
+NAN_METHOD(HeapBytes) {
+  Nan::HandleScope scope;
+  double bytes = -1;
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 info2 = mallinfo2();
+  bytes = static_cast<double>(info2.uordblks + info2.hblkhd);
+#endif
+  info.GetReturnValue().Set(Nan::New<Number>(bytes));
+}
+
+void Init(Local<Object> exports) {
+  Nan::SetMethod(exports, "storm", StartStorm);
+  Nan::SetMethod(exports, "heapBytes", HeapBytes);
+}
+
+}  // namespace
+
+NODE_MODULE(bench, Init)
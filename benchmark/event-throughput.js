@@ -0,0 +1,57 @@
+// Measures how many events per second make it from the kernel to the
+// callback while a watched directory goes through a burst of file creations,
+// modifications and deletions.
+//
+//   node benchmark/event-throughput.js [file count]
+
+const fs = require('fs')
+const os = require('os')
+const path = require('path')
+const pathWatcher = require('../lib/main')
+
+const fileCount = parseInt(process.argv[2], 10) || 5000
+const quietPeriod = 500
+
+const dir = fs.mkdtempSync(path.join(os.tmpdir(), 'pathwatcher-bench-'))
+
+let received = 0
+let firstEventAt = null
+let lastEventAt = null
+
+pathWatcher.watch(dir, () => {
+  lastEventAt = process.hrtime.bigint()
+  if (firstEventAt === null) firstEventAt = lastEventAt
+  received++
+})
+
+const start = process.hrtime.bigint()
+for (let i = 0; i < fileCount; i++) {
+  const file = path.join(dir, `file-${i}`)
+  fs.writeFileSync(file, 'x')
+  fs.appendFileSync(file, 'y')
+  fs.unlinkSync(file)
+}
+const writtenAt = process.hrtime.bigint()
+
+function waitForQuiet () {
+  const last = lastEventAt || writtenAt
+  if (Number(process.hrtime.bigint() - last) / 1e6 < quietPeriod) {
+    setTimeout(waitForQuiet, 50)
+    return
+  }
+
+  const elapsed = Number((lastEventAt || writtenAt) - start) / 1e9
+  console.log(JSON.stringify({
+    benchmark: 'event-throughput',
+    platform: process.platform,
+    fileOperations: fileCount * 3,
+    eventsReceived: received,
+    seconds: elapsed,
+    eventsPerSecond: Math.round(received / elapsed)
+  }))
+
+  pathWatcher.closeAllWatchers()
+  fs.rmdirSync(dir)
+}
+
+setTimeout(waitForQuiet, quietPeriod)
@@ -0,0 +1,54 @@
+// Times adding, looking up and removing handles in the native HandleMap, the
+// table every event is dispatched through.
+//
+//   node benchmark/handle-map.js [handle count]
+
+const {HandleMap} = require('../build/Release/pathwatcher.node')
+
+const handleCount = parseInt(process.argv[2], 10) || 100000
+const rounds = 5
+
+function time (fn) {
+  const start = process.hrtime.bigint()
+  fn()
+  return Number(process.hrtime.bigint() - start) / 1e6
+}
+
+const results = {add: [], get: [], has: [], forEach: [], remove: []}
+const values = []
+for (let i = 0; i < handleCount; i++) values.push({handle: i})
+
+for (let round = 0; round < rounds; round++) {
+  const map = new HandleMap()
+  results.add.push(time(() => {
+    for (let i = 0; i < handleCount; i++) map.add(i + 1, values[i])
+  }))
+  results.get.push(time(() => {
+    for (let i = 0; i < handleCount; i++) map.get(i + 1)
+  }))
+  results.has.push(time(() => {
+    for (let i = 0; i < handleCount; i++) map.has(handleCount + i + 1)
+  }))
+  results.forEach.push(time(() => {
+    map.forEach(() => {})
+  }))
+  results.remove.push(time(() => {
+    for (let i = 0; i < handleCount; i++) map.remove(i + 1)
+  }))
+}
+
+const summary = {}
+for (const operation in results) {
+  const best = Math.min(...results[operation])
+  summary[operation] = {
+    milliseconds: best,
+    nanosecondsPerOperation: Math.round(best * 1e6 / handleCount)
+  }
+}
+
+console.log(JSON.stringify({
+  benchmark: 'handle-map',
+  platform: process.platform,
+  handles: handleCount,
+  operations: summary
+}))
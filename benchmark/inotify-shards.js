@@ -0,0 +1,94 @@
+// Measures how fast events from several trees changing at once arrive with
+// the inotify watches spread over 1, 2, 4 and 8 instances, each read by its
+// own thread.
+//
+//   node benchmark/inotify-shards.js [tree count] [files per tree]
+
+const childProcess = require('child_process')
+const fs = require('fs')
+const os = require('os')
+const path = require('path')
+
+const treeCount = parseInt(process.argv[2], 10) || 8
+const filesPerTree = parseInt(process.argv[3], 10) || 5000
+const shardCounts = [1, 2, 4, 8]
+
+// Creates, fills and removes the files of one tree, run in a process of its
+// own so the writers don't wait on each other.
+const writer = `
+const fs = require('fs'), path = require('path')
+const [dir, count] = process.argv.slice(1)
+for (let i = 0; i < count; i++) {
+  const file = path.join(dir, 'sub-' + (i % 10), 'file-' + i)
+  fs.writeFileSync(file, 'x')
+  fs.unlinkSync(file)
+}
+`
+
+function measure (shards) {
+  const binding = require('../build/Release/pathwatcher.node')
+  const root = fs.mkdtempSync(path.join(os.tmpdir(), 'pathwatcher-bench-'))
+  const trees = []
+  for (let t = 0; t < treeCount; t++) {
+    const tree = path.join(root, `tree-${t}`)
+    for (let s = 0; s < 10; s++) fs.mkdirSync(path.join(tree, `sub-${s}`), {recursive: true})
+    trees.push(tree)
+  }
+
+  const expected = treeCount * filesPerTree
+  let deletes = 0
+  let events = 0
+  let overflows = 0
+  let start = null
+
+  // The deepest any kernel queue got, sampled by the reader threads.
+  let peak = 0
+  const peakQueuedEvents = () => Math.max(peak, binding.getQueueStats().peakEvents)
+  setInterval(() => { peak = peakQueuedEvents() }, 10)
+
+  binding.setCallback((batch) => {
+    for (let i = 0; i < batch.length; i += 5) {
+      events++
+      if (batch[i] === 'child-delete') deletes++
+      if (batch[i] === 'overflow') overflows++
+    }
+    if (deletes < expected && overflows === 0) return
+
+    const seconds = Number(process.hrtime.bigint() - start) / 1e9
+    console.log(JSON.stringify({
+      shards,
+      trees: treeCount,
+      filesPerTree,
+      events,
+      overflows,
+      peakQueuedEvents: peakQueuedEvents(),
+      seconds,
+      eventsPerSecond: Math.round(events / seconds)
+    }))
+    fs.rmSync(root, {recursive: true})
+    process.exit(0)
+  })
+
+  for (const tree of trees) binding.watchTree(tree)
+
+  start = process.hrtime.bigint()
+  for (const tree of trees) {
+    childProcess.spawn(process.execPath, ['-e', writer, tree, filesPerTree], {stdio: 'inherit'})
+  }
+}
+
+if (process.env.PATHWATCHER_BENCH_SHARDS) {
+  measure(parseInt(process.env.PATHWATCHER_BENCH_SHARDS, 10))
+} else {
+  const results = []
+  for (const shards of shardCounts) {
+    const env = Object.assign({}, process.env, {
+      PATHWATCHER_BACKEND: 'inotify',
+      PATHWATCHER_INOTIFY_SHARDS: String(shards),
+      PATHWATCHER_BENCH_SHARDS: String(shards)
+    })
+    const output = childProcess.execFileSync(process.execPath, [__filename, ...process.argv.slice(2)], {env})
+    results.push(JSON.parse(output.toString()))
+  }
+  console.log(JSON.stringify({benchmark: 'inotify-shards', platform: process.platform, results}))
+}
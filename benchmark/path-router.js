@@ -0,0 +1,63 @@
+// Times dispatching child events to the files watched through their parent
+// directory: calling every subscriber and letting it compare the path, as
+// before, against looking them up in the native PathRouter.
+//
+//   node benchmark/path-router.js [subscriber count]
+
+const path = require('path')
+const {PathRouter} = require('../build/Release/pathwatcher.node')
+
+const subscriberCount = parseInt(process.argv[2], 10) || 5000
+const eventCount = 10000
+const rounds = 5
+const root = path.join(path.sep, 'home', 'user', 'project', 'src')
+
+function time (fn) {
+  const start = process.hrtime.bigint()
+  fn()
+  return Number(process.hrtime.bigint() - start) / 1e6
+}
+
+const files = []
+for (let i = 0; i < subscriberCount; i++) files.push(path.join(root, `file-${i}.js`))
+const events = []
+for (let i = 0; i < eventCount; i++) events.push({event: 'child-change', newFilePath: files[(i * 7919) % subscriberCount]})
+
+let delivered = 0
+const subscribers = files.map((file) => (change) => {
+  if (change.newFilePath === file) delivered++
+})
+const router = new PathRouter()
+files.forEach((file, i) => router.add(file, subscribers[i]))
+
+const results = {callEvery: [], router: []}
+for (let round = 0; round < rounds; round++) {
+  results.callEvery.push(time(() => {
+    for (const change of events) {
+      for (const subscriber of subscribers) subscriber(change)
+    }
+  }))
+  results.router.push(time(() => {
+    for (const change of events) {
+      for (const subscriber of router.match(change.newFilePath, change.oldFilePath) || []) subscriber(change)
+    }
+  }))
+}
+
+const summary = {}
+for (const strategy in results) {
+  const best = Math.min(...results[strategy])
+  summary[strategy] = {
+    milliseconds: best,
+    nanosecondsPerEvent: Math.round(best * 1e6 / eventCount)
+  }
+}
+
+console.log(JSON.stringify({
+  benchmark: 'path-router',
+  platform: process.platform,
+  subscribers: subscriberCount,
+  events: eventCount,
+  delivered: delivered / rounds / 2,
+  strategies: summary
+}))
@@ -0,0 +1,238 @@
+// Runs the benchmark suite and prints the results as one JSON object, to
+// compare releases on the same machine:
+//
+//   - latency: from a file system operation to the callback, p50/p99/max in
+//     microseconds, for creations, modifications and deletions made one per
+//     millisecond
+//   - throughput: events per second while files are created, modified and
+//     deleted as fast as a thread can
+//   - registration: time to watch 1k, 10k and 100k files and the memory each
+//     watch costs
+//
+// The operations come from build/Release/bench.node, so build it first:
+//
+//   node-gyp rebuild -- -Dpathwatcher_benchmarks=true
+//   node benchmark/run.js [--dir <fixture dir>] [--out <file>] [--quick]
+//
+// Fixtures go to /dev/shm when there is one, so the disk doesn't take part.
+
+const childProcess = require('child_process')
+const fs = require('fs')
+const os = require('os')
+const path = require('path')
+
+const argv = process.argv.slice(2)
+const option = (name) => {
+  const index = argv.indexOf(name)
+  return index === -1 ? null : argv[index + 1]
+}
+const quick = argv.includes('--quick')
+
+const latencyCount = quick ? 200 : 1000
+const latencyIntervalUs = 1000
+const stormCount = quick ? 2000 : 20000
+const registrationCounts = quick ? [1000] : [1000, 10000, 100000]
+const quietPeriod = 300
+
+function fixtureRoot () {
+  const dir = option('--dir')
+  if (dir) return dir
+  try {
+    fs.accessSync('/dev/shm', fs.constants.W_OK)
+    return '/dev/shm'
+  } catch (error) {
+    return os.tmpdir()
+  }
+}
+
+function percentile (sorted, fraction) {
+  if (sorted.length === 0) return null
+  return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * fraction))]
+}
+
+// Runs one storm in |dir| and resolves with the time of each operation and of
+// the first matching event for it, both in nanoseconds.
+function storm (binding, bench, dir, kind, count, intervalUs) {
+  const eventType = {create: 'child-create', modify: 'child-change', delete: 'child-delete'}[kind]
+  const prefix = path.join(dir, 'file-')
+  const arrivals = new Float64Array(count)
+  let events = 0
+  let overflows = 0
+  let lastEventAt = 0
+
+  binding.setCallback((batch) => {
+    const now = Number(process.hrtime.bigint())
+    for (let i = 0; i < batch.length; i += 5) {
+      events++
+      lastEventAt = now
+      if (batch[i] === 'overflow') overflows++
+      if (batch[i] !== eventType || !batch[i + 2].startsWith(prefix)) continue
+      const index = parseInt(batch[i + 2].slice(prefix.length), 10)
+      if (arrivals[index] === 0) arrivals[index] = now
+    }
+  })
+
+  return new Promise((resolve, reject) => {
+    bench.storm(dir, kind, count, intervalUs, (error, times) => {
+      if (error) return reject(error)
+      const waitForQuiet = () => {
+        const last = Math.max(lastEventAt, times[times.length - 1])
+        if (Number(process.hrtime.bigint()) - last < quietPeriod * 1e6) {
+          setTimeout(waitForQuiet, 20)
+          return
+        }
+        resolve({times, arrivals, events, overflows})
+      }
+      waitForQuiet()
+    })
+  })
+}
+
+async function measureEvents () {
+  const binding = require('../build/Release/pathwatcher.node')
+  const bench = require('../build/Release/bench.node')
+  const results = {latency: {}, throughput: {}}
+
+  for (const [section, count, intervalUs] of [['latency', latencyCount, latencyIntervalUs],
+                                              ['throughput', stormCount, 0]]) {
+    const dir = fs.mkdtempSync(path.join(fixtureRoot(), 'pathwatcher-bench-'))
+    const handle = binding.watch(dir)
+    for (const kind of ['create', 'modify', 'delete']) {
+      const {times, arrivals, events, overflows} =
+        await storm(binding, bench, dir, kind, count, intervalUs)
+
+      const latencies = []
+      let lastArrival = 0
+      for (let i = 0; i < count; i++) {
+        if (arrivals[i] === 0) continue
+        latencies.push((arrivals[i] - times[i]) / 1e3)
+        lastArrival = Math.max(lastArrival, arrivals[i])
+      }
+      latencies.sort((a, b) => a - b)
+
+      if (section === 'latency') {
+        results.latency[kind] = {
+          operations: count,
+          matched: latencies.length,
+          p50: percentile(latencies, 0.5),
+          p99: percentile(latencies, 0.99),
+          max: latencies.length ? latencies[latencies.length - 1] : null
+        }
+      } else {
+        const seconds = (Math.max(lastArrival, times[count - 1]) - times[0]) / 1e9
+        results.throughput[kind] = {
+          operations: count,
+          matched: latencies.length,
+          events,
+          overflows,
+          seconds,
+          operationsPerSecond: Math.round(count / ((times[count - 1] - times[0]) / 1e9)),
+          eventsPerSecond: Math.round(latencies.length / seconds)
+        }
+      }
+    }
+    binding.unwatch(handle)
+    fs.rmSync(dir, {recursive: true})
+  }
+  return results
+}
+
+function measureRegistration (count) {
+  const binding = require('../build/Release/pathwatcher.node')
+  const bench = require('../build/Release/bench.node')
+  binding.setCallback(() => {})
+
+  const dir = fs.mkdtempSync(path.join(fixtureRoot(), 'pathwatcher-bench-'))
+  const files = []
+  for (let i = 0; i < count; i++) {
+    const subdirectory = path.join(dir, `dir-${Math.floor(i / 1000)}`)
+    if (i % 1000 === 0) fs.mkdirSync(subdirectory)
+    const file = path.join(subdirectory, `file-${i}`)
+    fs.writeFileSync(file, '')
+    files.push(file)
+  }
+
+  global.gc()
+  const rssBefore = process.memoryUsage().rss
+  const heapBefore = bench.heapBytes()
+  const handles = []
+  let error = null
+  const start = process.hrtime.bigint()
+  for (const file of files) {
+    try {
+      handles.push(binding.watch(file))
+    } catch (e) {
+      error = e.code || e.message
+      break
+    }
+  }
+  const watchMs = Number(process.hrtime.bigint() - start) / 1e6
+  global.gc()
+  const rssBytes = process.memoryUsage().rss - rssBefore
+  const heapBytes = heapBefore < 0 ? null : bench.heapBytes() - heapBefore
+
+  const unwatchStart = process.hrtime.bigint()
+  for (const handle of handles) binding.unwatch(handle)
+  const unwatchMs = Number(process.hrtime.bigint() - unwatchStart) / 1e6
+  fs.rmSync(dir, {recursive: true})
+
+  const watched = handles.length
+  return {
+    count,
+    watched,
+    error,
+    watchMs,
+    microsecondsPerWatch: watched ? watchMs * 1e3 / watched : null,
+    unwatchMs,
+    rssBytesPerWatch: watched ? Math.round(rssBytes / watched) : null,
+    nativeHeapBytesPerWatch: watched && heapBytes !== null ? Math.round(heapBytes / watched) : null
+  }
+}
+
+// Every case runs in a process of its own, so memory and kernel state left
+// behind by one doesn't show up in the next.
+function runCase (args) {
+  const output = childProcess.execFileSync(
+    process.execPath, ['--expose-gc', __filename, ...args, ...argv],
+    {maxBuffer: 16 * 1024 * 1024})
+  return JSON.parse(output.toString())
+}
+
+async function main () {
+  const benchCase = option('--case')
+  if (benchCase === 'events') {
+    console.log(JSON.stringify(await measureEvents()))
+    process.exit(0)
+  }
+  if (benchCase === 'registration') {
+    console.log(JSON.stringify(measureRegistration(parseInt(option('--count'), 10))))
+    process.exit(0)
+  }
+
+  const events = runCase(['--case', 'events'])
+  const registration = registrationCounts.map((count) =>
+    runCase(['--case', 'registration', '--count', String(count)]))
+
+  const result = JSON.stringify({
+    benchmark: 'suite',
+    date: new Date().toISOString(),
+    platform: process.platform,
+    arch: process.arch,
+    release: os.release(),
+    cpus: os.cpus().length,
+    node: process.version,
+    backend: process.env.PATHWATCHER_BACKEND || 'default',
+    fixtures: fixtureRoot(),
+    latency: events.latency,
+    throughput: events.throughput,
+    registration
+  }, null, 2)
+
+  if (option('--out')) fs.writeFileSync(option('--out'), result + '\n')
+  console.log(result)
+}
+
+main().catch((error) => {
+  console.error(error)
+  process.exit(1)
+})
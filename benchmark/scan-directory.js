@@ -0,0 +1,85 @@
+// Compares listing a large directory the way Directory.getEntries used to, a
+// readdir followed by one lstat at a time and a stat for every symlink, with a
+// single native scanDirectory call, with and without the sizes and times.
+//
+//   node benchmark/scan-directory.js [entry count]
+
+const fs = require('fs')
+const os = require('os')
+const path = require('path')
+const binding = require('../build/Release/pathwatcher.node')
+
+const entryCount = parseInt(process.argv[2], 10) || 50000
+const rounds = 3
+
+const dir = fs.mkdtempSync(path.join(os.tmpdir(), 'pathwatcher-bench-'))
+for (let i = 0; i < entryCount; i++) {
+  const entry = path.join(dir, `entry-${i}`)
+  // Mostly files, with a directory and a symlink now and then.
+  if (i % 100 === 0) {
+    fs.mkdirSync(entry)
+  } else if (i % 100 === 1) {
+    fs.symlinkSync(path.join(dir, 'entry-0'), entry)
+  } else {
+    fs.writeFileSync(entry, '')
+  }
+}
+
+function serialStat () {
+  return new Promise((resolve, reject) => {
+    fs.readdir(dir, (error, names) => {
+      if (error) return reject(error)
+      const kinds = []
+      const next = (i) => {
+        if (i === names.length) return resolve(kinds)
+        const entryPath = path.join(dir, names[i])
+        fs.lstat(entryPath, (error, stat) => {
+          if (stat && stat.isSymbolicLink()) {
+            fs.stat(entryPath, (error, stat) => {
+              kinds.push(stat && stat.isDirectory())
+              next(i + 1)
+            })
+          } else {
+            kinds.push(stat && stat.isDirectory())
+            next(i + 1)
+          }
+        })
+      }
+      next(0)
+    })
+  })
+}
+
+function nativeScan (stat) {
+  return new Promise((resolve, reject) => {
+    binding.scanDirectory(dir, stat, (error, result) => error ? reject(error) : resolve(result))
+  })
+}
+
+async function time (fn) {
+  const start = process.hrtime.bigint()
+  await fn()
+  return Number(process.hrtime.bigint() - start) / 1e6
+}
+
+async function main () {
+  const results = {serialStat: [], scanDirectory: [], scanDirectoryWithStat: []}
+  for (let round = 0; round < rounds; round++) {
+    results.serialStat.push(await time(serialStat))
+    results.scanDirectory.push(await time(() => nativeScan(false)))
+    results.scanDirectoryWithStat.push(await time(() => nativeScan(true)))
+  }
+
+  const milliseconds = {}
+  for (const kind in results) milliseconds[kind] = Math.min(...results[kind])
+
+  console.log(JSON.stringify({
+    benchmark: 'scan-directory',
+    platform: process.platform,
+    entries: entryCount,
+    milliseconds
+  }))
+  fs.rmSync(dir, {recursive: true})
+}
+
+main()
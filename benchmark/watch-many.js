@@ -0,0 +1,74 @@
+// Compares starting a watch for every file of a large workspace one call at a
+// time with starting them all through a single watchMany call, for files that
+// exist and for files that are gone by the time they are watched.
+//
+//   node benchmark/watch-many.js [file count]
+
+const fs = require('fs')
+const os = require('os')
+const path = require('path')
+const binding = require('../build/Release/pathwatcher.node')
+
+const fileCount = parseInt(process.argv[2], 10) || 20000
+const rounds = 3
+
+const dir = fs.mkdtempSync(path.join(os.tmpdir(), 'pathwatcher-bench-'))
+const paths = []
+const missingPaths = []
+for (let i = 0; i < fileCount; i++) {
+  const subdirectory = path.join(dir, `dir-${Math.floor(i / 100)}`)
+  if (i % 100 === 0) fs.mkdirSync(subdirectory)
+  const file = path.join(subdirectory, `file-${i}`)
+  fs.writeFileSync(file, '')
+  paths.push(file)
+  missingPaths.push(`${file}-missing`)
+}
+
+binding.setCallback(() => {})
+
+function time (fn) {
+  const start = process.hrtime.bigint()
+  const handles = fn()
+  const elapsed = Number(process.hrtime.bigint() - start) / 1e6
+  for (const handle of handles) binding.unwatch(handle)
+  return elapsed
+}
+
+function watchEach (files) {
+  const handles = []
+  for (const file of files) {
+    try {
+      handles.push(binding.watch(file))
+    } catch (error) {}
+  }
+  return handles
+}
+
+function watchAll (files) {
+  return binding.watchMany(files).handles.filter((handle) => handle !== null)
+}
+
+const results = {existing: {watch: [], watchMany: []}, missing: {watch: [], watchMany: []}}
+for (let round = 0; round < rounds; round++) {
+  results.existing.watch.push(time(() => watchEach(paths)))
+  results.existing.watchMany.push(time(() => watchAll(paths)))
+  results.missing.watch.push(time(() => watchEach(missingPaths)))
+  results.missing.watchMany.push(time(() => watchAll(missingPaths)))
+}
+
+const milliseconds = {}
+for (const kind in results) {
+  milliseconds[kind] = {
+    watch: Math.min(...results[kind].watch),
+    watchMany: Math.min(...results[kind].watchMany)
+  }
+}
+
+console.log(JSON.stringify({
+  benchmark: 'watch-many',
+  platform: process.platform,
+  paths: fileCount,
+  milliseconds
+}))
+
+fs.rmSync(dir, {recursive: true})
@@ -1,14 +1,32 @@
 {
+  "variables": {
+    # Build bench.node for benchmark/run.js, with
+    # `node-gyp rebuild -- -Dpathwatcher_benchmarks=true`.
+    "pathwatcher_benchmarks%": "false",
+  },
   "targets": [
     {
       "target_name": "pathwatcher",
       "sources": [
         "src/main.cc",
+        "src/change_journal.h",
         "src/common.cc",
         "src/common.h",
+        "src/contents_cache.cc",
+        "src/contents_cache.h",
+        "src/digest.cc",
+        "src/digest.h",
+        "src/directory_scan.cc",
+        "src/directory_scan.h",
+        "src/event_queue.h",
         "src/handle_map.cc",
         "src/handle_map.h",
-        "src/unsafe_persistent.h",
+        "src/path_filter.cc",
+        "src/path_filter.h",
+        "src/path_router.cc",
+        "src/path_router.h",
+        "src/snapshot.cc",
+        "src/snapshot.h",
       ],
       "include_dirs": [
         "src",
@@ -42,9 +60,17 @@
         }],  # OS=="win"
         ['OS=="linux"', {
           "sources": [
+            "src/pathwatcher_fanotify.cc",
+            "src/pathwatcher_fanotify.h",
             "src/pathwatcher_linux.cc",
           ],
         }],  # OS=="linux"
+        ['OS!="win"', {
+          "sources": [
+            "src/pathwatcher_poll.cc",
+            "src/pathwatcher_poll.h",
+          ],
+        }],  # OS!="win"
         ['OS!="win" and OS!="linux"', {
           "sources": [
             "src/pathwatcher_unix.cc",
@@ -52,5 +78,20 @@
         }],  # OS~="unix"
       ],
     }
-  ]
+  ],
+  "conditions": [
+    ['pathwatcher_benchmarks=="true" and OS!="win"', {
+      "targets": [
+        {
+          "target_name": "bench",
+          "sources": [
+            "benchmark/bench.cc",
+          ],
+          "include_dirs": [
+            '<!(node -e "require(\'nan\')")'
+          ],
+        },
+      ],
+    }],
+  ],
 }
@@ -0,0 +1,67 @@
+#ifndef SRC_CHANGE_JOURNAL_H_
+#define SRC_CHANGE_JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+// The paths of the last events an environment received, each numbered in
+// order. A consumer keeps the number after the last change it has seen as its
+// cursor and asks for every path touched since, rather than listening to
+// every event. Only used on the main thread of its environment.
+class ChangeJournal {
+ public:
+  explicit ChangeJournal(size_t capacity)
+      : entries_(capacity),
+        next_(0),
+        valid_from_(0) {}
+
+  // The cursor that comes after everything recorded so far.
+  uint64_t cursor() const { return next_; }
+
+  // Records a change of |path|, and of |old_path| for a rename.
+  void Record(const std::string& path, const std::string& old_path) {
+    Entry& entry = entries_[next_ % entries_.size()];
+    entry.path = path;
+    entry.old_path = old_path;
+    ++next_;
+  }
+
+  // Changes were lost, no cursor handed out so far can be answered.
+  void Invalidate() { valid_from_ = next_; }
+
+  // Adds the paths recorded from |cursor| on to |paths|. Returns false when
+  // some of them are gone, because they have been overwritten or were lost,
+  // or when |cursor| was never handed out.
+  bool ChangesSince(uint64_t cursor, std::set<std::string>* paths) const {
+    uint64_t oldest = next_ > entries_.size() ? next_ - entries_.size() : 0;
+    if (cursor < oldest || cursor < valid_from_ || cursor > next_)
+      return false;
+
+    for (uint64_t i = cursor; i < next_; ++i) {
+      const Entry& entry = entries_[i % entries_.size()];
+      paths->insert(entry.path);
+      if (!entry.old_path.empty())
+        paths->insert(entry.old_path);
+    }
+    return true;
+  }
+
+ private:
+  struct Entry {
+    std::string path;
+    std::string old_path;
+  };
+
+  std::vector<Entry> entries_;
+  uint64_t next_;
+  uint64_t valid_from_;
+
+  ChangeJournal(const ChangeJournal&);
+  ChangeJournal& operator=(const ChangeJournal&);
+};
+
+#endif  // SRC_CHANGE_JOURNAL_H_
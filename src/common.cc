@@ -1,72 +1,568 @@
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+
+#include "change_journal.h"
 #include "common.h"
+#include "contents_cache.h"
+#include "digest.h"
+#include "event_queue.h"
+#include "snapshot.h"
+#ifndef _WIN32
+#include "pathwatcher_poll.h"
+#endif
+
+// Number of events that can be pending for the main thread, the watcher
+// threads only block after they have got this far ahead.
+static const size_t kEventQueueCapacity = 4096;
+
+// Every event is passed to JavaScript as this many consecutive entries of one
+// flat array: type, handle, new path, old path and the number of raw events it
+// stands for.
+static const uint32_t kEventFields = 5;
+
+// While events keep coming, coalesced events are held back for at most this
+// many windows.
+static const uint64_t kMaxCoalesceWindows = 4;
+
+// The latency histogram has a bucket for every power of two microseconds, the
+// last one takes everything longer.
+static const size_t kLatencyBuckets = 24;
+
+// How many of the latest events changesSince() can answer for.
+static const size_t kJournalCapacity = 16384;
+
+// Records in the event ring start with this header: the size of the record,
+// 0 marking the end of the ring, the event type, the handle, the number of
+// raw events and the sizes of the two paths, which follow. Every record is
+// padded to a multiple of 8 bytes.
+static const size_t kRingHeaderSize = 24;
+static const size_t kMinRingCapacity = 64 * 1024;
 
-static uv_async_t g_async;
-static int g_watch_count;
 static uv_sem_t g_semaphore;
 static uv_thread_t g_thread;
 
-static EVENT_TYPE g_type;
-static WatcherHandle g_handle;
-static std::vector<char> g_new_path;
-static std::vector<char> g_old_path;
-static Nan::Persistent<Function> g_callback;
+// Every environment has this many lanes, each a queue of its own. The first
+// one is shared by whoever doesn't ask for another, events are taken from the
+// lanes in turn.
+static size_t g_lane_count;
+static thread_local size_t t_lane = 0;
+
+// An event waiting on the main thread for the coalescing window to pass.
+struct PendingEvent {
+  WatcherEvent event;
+  uint32_t count;
+};
+
+typedef std::pair<EVENT_TYPE, std::vector<char> > MergeKey;
+
+// The event pipeline of one environment, the main thread's or that of a
+// worker the module is loaded in. The watcher threads push to its lanes and
+// wake it through |async|, everything else is only touched on its own thread.
+struct Environment : public std::enable_shared_from_this<Environment> {
+  Environment()
+      : loop(NULL),
+        next_lane(0),
+        queue_full_waiting(false),
+        closed(false),
+        open_handles(0),
+        coalesce_window(0),
+        coalesce_deadline(0),
+        async_watches(0),
+        events_dropped(0),
+        events_delivered(0),
+        batches_delivered(0),
+        journal(kJournalCapacity),
+        ring_data(NULL),
+        ring_capacity(0),
+        ring_head(0),
+        ring_delivering(false) {
+    uv_mutex_init(&queue_full_mutex);
+    uv_cond_init(&queue_full_cond);
+    memset(latency_counts, 0, sizeof(latency_counts));
+  }
+
+  ~Environment() {
+    uv_cond_destroy(&queue_full_cond);
+    uv_mutex_destroy(&queue_full_mutex);
+  }
+
+  uv_loop_t* loop;
+  uv_async_t async;
+  Nan::Persistent<Function> callback;
+
+  std::vector<std::unique_ptr<BoundedQueue<WatcherEvent> > > lanes;
+  size_t next_lane;
+
+  // Used by watcher threads to sleep while a lane is full.
+  uv_mutex_t queue_full_mutex;
+  uv_cond_t queue_full_cond;
+  bool queue_full_waiting;
+
+  // Set under g_routes_lock once the environment is going away, nothing is
+  // pushed to it or woken after that.
+  bool closed;
+  int open_handles;
+
+  // Changes of the same path through the same handle merge into one event, as
+  // long as nothing else happened to that handle in between.
+  std::vector<PendingEvent> pending;
+  std::map<WatcherHandle, std::map<MergeKey, size_t> > mergeable;
+  uint64_t coalesce_window;
+  uint64_t coalesce_deadline;
+  uv_timer_t coalesce_timer;
+
+  // Handles JavaScript has been given and not unwatched yet, the loop is kept
+  // alive while there are any.
+  std::set<WatcherHandle> handles;
+
+  // A watch started in the background can report events before JavaScript
+  // learns its handle. While any is in flight, events for handles JavaScript
+  // doesn't know are held here and handed over once the watch completes.
+  int async_watches;
+  std::map<WatcherHandle, std::vector<WatcherEvent> > held;
+
+  uint64_t events_dropped;
+  uint64_t events_delivered;
+  uint64_t batches_delivered;
+  uint64_t latency_counts[kLatencyBuckets];
+
+  // Every event that reached the main thread, for changesSince().
+  ChangeJournal journal;
+
+  // With setEventRing() events are written to this Buffer, shared with
+  // JavaScript, instead of being turned into strings.
+  Nan::Persistent<Object> ring;
+  char* ring_data;
+  size_t ring_capacity;
+  size_t ring_head;
+  // Set while records are written and handed to the callback, which must not
+  // swap the ring underneath.
+  bool ring_delivering;
+};
+
+typedef std::vector<std::shared_ptr<Environment> > Owners;
+
+struct Route {
+  Route() : stopping(false) {}
+
+  // What was watched, events about the watched path itself come without one.
+  std::string path;
+  Owners owners;
+  // Set while the watch is stopped, after its last owner let go.
+  bool stopping;
+};
+
+// Which environments watch a handle. The same kernel watch can be handed to
+// several of them, inotify gives every path of one inode the same descriptor,
+// and it is only stopped once the last of them lets go. Watcher threads take
+// the lock for reading to post, environments take it for writing to change
+// what they watch or to go away.
+static uv_rwlock_t g_routes_lock;
+static std::map<WatcherHandle, Route> g_routes;
+// Starts in flight, and the handles stopped since the oldest of them began,
+// both under g_routes_lock. A start can be handed the handle of a watch that
+// is stopped meanwhile, inotify gives every path of the inode its descriptor
+// until it is removed, and then starts again rather than keep a dead watch.
+static size_t g_starts_running = 0;
+static std::set<WatcherHandle> g_stopped;
+// Signalled whenever a watch has been stopped.
+static uv_mutex_t g_stops_mutex;
+static uv_cond_t g_stops_cond;
+static std::vector<std::shared_ptr<Environment> > g_environments;
+static thread_local Owners t_owners;
+
+// Run when the main thread's environment goes away.
+static std::vector<std::pair<void (*)(void*), void*> > g_exit_hooks;
+
+// The counters of one thread, on a cache line of its own. Only the thread
+// writes them, getStats() reads them all. They live as long as the process,
+// so what exited threads counted isn't lost.
+struct alignas(64) ThreadStats {
+  ThreadStats() {
+    for (size_t i = 0; i < STAT_COUNTER_COUNT; ++i)
+      counters[i].store(0, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> counters[STAT_COUNTER_COUNT];
+};
+
+static std::vector<ThreadStats*> g_thread_stats;
+static uv_mutex_t g_thread_stats_mutex;
+static thread_local ThreadStats* t_stats = NULL;
+static thread_local uint64_t t_read_at = 0;
+
+// Whether a watch uses the polling backend: when the `poll` option asks for
+// it, or by default when the filesystem of the path calls for it.
+enum PollMode {
+  POLL_AUTO,
+  POLL_ALWAYS,
+  POLL_NEVER,
+};
 
 static void CommonThread(void* handle) {
   WaitForMainThread();
   PlatformThread();
 }
 
+static Local<String> EventTypeToV8String(EVENT_TYPE type) {
+  switch (type) {
+    case EVENT_CHANGE:
+      return Nan::New("change").ToLocalChecked();
+    case EVENT_DELETE:
+      return Nan::New("delete").ToLocalChecked();
+    case EVENT_RENAME:
+      return Nan::New("rename").ToLocalChecked();
+    case EVENT_CHILD_CREATE:
+      return Nan::New("child-create").ToLocalChecked();
+    case EVENT_CHILD_CHANGE:
+      return Nan::New("child-change").ToLocalChecked();
+    case EVENT_CHILD_DELETE:
+      return Nan::New("child-delete").ToLocalChecked();
+    case EVENT_CHILD_RENAME:
+      return Nan::New("child-rename").ToLocalChecked();
+    case EVENT_OVERFLOW:
+      return Nan::New("overflow").ToLocalChecked();
+    default:
+      return Local<String>();
+  }
+}
+
+static void WakeupFullQueueWaiters(Environment* env) {
+  uv_mutex_lock(&env->queue_full_mutex);
+  if (env->queue_full_waiting) {
+    env->queue_full_waiting = false;
+    uv_cond_broadcast(&env->queue_full_cond);
+  }
+  uv_mutex_unlock(&env->queue_full_mutex);
+}
+
+static Environment* GetEnvironment(const Nan::FunctionCallbackInfo<Value>& info) {
+  return static_cast<Environment*>(info.Data().As<External>()->Value());
+}
+
+static ThreadStats* GetThreadStats() {
+  if (t_stats == NULL) {
+    t_stats = new ThreadStats;
+    uv_mutex_lock(&g_thread_stats_mutex);
+    g_thread_stats.push_back(t_stats);
+    uv_mutex_unlock(&g_thread_stats_mutex);
+  }
+  return t_stats;
+}
+
+void CountStat(STAT_COUNTER counter, uint64_t amount) {
+  // Nobody else writes it, so there is no need for a locked add.
+  std::atomic<uint64_t>& value = GetThreadStats()->counters[counter];
+  value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+uint64_t PostedEvents() {
+  return GetThreadStats()->counters[STAT_EVENTS_POSTED].load(std::memory_order_relaxed);
+}
+
+void CountRawEvent(uint64_t posted_before) {
+  CountStat(STAT_EVENTS_READ);
+  if (PostedEvents() == posted_before)
+    CountStat(STAT_EVENTS_IGNORED);
+}
+
+void SetEventReadTime(uint64_t read_at) {
+  t_read_at = read_at;
+}
+
+uint64_t EventReadTime() {
+  return t_read_at;
+}
+
+static void RecordLatency(Environment* env, uint64_t nanoseconds) {
+  size_t bucket = 0;
+  for (uint64_t microseconds = nanoseconds / 1000;
+       microseconds > 0 && bucket < kLatencyBuckets - 1;
+       microseconds >>= 1)
+    ++bucket;
+  ++env->latency_counts[bucket];
+}
+
+// Events about a watched path itself come without the path, look it up.
+static std::string RoutePath(WatcherHandle handle) {
+  std::string path;
+  uv_rwlock_rdlock(&g_routes_lock);
+  std::map<WatcherHandle, Route>::const_iterator route = g_routes.find(handle);
+  if (route != g_routes.end())
+    path = route->second.path;
+  uv_rwlock_rdunlock(&g_routes_lock);
+  return path;
+}
+
+static void JournalEvent(Environment* env, const WatcherEvent& event) {
+  if (event.type == EVENT_OVERFLOW) {
+    env->journal.Invalidate();
+    return;
+  }
+
+  std::string path = event.new_path.empty()
+      ? RoutePath(event.handle)
+      : std::string(event.new_path.data(), event.new_path.size());
+  env->journal.Record(path, std::string(event.old_path.data(), event.old_path.size()));
+}
+
+static void CoalesceEvent(Environment* env, WatcherEvent* event) {
+  // Merged or not, the change is in the journal before anyone can ask.
+  JournalEvent(env, *event);
+
+  // Creations, deletions and renames are kept in order, nothing merges across
+  // them.
+  if (env->coalesce_window > 0) {
+    if (event->type != EVENT_CHANGE && event->type != EVENT_CHILD_CHANGE) {
+      env->mergeable.erase(event->handle);
+    } else {
+      std::map<MergeKey, size_t>& mergeable = env->mergeable[event->handle];
+      MergeKey key(event->type, event->new_path);
+      std::map<MergeKey, size_t>::const_iterator iter = mergeable.find(key);
+      if (iter != mergeable.end()) {
+        env->pending[iter->second].count++;
+        return;
+      }
+      mergeable[key] = env->pending.size();
+    }
+  }
+
+  env->pending.push_back(PendingEvent());
+  PendingEvent& pending = env->pending.back();
+  pending.event.type = event->type;
+  pending.event.handle = event->handle;
+  pending.event.new_path.swap(event->new_path);
+  pending.event.old_path.swap(event->old_path);
+  pending.event.read_at = event->read_at;
+  pending.count = 1;
+}
+
+// A merged event is as late as the first change it stands for.
+static void CountDelivery(Environment* env, const std::vector<PendingEvent>& pending, uint64_t events) {
+  uint64_t now = uv_hrtime();
+  for (size_t i = 0; i < pending.size(); ++i)
+    RecordLatency(env, now - pending[i].event.read_at);
+  env->events_delivered += events;
+  ++env->batches_delivered;
+}
+
+#ifndef _WIN32
+static inline size_t RingRecordSize(const WatcherEvent& event) {
+  return (kRingHeaderSize + event.new_path.size() + event.old_path.size() + 7) & ~static_cast<size_t>(7);
+}
+
+// Calls back with where the records written since |start| begin and end.
+static bool FlushRing(Environment* env, size_t start) {
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Value> argv[] = {
+    Nan::New<Number>(static_cast<double>(start)),
+    Nan::New<Number>(static_cast<double>(env->ring_head)),
+  };
+  Local<Value> result;
+  return Nan::New(env->callback)->Call(context, context->Global(), 2, argv).ToLocal(&result);
+}
+
+// Writes |pending| to the ring after what was delivered before, which stays
+// readable until the ring comes around to it again. The callback is called
+// whenever the next record would overwrite what it hasn't seen yet.
+static void DeliverToRing(Environment* env, const std::vector<PendingEvent>& pending) {
+  uint64_t delivered = 0;
+  size_t start = env->ring_head;
+  size_t written = 0;
+  env->ring_delivering = true;
+  for (size_t i = 0; i < pending.size(); ++i) {
+    const WatcherEvent& event = pending[i].event;
+    size_t size = RingRecordSize(event);
+    if (event.type == EVENT_NONE || size > env->ring_capacity / 2) {
+      ++env->events_dropped;
+      continue;
+    }
+
+    // Records never wrap, what is left at the end of the ring is skipped.
+    size_t skipped = env->ring_head + size > env->ring_capacity ? env->ring_capacity - env->ring_head : 0;
+    if (written + skipped + size >= env->ring_capacity) {
+      if (!FlushRing(env, start)) {
+        // The callback threw, what it didn't get to is lost.
+        env->events_dropped += pending.size() - i;
+        written = 0;
+        break;
+      }
+      start = env->ring_head;
+      written = 0;
+    }
+    if (env->ring_head + size > env->ring_capacity) {
+      memset(env->ring_data + env->ring_head, 0, sizeof(uint32_t));
+      written += env->ring_capacity - env->ring_head;
+      env->ring_head = 0;
+    }
+
+    char* record = env->ring_data + env->ring_head;
+    uint32_t header[6] = {
+      static_cast<uint32_t>(size),
+      static_cast<uint32_t>(event.type),
+      static_cast<uint32_t>(event.handle),
+      pending[i].count,
+      static_cast<uint32_t>(event.new_path.size()),
+      static_cast<uint32_t>(event.old_path.size()),
+    };
+    memcpy(record, header, sizeof(header));
+    if (!event.new_path.empty())
+      memcpy(record + kRingHeaderSize, event.new_path.data(), event.new_path.size());
+    if (!event.old_path.empty())
+      memcpy(record + kRingHeaderSize + event.new_path.size(), event.old_path.data(), event.old_path.size());
+    env->ring_head = (env->ring_head + size) % env->ring_capacity;
+    written += size;
+    ++delivered;
+  }
+
+  if (delivered > 0)
+    CountDelivery(env, pending, delivered);
+  if (written > 0)
+    FlushRing(env, start);
+  env->ring_delivering = false;
+}
+#endif
+
+static void DeliverPendingEvents(Environment* env) {
+  Nan::HandleScope scope;
+
+  std::vector<PendingEvent> pending;
+  pending.swap(env->pending);
+  env->mergeable.clear();
+  if (pending.empty())
+    return;
+  if (env->callback.IsEmpty()) {
+    env->events_dropped += pending.size();
+    return;
+  }
+
+#ifndef _WIN32
+  if (env->ring_capacity > 0) {
+    DeliverToRing(env, pending);
+    return;
+  }
+#endif
+
+  Local<Array> events = Nan::New<Array>();
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  uint32_t index = 0;
+  for (size_t i = 0; i < pending.size(); ++i) {
+    const WatcherEvent& event = pending[i].event;
+    Local<String> type = EventTypeToV8String(event.type);
+    if (type.IsEmpty())
+      continue;
+
+    events->Set(context, index++, type).FromJust();
+    events->Set(context, index++, WatcherHandleToV8Value(event.handle)).FromJust();
+    events->Set(context, index++,
+                Nan::New(event.new_path.data(),
+                         event.new_path.size()).ToLocalChecked()).FromJust();
+    events->Set(context, index++,
+                Nan::New(event.old_path.data(),
+                         event.old_path.size()).ToLocalChecked()).FromJust();
+    events->Set(context, index++, Nan::New<Uint32>(pending[i].count)).FromJust();
+  }
+
+  if (index > 0) {
+    CountDelivery(env, pending, index / kEventFields);
+
+    // The call comes back empty when the callback threw or a worker is being
+    // terminated, either way there is nothing more to do.
+    Local<Value> argv[] = { events };
+    Local<Value> result;
+    if (!Nan::New(env->callback)->Call(context, context->Global(), 1, argv).ToLocal(&result))
+      return;
+  }
+}
+
+#if NODE_VERSION_AT_LEAST(0, 11, 13)
+static void DeliverCoalescedEvents(uv_timer_t* timer) {
+#else
+static void DeliverCoalescedEvents(uv_timer_t* timer, int status) {
+#endif
+  DeliverPendingEvents(static_cast<Environment*>(timer->data));
+}
+
+static void ScheduleDelivery(Environment* env, bool had_pending);
+
+// Takes the next event, starting at another lane every time so a thread that
+// posts a lot can't keep the others waiting.
+static bool PopEvent(Environment* env, WatcherEvent* event) {
+  for (size_t tried = 0; tried < env->lanes.size(); ++tried) {
+    BoundedQueue<WatcherEvent>& lane = *env->lanes[env->next_lane];
+    env->next_lane = (env->next_lane + 1) % env->lanes.size();
+    if (lane.TryPop(event))
+      return true;
+  }
+  return false;
+}
+
 #if NODE_VERSION_AT_LEAST(0, 11, 13)
 static void MakeCallbackInMainThread(uv_async_t* handle) {
 #else
 static void MakeCallbackInMainThread(uv_async_t* handle, int status) {
 #endif
-  Nan::HandleScope scope;
+  Environment* env = static_cast<Environment*>(handle->data);
+  bool had_pending = !env->pending.empty();
 
-  if (!g_callback.IsEmpty()) {
-    Local<String> type;
-    switch (g_type) {
-      case EVENT_CHANGE:
-        type = Nan::New("change").ToLocalChecked();
-        break;
-      case EVENT_DELETE:
-        type = Nan::New("delete").ToLocalChecked();
-        break;
-      case EVENT_RENAME:
-        type = Nan::New("rename").ToLocalChecked();
-        break;
-      case EVENT_CHILD_CREATE:
-        type = Nan::New("child-create").ToLocalChecked();
-        break;
-      case EVENT_CHILD_CHANGE:
-        type = Nan::New("child-change").ToLocalChecked();
-        break;
-      case EVENT_CHILD_DELETE:
-        type = Nan::New("child-delete").ToLocalChecked();
-        break;
-      case EVENT_CHILD_RENAME:
-        type = Nan::New("child-rename").ToLocalChecked();
-        break;
-      default:
-        type = Nan::New("unknown").ToLocalChecked();
-        return;
+  // Drain at most one queue worth of events per wakeup so busy watcher
+  // threads can't keep us in here forever, and come back for the rest.
+  bool has_callback = !env->callback.IsEmpty();
+  size_t drained = 0;
+  WatcherEvent event;
+  while (drained < kEventQueueCapacity && PopEvent(env, &event)) {
+    ++drained;
+    if (env->async_watches > 0 && env->handles.count(event.handle) == 0) {
+      env->held[event.handle].push_back(std::move(event));
+      continue;
     }
+    if (event.type == EVENT_OVERFLOW)
+      RescanWatch(event.handle);
+    if (has_callback)
+      CoalesceEvent(env, &event);
+    else
+      ++env->events_dropped;
+  }
 
-    Local<Value> argv[] = {
-        type,
-        WatcherHandleToV8Value(g_handle),
-        Nan::New(g_new_path.data(), g_new_path.size()).ToLocalChecked(),
-        Nan::New(g_old_path.data(), g_old_path.size()).ToLocalChecked(),
-    };
-    Local<v8::Context> context = Nan::GetCurrentContext();
-    Nan::New(g_callback)->Call(context, context->Global(), 4, argv).ToLocalChecked();
+  WakeupFullQueueWaiters(env);
+  if (drained == kEventQueueCapacity)
+    uv_async_send(&env->async);
+
+  FlushSnapshots();
+  ScheduleDelivery(env, had_pending);
+}
+
+// Delivers what was coalesced right away, or once the window has passed.
+static void ScheduleDelivery(Environment* env, bool had_pending) {
+  if (env->coalesce_window == 0) {
+    DeliverPendingEvents(env);
+    return;
   }
 
-  WakeupNewThread();
+  if (env->pending.empty())
+    return;
+
+  // Wait for the window to pass without new events, but don't hold back the
+  // first of them for more than a few windows.
+  uint64_t now = uv_now(env->loop);
+  if (!had_pending)
+    env->coalesce_deadline = now + kMaxCoalesceWindows * env->coalesce_window;
+  uint64_t timeout = env->coalesce_deadline > now ? env->coalesce_deadline - now : 0;
+  if (timeout > env->coalesce_window)
+    timeout = env->coalesce_window;
+  uv_timer_start(&env->coalesce_timer, DeliverCoalescedEvents, timeout, 0);
 }
 
-static void SetRef(bool value) {
-  uv_handle_t* h = reinterpret_cast<uv_handle_t*>(&g_async);
+static void SetRef(Environment* env, bool value) {
+  uv_handle_t* h = reinterpret_cast<uv_handle_t*>(&env->async);
   if (value) {
     uv_ref(h);
   } else {
@@ -75,35 +571,222 @@ static void SetRef(bool value) {
 }
 
 void CommonInit() {
+  uv_mutex_init(&g_thread_stats_mutex);
+  uv_rwlock_init(&g_routes_lock);
+  uv_mutex_init(&g_stops_mutex);
+  uv_cond_init(&g_stops_cond);
   uv_sem_init(&g_semaphore, 0);
-  uv_async_init(uv_default_loop(), &g_async, MakeCallbackInMainThread);
+  AddEventLane();
+#ifndef _WIN32
+  PollInit();
+#endif
+  uv_thread_create(&g_thread, &CommonThread, NULL);
+}
+
+static void StopUnusedWatch(WatcherHandle handle);
+
+static void CloseEnvironmentHandle(uv_handle_t* handle) {
+  Environment* env = static_cast<Environment*>(handle->data);
+  if (--env->open_handles > 0)
+    return;
+
+  // Watcher threads still waiting for room in its lanes hold on to it until
+  // they see it closed.
+  uv_rwlock_wrlock(&g_routes_lock);
+  for (size_t i = 0; i < g_environments.size(); ++i) {
+    if (g_environments[i].get() == env) {
+      g_environments.erase(g_environments.begin() + i);
+      break;
+    }
+  }
+  uv_rwlock_wrunlock(&g_routes_lock);
+}
+
+#if NODE_VERSION_AT_LEAST(10, 2, 0)
+static void CleanupEnvironment(void* arg) {
+  Environment* env = static_cast<Environment*>(arg);
+
+  // Stop posting to it, and stop the watches nobody else has.
+  std::vector<WatcherHandle> unused;
+  uv_rwlock_wrlock(&g_routes_lock);
+  env->closed = true;
+  std::map<WatcherHandle, Route>::iterator route = g_routes.begin();
+  while (route != g_routes.end()) {
+    Owners& owners = route->second.owners;
+    for (size_t i = 0; i < owners.size(); ++i) {
+      if (owners[i].get() == env) {
+        owners.erase(owners.begin() + i);
+        break;
+      }
+    }
+    if (owners.empty())
+      unused.push_back(route->first);
+    ++route;
+  }
+  uv_rwlock_wrunlock(&g_routes_lock);
+
+  WakeupFullQueueWaiters(env);
+  for (size_t i = 0; i < unused.size(); ++i)
+    StopUnusedWatch(unused[i]);
+
+  env->callback.Reset();
+  env->ring.Reset();
+  env->ring_capacity = 0;
+  env->pending.clear();
+  env->held.clear();
+  env->open_handles = 2;
+  uv_close(reinterpret_cast<uv_handle_t*>(&env->async), CloseEnvironmentHandle);
+  uv_close(reinterpret_cast<uv_handle_t*>(&env->coalesce_timer), CloseEnvironmentHandle);
+
+  // Only the process exiting takes the main thread's environment away, the
+  // watcher threads are done then.
+  if (env->loop == uv_default_loop()) {
+    for (size_t i = 0; i < g_exit_hooks.size(); ++i)
+      g_exit_hooks[i].first(g_exit_hooks[i].second);
+  }
+}
+#endif
+
+Local<Value> CommonInitEnvironment() {
+  std::shared_ptr<Environment> env(new Environment);
+  env->loop = Nan::GetCurrentEventLoop();
+  uv_async_init(env->loop, &env->async, MakeCallbackInMainThread);
+  env->async.data = env.get();
+  uv_timer_init(env->loop, &env->coalesce_timer);
+  env->coalesce_timer.data = env.get();
+  uv_unref(reinterpret_cast<uv_handle_t*>(&env->coalesce_timer));
   // As long as any uv_ref'd uv_async_t handle remains active, the node
   // process will never exit, so we must call uv_unref here (#47).
-  SetRef(false);
-  g_watch_count = 0;
-  uv_thread_create(&g_thread, &CommonThread, NULL);
+  SetRef(env.get(), false);
+
+  for (size_t i = 0; i < g_lane_count; ++i) {
+    env->lanes.push_back(std::unique_ptr<BoundedQueue<WatcherEvent> >(
+        new BoundedQueue<WatcherEvent>(kEventQueueCapacity)));
+  }
+
+  uv_rwlock_wrlock(&g_routes_lock);
+  g_environments.push_back(env);
+  uv_rwlock_wrunlock(&g_routes_lock);
+
+#if NODE_VERSION_AT_LEAST(10, 2, 0)
+  node::AddEnvironmentCleanupHook(v8::Isolate::GetCurrent(), CleanupEnvironment, env.get());
+#endif
+  return Nan::New<External>(env.get());
+}
+
+void AddExitHook(void (*hook)(void*), void* arg) {
+  g_exit_hooks.push_back(std::make_pair(hook, arg));
+}
+
+size_t AddEventLane() {
+  return g_lane_count++;
+}
+
+void SetEventLane(size_t lane) {
+  t_lane = lane;
 }
 
 void WaitForMainThread() {
+  uint64_t start = uv_hrtime();
   uv_sem_wait(&g_semaphore);
+  CountStat(STAT_BLOCKED_NS, uv_hrtime() - start);
 }
 
 void WakeupNewThread() {
   uv_sem_post(&g_semaphore);
 }
 
-void PostEventAndWait(EVENT_TYPE type,
-                      WatcherHandle handle,
-                      const std::vector<char>& new_path,
-                      const std::vector<char>& old_path) {
-  // FIXME should not pass args by settings globals.
-  g_type = type;
-  g_handle = handle;
-  g_new_path = new_path;
-  g_old_path = old_path;
+// Hands |event| to |env|. Called with g_routes_lock held for reading, which
+// is let go while the main thread of |env| makes room in a full lane.
+static void PushEvent(Environment* env, WatcherEvent* event) {
+  BoundedQueue<WatcherEvent>& queue = *env->lanes[t_lane];
+  while (!env->closed && !queue.TryPush(*event)) {
+    // The main thread is a whole queue behind, sleep until it catches up.
+    // The waiting flag is set before the lock is let go, so an environment
+    // going away in the meantime still wakes us.
+    uint64_t start = uv_hrtime();
+    uv_mutex_lock(&env->queue_full_mutex);
+    env->queue_full_waiting = true;
+    uv_async_send(&env->async);
+    uv_rwlock_rdunlock(&g_routes_lock);
+    while (env->queue_full_waiting && queue.IsFull())
+      uv_cond_wait(&env->queue_full_cond, &env->queue_full_mutex);
+    uv_mutex_unlock(&env->queue_full_mutex);
+    uv_rwlock_rdlock(&g_routes_lock);
+    CountStat(STAT_BLOCKED_NS, uv_hrtime() - start);
+  }
+
+  // uv_async_send coalesces, so a burst of events costs a single wakeup.
+  if (!env->closed)
+    uv_async_send(&env->async);
+}
+
+// What was cached about a path is stale before anyone hears of its change.
+static void InvalidateCaches(const char* path, size_t length) {
+  InvalidateDigests(path, length);
+  InvalidateContents(path, length);
+}
 
-  uv_async_send(&g_async);
-  WaitForMainThread();
+static void ClearCaches() {
+  ClearDigests();
+  ClearContents();
+}
+
+bool IsPathWatched(const char* path) {
+  bool watched = false;
+  uv_rwlock_rdlock(&g_routes_lock);
+  for (std::map<WatcherHandle, Route>::const_iterator route = g_routes.begin();
+       route != g_routes.end() && !watched; ++route) {
+#ifndef _WIN32
+    if (IsPollHandle(route->first))
+      continue;
+#endif
+    watched = !route->second.owners.empty() && route->second.path == path;
+  }
+  uv_rwlock_rdunlock(&g_routes_lock);
+  return watched;
+}
+
+void PostEvent(EVENT_TYPE type,
+               WatcherHandle handle,
+               const std::vector<char>& new_path,
+               const std::vector<char>& old_path) {
+  RecordEvent(type, handle, new_path, old_path);
+
+  WatcherEvent event;
+  event.type = type;
+  event.handle = handle;
+  event.new_path = new_path;
+  event.old_path = old_path;
+  event.read_at = t_read_at != 0 ? t_read_at : uv_hrtime();
+  CountStat(STAT_EVENTS_POSTED);
+
+  if (type == EVENT_OVERFLOW)
+    ClearCaches();
+  if (!new_path.empty())
+    InvalidateCaches(new_path.data(), new_path.size());
+  if (!old_path.empty())
+    InvalidateCaches(old_path.data(), old_path.size());
+
+  // Every environment watching the handle gets the event, those that don't
+  // are never woken for it.
+  uv_rwlock_rdlock(&g_routes_lock);
+  std::map<WatcherHandle, Route>::const_iterator route = g_routes.find(handle);
+  if (route != g_routes.end()) {
+    t_owners = route->second.owners;
+    if (new_path.empty())
+      InvalidateCaches(route->second.path.data(), route->second.path.size());
+  }
+  for (size_t i = 0; i < t_owners.size(); ++i) {
+    if (i + 1 < t_owners.size()) {
+      WatcherEvent copy(event);
+      PushEvent(t_owners[i].get(), &copy);
+    } else {
+      PushEvent(t_owners[i].get(), &event);
+    }
+  }
+  uv_rwlock_rdunlock(&g_routes_lock);
+  t_owners.clear();
 }
 
 NAN_METHOD(SetCallback) {
@@ -112,46 +795,538 @@ NAN_METHOD(SetCallback) {
   if (!info[0]->IsFunction())
     return Nan::ThrowTypeError("Function required");
 
-  g_callback.Reset(Local<Function>::Cast(info[0]));
+  GetEnvironment(info)->callback.Reset(Local<Function>::Cast(info[0]));
   return;
 }
 
-NAN_METHOD(Watch) {
+NAN_METHOD(SetCoalesceWindow) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsNumber() || info[0]->NumberValue(Nan::GetCurrentContext()).FromJust() < 0)
+    return Nan::ThrowTypeError("Non-negative number required");
+
+  Environment* env = GetEnvironment(info);
+  env->coalesce_window = static_cast<uint64_t>(
+      info[0]->NumberValue(Nan::GetCurrentContext()).FromJust());
+
+  // Whatever was held back under the old window goes out right away.
+  if (!env->pending.empty())
+    uv_timer_start(&env->coalesce_timer, DeliverCoalescedEvents, 0, 0);
+  return;
+}
+
+NAN_METHOD(SetEventRing) {
   Nan::HandleScope scope;
 
+  if (!info[0]->IsNumber() || info[0]->NumberValue(Nan::GetCurrentContext()).FromJust() < 0)
+    return Nan::ThrowTypeError("Non-negative number required");
+
+#ifdef _WIN32
+  return Nan::ThrowError("The event ring isn't supported on Windows");
+#else
+  Environment* env = GetEnvironment(info);
+  size_t capacity = static_cast<size_t>(info[0]->NumberValue(Nan::GetCurrentContext()).FromJust());
+  if (env->ring_delivering)
+    return Nan::ThrowError("The event ring can't be changed while it is being read");
+
+  // Whatever is held back is delivered the way the callback expects it now.
+  DeliverPendingEvents(env);
+  env->ring.Reset();
+  env->ring_data = NULL;
+  env->ring_capacity = 0;
+  env->ring_head = 0;
+  if (capacity == 0)
+    return;
+
+  capacity = (std::max(capacity, kMinRingCapacity) + 7) & ~static_cast<size_t>(7);
+  Local<Object> ring;
+  if (!Nan::NewBuffer(capacity).ToLocal(&ring))
+    return;
+  env->ring.Reset(ring);
+  env->ring_data = node::Buffer::Data(ring);
+  env->ring_capacity = capacity;
+  info.GetReturnValue().Set(ring);
+#endif
+}
+
+// Compiles the array of patterns under |name| in |options| into |matcher|,
+// returns false when it isn't an array of strings.
+static bool AddPatterns(Local<Object> options, const char* name, PathMatcher* matcher) {
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Value> value =
+      options->Get(context, Nan::New(name).ToLocalChecked()).ToLocalChecked();
+  if (value->IsUndefined() || value->IsNull())
+    return true;
+  if (!value->IsArray())
+    return false;
+
+  Local<Array> patterns = Local<Array>::Cast(value);
+  for (uint32_t i = 0; i < patterns->Length(); ++i) {
+    Local<Value> pattern = patterns->Get(context, i).ToLocalChecked();
+    if (!pattern->IsString())
+      return false;
+    matcher->Add(*String::Utf8Value(v8::Isolate::GetCurrent(), pattern));
+  }
+  return true;
+}
+
+// Reads the `ignore`, `include`, `rescanOnOverflow`, `snapshotFile` and `poll`
+// options, throws and returns false when they are malformed.
+static bool ParseWatchOptions(Local<Value> value,
+                              PathFilterPtr* filter,
+                              TrackOptions* track,
+                              PollMode* poll) {
+  *track = TrackOptions();
+  *poll = POLL_AUTO;
+  if (!value->IsObject())
+    return true;
+
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Object> options = value->ToObject(context).ToLocalChecked();
+  track->rescan_on_overflow = options->Get(
+      context, Nan::New("rescanOnOverflow").ToLocalChecked()).ToLocalChecked()->IsTrue();
+  Local<Value> file_value =
+      options->Get(context, Nan::New("snapshotFile").ToLocalChecked()).ToLocalChecked();
+  if (file_value->IsString()) {
+    track->file = *String::Utf8Value(v8::Isolate::GetCurrent(), file_value);
+  } else if (!file_value->IsUndefined() && !file_value->IsNull()) {
+    Nan::ThrowTypeError("String required for snapshotFile");
+    return false;
+  }
+  Local<Value> poll_value =
+      options->Get(context, Nan::New("poll").ToLocalChecked()).ToLocalChecked();
+  if (poll_value->IsTrue())
+    *poll = POLL_ALWAYS;
+  else if (poll_value->IsFalse())
+    *poll = POLL_NEVER;
+  std::shared_ptr<PathFilter> compiled(new PathFilter);
+  if (!AddPatterns(options, "ignore", &compiled->ignore) ||
+      !AddPatterns(options, "include", &compiled->include)) {
+    Nan::ThrowTypeError("Array of patterns required");
+    return false;
+  }
+  if (!compiled->ignore.empty() || !compiled->include.empty())
+    *filter = compiled;
+  return true;
+}
+
+// Starts watching |path| with the platform's backend or the polling one.
+static WatcherHandle StartWatch(WatcherHandle (*platform_watch)(const char*, const PathFilterPtr&),
+                                const char* path,
+                                bool recursive,
+                                const PathFilterPtr& filter,
+                                PollMode poll) {
+#ifndef _WIN32
+  if (poll == POLL_ALWAYS || (poll == POLL_AUTO && ShouldPoll(path)))
+    return recursive ? PollWatchTree(path, filter) : PollWatch(path, filter);
+#endif
+  return platform_watch(path, filter);
+}
+
+static void StopWatch(WatcherHandle handle) {
+#ifndef _WIN32
+  if (IsPollHandle(handle))
+    return PollUnwatch(handle);
+#endif
+  PlatformUnwatch(handle);
+}
+
+static void UntrackAndStopWatch(WatcherHandle handle) {
+  UntrackWatch(handle);
+  StopWatch(handle);
+}
+
+static bool IsWatchStopping(WatcherHandle handle) {
+  uv_rwlock_rdlock(&g_routes_lock);
+  std::map<WatcherHandle, Route>::const_iterator route = g_routes.find(handle);
+  bool stopping = route != g_routes.end() && route->second.stopping;
+  uv_rwlock_rdunlock(&g_routes_lock);
+  return stopping;
+}
+
+static void WaitForStoppedWatch(WatcherHandle handle) {
+  uv_mutex_lock(&g_stops_mutex);
+  while (IsWatchStopping(handle))
+    uv_cond_wait(&g_stops_cond, &g_stops_mutex);
+  uv_mutex_unlock(&g_stops_mutex);
+}
+
+enum RouteResult { ROUTE_ADDED, ROUTE_CLOSED, ROUTE_STALE };
+
+// Routes the events of |handle|, the watch of |path|, to |env| from now on.
+// Returns ROUTE_STALE when the watch was stopped while it was started, and
+// ROUTE_CLOSED when the environment is going away; the watch is then left
+// with a route of its own when nobody has it, for StopUnusedWatch to stop.
+static RouteResult AddRoute(Environment* env, WatcherHandle handle, const char* path) {
+  uv_rwlock_wrlock(&g_routes_lock);
+  std::map<WatcherHandle, Route>::iterator stopping = g_routes.find(handle);
+  while (stopping != g_routes.end() && stopping->second.stopping) {
+    uv_rwlock_wrunlock(&g_routes_lock);
+    WaitForStoppedWatch(handle);
+    uv_rwlock_wrlock(&g_routes_lock);
+    stopping = g_routes.find(handle);
+  }
+
+  RouteResult result = ROUTE_ADDED;
+  if (g_stopped.count(handle) > 0) {
+    result = ROUTE_STALE;
+  } else {
+    Route& route = g_routes[handle];
+    if (route.owners.empty())
+      route.path = path;
+    if (env->closed) {
+      result = ROUTE_CLOSED;
+    } else {
+      Owners& owners = route.owners;
+      bool known = false;
+      for (size_t i = 0; i < owners.size() && !known; ++i)
+        known = owners[i].get() == env;
+      if (!known)
+        owners.push_back(env->shared_from_this());
+    }
+  }
+  uv_rwlock_wrunlock(&g_routes_lock);
+  return result;
+}
+
+// Stops |handle| and drops its route, unless an environment took the watch
+// again since its last owner let go or it is being stopped already. Only the
+// route is locked, a start handed the handle meanwhile finds it stopping.
+static void StopUnusedWatch(WatcherHandle handle) {
+  uv_rwlock_wrlock(&g_routes_lock);
+  std::map<WatcherHandle, Route>::iterator route = g_routes.find(handle);
+  bool unused = route != g_routes.end() && route->second.owners.empty() &&
+                !route->second.stopping;
+  if (unused)
+    route->second.stopping = true;
+  uv_rwlock_wrunlock(&g_routes_lock);
+  if (!unused)
+    return;
+
+  UntrackAndStopWatch(handle);
+
+  uv_rwlock_wrlock(&g_routes_lock);
+  g_routes.erase(handle);
+  if (g_starts_running > 0)
+    g_stopped.insert(handle);
+  uv_rwlock_wrunlock(&g_routes_lock);
+
+  uv_mutex_lock(&g_stops_mutex);
+  uv_cond_broadcast(&g_stops_cond);
+  uv_mutex_unlock(&g_stops_mutex);
+}
+
+// Stops routing the events of |handle| to |env|, and stops the watch when no
+// other environment has it.
+static void ReleaseWatch(Environment* env, WatcherHandle handle) {
+  uv_rwlock_wrlock(&g_routes_lock);
+  bool unused = false;
+  std::map<WatcherHandle, Route>::iterator route = g_routes.find(handle);
+  if (route != g_routes.end()) {
+    Owners& owners = route->second.owners;
+    for (size_t i = 0; i < owners.size(); ++i) {
+      if (owners[i].get() == env) {
+        owners.erase(owners.begin() + i);
+        unused = owners.empty();
+        break;
+      }
+    }
+  }
+  uv_rwlock_wrunlock(&g_routes_lock);
+
+  if (unused)
+    StopUnusedWatch(handle);
+}
+
+// Starts a watch for |env| and routes its events there, on any thread.
+static WatcherHandle StartRoutedWatch(Environment* env,
+                                      WatcherHandle (*platform_watch)(const char*, const PathFilterPtr&),
+                                      const char* path,
+                                      bool recursive,
+                                      const PathFilterPtr& filter,
+                                      PollMode poll) {
+  uv_rwlock_wrlock(&g_routes_lock);
+  ++g_starts_running;
+  uv_rwlock_wrunlock(&g_routes_lock);
+
+  // A stale handle is kept until the watch started again, kqueue and Windows
+  // would hand out the same number otherwise.
+  std::vector<WatcherHandle> stale;
+  WatcherHandle handle;
+  RouteResult result = ROUTE_ADDED;
+  for (;;) {
+    handle = StartWatch(platform_watch, path, recursive, filter, poll);
+    if (!PlatformIsHandleValid(handle))
+      break;
+    result = AddRoute(env, handle, path);
+    if (result != ROUTE_STALE)
+      break;
+    stale.push_back(handle);
+  }
+  for (size_t i = 0; i < stale.size(); ++i)
+    StopWatch(stale[i]);
+
+  uv_rwlock_wrlock(&g_routes_lock);
+  if (--g_starts_running == 0)
+    g_stopped.clear();
+  uv_rwlock_wrunlock(&g_routes_lock);
+
+  if (PlatformIsHandleValid(handle) && result == ROUTE_CLOSED)
+    StopUnusedWatch(handle);
+  return handle;
+}
+
+// Watches |path|, returns 0 or the error number of why it can't be.
+static int WatchPath(Environment* env,
+                     WatcherHandle (*platform_watch)(const char*, const PathFilterPtr&),
+                     const char* path,
+                     bool recursive,
+                     const PathFilterPtr& filter,
+                     const TrackOptions& track,
+                     PollMode poll,
+                     WatcherHandle* handle) {
+  *handle = StartRoutedWatch(env, platform_watch, path, recursive, filter, poll);
+  if (!PlatformIsHandleValid(*handle))
+    return PlatformInvalidHandleToErrorNumber(*handle);
+
+  if (track.enabled())
+    TrackWatch(*handle, path, recursive, filter, track.file);
+  return 0;
+}
+
+static void AddHandle(Environment* env, WatcherHandle handle) {
+  // The same watch can be handed out twice, inotify returns the same
+  // descriptor for every path of one inode.
+  env->handles.insert(handle);
+  if (env->handles.size() == 1)
+    SetRef(env, true);
+}
+
+static Local<Value> WatchError(int error_number) {
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  v8::Local<v8::Value> err =
+    v8::Exception::Error(Nan::New<v8::String>("Unable to watch path").ToLocalChecked());
+  v8::Local<v8::Object> err_obj = err.As<v8::Object>();
+  if (error_number != 0) {
+    err_obj->Set(context,
+                 Nan::New<v8::String>("errno").ToLocalChecked(),
+                 Nan::New<v8::Integer>(error_number)).FromJust();
+#if NODE_VERSION_AT_LEAST(0, 11, 5)
+    // Node 0.11.5 is the first version to contain libuv v0.11.6, which
+    // contains https://github.com/libuv/libuv/commit/3ee4d3f183 which changes
+    // uv_err_name from taking a struct uv_err_t (whose uv_err_code `code` is
+    // a difficult-to-produce uv-specific errno) to just take an int which is
+    // a negative errno.
+    err_obj->Set(context,
+                 Nan::New<v8::String>("code").ToLocalChecked(),
+                 Nan::New<v8::String>(uv_err_name(-error_number)).ToLocalChecked()).FromJust();
+#endif
+  }
+  return err;
+}
+
+static void WatchWith(const Nan::FunctionCallbackInfo<Value>& info,
+                      WatcherHandle (*platform_watch)(const char*, const PathFilterPtr&),
+                      bool recursive) {
   if (!info[0]->IsString())
     return Nan::ThrowTypeError("String required");
 
   Local<v8::Context> context = Nan::GetCurrentContext();
+  PathFilterPtr filter;
+  TrackOptions track;
+  PollMode poll;
+  if (!ParseWatchOptions(info[1], &filter, &track, &poll))
+    return;
+
+  Environment* env = GetEnvironment(info);
   Local<String> path = info[0]->ToString(context).ToLocalChecked();
-  WatcherHandle handle = PlatformWatch(*String::Utf8Value(v8::Isolate::GetCurrent(), path));
-  if (!PlatformIsHandleValid(handle)) {
-    int error_number = PlatformInvalidHandleToErrorNumber(handle);
-    v8::Local<v8::Value> err =
-      v8::Exception::Error(Nan::New<v8::String>("Unable to watch path").ToLocalChecked());
-    v8::Local<v8::Object> err_obj = err.As<v8::Object>();
-    if (error_number != 0) {
-      err_obj->Set(context,
-                   Nan::New<v8::String>("errno").ToLocalChecked(),
-                   Nan::New<v8::Integer>(error_number)).FromJust();
-#if NODE_VERSION_AT_LEAST(0, 11, 5)
-      // Node 0.11.5 is the first version to contain libuv v0.11.6, which
-      // contains https://github.com/libuv/libuv/commit/3ee4d3f183 which changes
-      // uv_err_name from taking a struct uv_err_t (whose uv_err_code `code` is
-      // a difficult-to-produce uv-specific errno) to just take an int which is
-      // a negative errno.
-      err_obj->Set(context,
-                   Nan::New<v8::String>("code").ToLocalChecked(),
-                   Nan::New<v8::String>(uv_err_name(-error_number)).ToLocalChecked()).FromJust();
-#endif
+  String::Utf8Value path_value(v8::Isolate::GetCurrent(), path);
+  WatcherHandle handle;
+  int error_number = WatchPath(env, platform_watch, *path_value, recursive, filter,
+                               track, poll, &handle);
+  if (!PlatformIsHandleValid(handle))
+    return Nan::ThrowError(WatchError(error_number));
+
+  AddHandle(env, handle);
+  info.GetReturnValue().Set(WatcherHandleToV8Value(handle));
+}
+
+NAN_METHOD(Watch) {
+  Nan::HandleScope scope;
+  WatchWith(info, PlatformWatch, false);
+}
+
+NAN_METHOD(WatchTree) {
+  Nan::HandleScope scope;
+  WatchWith(info, PlatformWatchTree, true);
+}
+
+// Starts a watch on the thread pool, so a slow filesystem doesn't stall the
+// event loop, and reports the handle or the error to a callback.
+class AsyncWatch : public Nan::AsyncWorker {
+ public:
+  AsyncWatch(Nan::Callback* callback,
+             Environment* env,
+             WatcherHandle (*platform_watch)(const char*, const PathFilterPtr&),
+             const std::string& path,
+             bool recursive,
+             const PathFilterPtr& filter,
+             const TrackOptions& track,
+             PollMode poll)
+      : Nan::AsyncWorker(callback, "pathwatcher:watch"),
+        env_(env->shared_from_this()),
+        platform_watch_(platform_watch),
+        path_(path),
+        recursive_(recursive),
+        filter_(filter),
+        track_(track),
+        poll_(poll) {
+    ++env_->async_watches;
+  }
+
+  void Execute() {
+    handle_ = StartRoutedWatch(env_.get(), platform_watch_, path_.c_str(), recursive_,
+                               filter_, poll_);
+  }
+
+ protected:
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    if (!PlatformIsHandleValid(handle_)) {
+      Local<Value> argv[] = { WatchError(PlatformInvalidHandleToErrorNumber(handle_)) };
+      FinishWatch();
+      callback->Call(1, argv, async_resource);
+      return;
     }
-    return Nan::ThrowError(err);
+
+    if (track_.enabled())
+      TrackWatch(handle_, path_.c_str(), recursive_, filter_, track_.file);
+    AddHandle(env_.get(), handle_);
+
+    // JavaScript registers the handle in the callback, what arrived for it
+    // so far is delivered right after.
+    Local<Value> argv[] = { Nan::Null(), WatcherHandleToV8Value(handle_) };
+    callback->Call(2, argv, async_resource);
+    FinishWatch();
   }
 
-  if (g_watch_count++ == 0)
-    SetRef(true);
+ private:
+  void FinishWatch() {
+    Environment* env = env_.get();
+    bool had_pending = !env->pending.empty();
+    std::map<WatcherHandle, std::vector<WatcherEvent> >::iterator held =
+        env->held.find(handle_);
+    if (held != env->held.end()) {
+      if (!env->callback.IsEmpty()) {
+        for (size_t i = 0; i < held->second.size(); ++i)
+          CoalesceEvent(env, &held->second[i]);
+      }
+      env->held.erase(held);
+    }
+
+    // Nobody is going to ask for what is still held.
+    if (--env->async_watches == 0) {
+      for (held = env->held.begin(); held != env->held.end(); ++held)
+        env->events_dropped += held->second.size();
+      env->held.clear();
+    }
 
-  info.GetReturnValue().Set(WatcherHandleToV8Value(handle));
+    if (!env->pending.empty())
+      ScheduleDelivery(env, had_pending);
+  }
+
+  std::shared_ptr<Environment> env_;
+  WatcherHandle (*platform_watch_)(const char*, const PathFilterPtr&);
+  std::string path_;
+  bool recursive_;
+  PathFilterPtr filter_;
+  TrackOptions track_;
+  PollMode poll_;
+  WatcherHandle handle_;
+};
+
+static void WatchAsyncWith(const Nan::FunctionCallbackInfo<Value>& info,
+                           WatcherHandle (*platform_watch)(const char*, const PathFilterPtr&),
+                           bool recursive) {
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+  if (!info[2]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  PathFilterPtr filter;
+  TrackOptions track;
+  PollMode poll;
+  if (!ParseWatchOptions(info[1], &filter, &track, &poll))
+    return;
+
+  String::Utf8Value path(v8::Isolate::GetCurrent(), info[0]);
+  Nan::Callback* callback = new Nan::Callback(info[2].As<Function>());
+  Nan::AsyncQueueWorker(new AsyncWatch(callback, GetEnvironment(info), platform_watch, *path,
+                                       recursive, filter, track, poll));
+}
+
+NAN_METHOD(WatchAsync) {
+  Nan::HandleScope scope;
+  WatchAsyncWith(info, PlatformWatch, false);
+}
+
+NAN_METHOD(WatchTreeAsync) {
+  Nan::HandleScope scope;
+  WatchAsyncWith(info, PlatformWatchTree, true);
+}
+
+NAN_METHOD(WatchMany) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsArray())
+    return Nan::ThrowTypeError("Array of paths required");
+
+  PathFilterPtr filter;
+  TrackOptions track;
+  PollMode poll;
+  if (!ParseWatchOptions(info[1], &filter, &track, &poll))
+    return;
+
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Array> paths = Local<Array>::Cast(info[0]);
+  uint32_t length = paths->Length();
+  Local<Array> handles = Nan::New<Array>(length);
+  Local<Array> errors = Nan::New<Array>(length);
+
+  // Checked before anything is watched, a throw halfway would leave the
+  // watches already started without handles JavaScript could unwatch.
+  std::vector<Local<Value> > path_values;
+  for (uint32_t i = 0; i < length; ++i) {
+    Local<Value> path = paths->Get(context, i).ToLocalChecked();
+    if (!path->IsString())
+      return Nan::ThrowTypeError("Array of paths required");
+    path_values.push_back(path);
+  }
+
+  Environment* env = GetEnvironment(info);
+  bool had_handles = !env->handles.empty();
+  for (uint32_t i = 0; i < length; ++i) {
+    String::Utf8Value path_value(v8::Isolate::GetCurrent(), path_values[i]);
+    WatcherHandle handle;
+    int error_number = WatchPath(env, PlatformWatch, *path_value, false, filter,
+                                 track, poll, &handle);
+    if (PlatformIsHandleValid(handle)) {
+      handles->Set(context, i, WatcherHandleToV8Value(handle)).FromJust();
+      env->handles.insert(handle);
+    } else {
+      handles->Set(context, i, Nan::Null()).FromJust();
+    }
+    errors->Set(context, i, Nan::New<Integer>(error_number)).FromJust();
+  }
+
+  if (!had_handles && !env->handles.empty())
+    SetRef(env, true);
+
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("handles").ToLocalChecked(), handles);
+  Nan::Set(result, Nan::New("errors").ToLocalChecked(), errors);
+  info.GetReturnValue().Set(result);
 }
 
 NAN_METHOD(Unwatch) {
@@ -160,10 +1335,117 @@ NAN_METHOD(Unwatch) {
   if (!IsV8ValueWatcherHandle(info[0]))
     return Nan::ThrowTypeError("Local type required");
 
-  PlatformUnwatch(V8ValueToWatcherHandle(info[0]));
+  Environment* env = GetEnvironment(info);
+  WatcherHandle handle = V8ValueToWatcherHandle(info[0]);
+  ReleaseWatch(env, handle);
 
-  if (--g_watch_count == 0)
-    SetRef(false);
+  if (env->handles.erase(handle) > 0 && env->handles.empty())
+    SetRef(env, false);
 
   return;
 }
+
+NAN_METHOD(GetQueueStats) {
+  Nan::HandleScope scope;
+
+  QueueStats stats;
+  memset(&stats, 0, sizeof(stats));
+  PlatformGetQueueStats(&stats);
+  if (!stats.supported) {
+    info.GetReturnValue().SetNull();
+    return;
+  }
+
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("bytes").ToLocalChecked(), Nan::New<Number>(stats.bytes));
+  Nan::Set(result, Nan::New("events").ToLocalChecked(), Nan::New<Number>(stats.events));
+  Nan::Set(result, Nan::New("peakBytes").ToLocalChecked(), Nan::New<Number>(stats.peak_bytes));
+  Nan::Set(result, Nan::New("peakEvents").ToLocalChecked(), Nan::New<Number>(stats.peak_events));
+  Nan::Set(result, Nan::New("limit").ToLocalChecked(), Nan::New<Number>(stats.limit));
+  info.GetReturnValue().Set(result);
+}
+
+NAN_METHOD(GetStats) {
+  Nan::HandleScope scope;
+
+  // What the watcher threads counted is shared by every environment, what
+  // happened on the main thread is this environment's own.
+  Environment* env = GetEnvironment(info);
+
+  uint64_t counters[STAT_COUNTER_COUNT] = { 0 };
+  uv_mutex_lock(&g_thread_stats_mutex);
+  for (size_t i = 0; i < g_thread_stats.size(); ++i) {
+    for (size_t j = 0; j < STAT_COUNTER_COUNT; ++j)
+      counters[j] += g_thread_stats[i]->counters[j].load(std::memory_order_relaxed);
+  }
+  uv_mutex_unlock(&g_thread_stats_mutex);
+
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("eventsRead").ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(counters[STAT_EVENTS_READ])));
+  Nan::Set(result, Nan::New("eventsIgnored").ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(counters[STAT_EVENTS_IGNORED])));
+  Nan::Set(result, Nan::New("eventsPosted").ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(counters[STAT_EVENTS_POSTED])));
+  Nan::Set(result, Nan::New("eventsDropped").ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(env->events_dropped)));
+  Nan::Set(result, Nan::New("eventsDelivered").ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(env->events_delivered)));
+  Nan::Set(result, Nan::New("batchesDelivered").ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(env->batches_delivered)));
+  Nan::Set(result, Nan::New("activeWatches").ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(env->handles.size())));
+  Nan::Set(result, Nan::New("blockedMilliseconds").ToLocalChecked(),
+           Nan::New<Number>(counters[STAT_BLOCKED_NS] / 1e6));
+
+  // Bucket i counts the events delivered within 2^i microseconds of being
+  // posted and not within the bucket before.
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Array> bounds = Nan::New<Array>(kLatencyBuckets);
+  Local<Array> counts = Nan::New<Array>(kLatencyBuckets);
+  for (size_t i = 0; i < kLatencyBuckets; ++i) {
+    double bound = i == kLatencyBuckets - 1 ? INFINITY : static_cast<double>(1u << i);
+    bounds->Set(context, i, Nan::New<Number>(bound)).FromJust();
+    counts->Set(context, i, Nan::New<Number>(static_cast<double>(env->latency_counts[i]))).FromJust();
+  }
+  Local<Object> latency = Nan::New<Object>();
+  Nan::Set(latency, Nan::New("microseconds").ToLocalChecked(), bounds);
+  Nan::Set(latency, Nan::New("counts").ToLocalChecked(), counts);
+  Nan::Set(result, Nan::New("latency").ToLocalChecked(), latency);
+
+  info.GetReturnValue().Set(result);
+}
+
+NAN_METHOD(ChangesSince) {
+  Nan::HandleScope scope;
+
+  Environment* env = GetEnvironment(info);
+  uint64_t cursor = env->journal.cursor();
+  if (!info[0]->IsUndefined()) {
+    double value = info[0]->IsNumber() ? info[0]->NumberValue(Nan::GetCurrentContext()).FromJust() : -1;
+    if (!(value >= 0) || value != floor(value))
+      return Nan::ThrowTypeError("Cursor required");
+    cursor = static_cast<uint64_t>(value);
+  }
+
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("cursor").ToLocalChecked(),
+           Nan::New<Number>(static_cast<double>(env->journal.cursor())));
+
+  std::set<std::string> paths;
+  if (!env->journal.ChangesSince(cursor, &paths)) {
+    Nan::Set(result, Nan::New("paths").ToLocalChecked(), Nan::Null());
+    info.GetReturnValue().Set(result);
+    return;
+  }
+
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Array> array = Nan::New<Array>(paths.size());
+  uint32_t index = 0;
+  for (std::set<std::string>::const_iterator iter = paths.begin(); iter != paths.end(); ++iter) {
+    array->Set(context, index++,
+               Nan::New(iter->data(), iter->size()).ToLocalChecked()).FromJust();
+  }
+  Nan::Set(result, Nan::New("paths").ToLocalChecked(), array);
+  info.GetReturnValue().Set(result);
+}
@@ -4,6 +4,7 @@
 #include <vector>
 
 #include "nan.h"
+#include "path_filter.h"
 using namespace v8;
 
 #ifdef _WIN32
@@ -24,11 +25,30 @@ typedef int32_t WatcherHandle;
 
 void PlatformInit();
 void PlatformThread();
-WatcherHandle PlatformWatch(const char* path);
+// A |filter|, when given, is evaluated on the watcher thread against the
+// paths of the children, what it rejects is never posted.
+WatcherHandle PlatformWatch(const char* path, const PathFilterPtr& filter);
+// Watches a directory and everything below it through a single handle, the
+// events carry the full paths of the children that changed. Directories the
+// filter ignores are not watched.
+WatcherHandle PlatformWatchTree(const char* path, const PathFilterPtr& filter);
 void PlatformUnwatch(WatcherHandle handle);
 bool PlatformIsHandleValid(WatcherHandle handle);
 int PlatformInvalidHandleToErrorNumber(WatcherHandle handle);
 
+// How far behind the reader of the kernel event queue is, as last sampled.
+// The peaks cover the time since the previous call, which resets them.
+struct QueueStats {
+  bool supported;
+  uint32_t bytes;
+  uint32_t events;
+  uint32_t peak_bytes;
+  uint32_t peak_events;
+  // How many events the kernel queues before it overflows, 0 if unknown.
+  uint32_t limit;
+};
+void PlatformGetQueueStats(QueueStats* stats);
+
 enum EVENT_TYPE {
   EVENT_NONE,
   EVENT_CHANGE,
@@ -38,19 +58,101 @@ enum EVENT_TYPE {
   EVENT_CHILD_RENAME,
   EVENT_CHILD_DELETE,
   EVENT_CHILD_CREATE,
+  // The kernel dropped events, what the handle reported may be stale.
+  EVENT_OVERFLOW,
+};
+
+struct WatcherEvent {
+  EVENT_TYPE type;
+  WatcherHandle handle;
+  std::vector<char> new_path;
+  std::vector<char> old_path;
+  // The uv_hrtime() the raw event it stands for was read at.
+  uint64_t read_at;
 };
 
 void WaitForMainThread();
 void WakeupNewThread();
-void PostEventAndWait(EVENT_TYPE type,
-                      WatcherHandle handle,
-                      const std::vector<char>& new_path,
-                      const std::vector<char>& old_path = std::vector<char>());
 
+// Queues an event for the main thread without waiting for it to be handled,
+// blocks only when the main thread has fallen a whole queue behind.
+void PostEvent(EVENT_TYPE type,
+               WatcherHandle handle,
+               const std::vector<char>& new_path,
+               const std::vector<char>& old_path = std::vector<char>());
+
+// Whether a native watch was started for exactly |path|, other than by
+// polling, so a change to it is posted soon after it happens.
+bool IsPathWatched(const char* path);
+
+// A watcher thread that posts a lot can get a lane of its own: a queue the
+// main thread takes turns with, so one busy thread can't starve the others.
+// Lanes are added by PlatformInit, before any environment is set up.
+size_t AddEventLane();
+void SetEventLane(size_t lane);
+
+// Counters for getStats(), cheap enough to always keep: every thread bumps a
+// copy of its own without locking, they are only added up when asked for.
+enum STAT_COUNTER {
+  // Raw events the backends read from the kernel, and those of them nothing
+  // was posted for.
+  STAT_EVENTS_READ,
+  STAT_EVENTS_IGNORED,
+  STAT_EVENTS_POSTED,
+  // Nanoseconds watcher threads spent waiting for the main thread.
+  STAT_BLOCKED_NS,
+  STAT_COUNTER_COUNT,
+};
+void CountStat(STAT_COUNTER counter, uint64_t amount = 1);
+
+// How many events the calling thread has posted. A backend takes it before
+// handling a raw event and passes it to CountRawEvent afterwards, which counts
+// the event as ignored when nothing was posted in between.
+uint64_t PostedEvents();
+void CountRawEvent(uint64_t posted_before);
+
+// When the raw events the calling thread handles now were read. A backend
+// sets it as the read returns and the events it posts are timed from then,
+// otherwise from being posted.
+void SetEventReadTime(uint64_t read_at);
+uint64_t EventReadTime();
+
+// Sets up what the watcher threads share, once per process.
 void CommonInit();
+// Sets up the event pipeline of the calling environment, the main thread or
+// a worker, and returns the data its methods have to be bound to. Events are
+// only delivered to the environments that watch their handle.
+Local<Value> CommonInitEnvironment();
+
+// Runs |hook| when the main thread's environment goes away with the process.
+// Backends stop their threads there, workers come and go while they run.
+void AddExitHook(void (*hook)(void*), void* arg);
 
 NAN_METHOD(SetCallback);
+// Sets how many milliseconds events are held back so repeated changes of the
+// same path can be delivered as one, 0 turns coalescing off.
+NAN_METHOD(SetCoalesceWindow);
+// setEventRing(bytes) has events written to a Buffer of that size, which it
+// returns, and the callback called with `(start, end)`: the offsets of the
+// first record delivered and of the one after the last. 0 goes back to arrays
+// of strings. Not supported on Windows, where handles are objects.
+NAN_METHOD(SetEventRing);
 NAN_METHOD(Watch);
+NAN_METHOD(WatchTree);
+// Like Watch and WatchTree, but the watch is started on the thread pool and
+// the callback gets `(error, handle)`. Events that arrive before the callback
+// runs are delivered right after it.
+NAN_METHOD(WatchAsync);
+NAN_METHOD(WatchTreeAsync);
+// Watches every path of an array in one call, returns `{handles, errors}` with
+// a null handle and the error number for each path that can't be watched.
+NAN_METHOD(WatchMany);
 NAN_METHOD(Unwatch);
+NAN_METHOD(GetQueueStats);
+NAN_METHOD(GetStats);
+// changesSince(cursor) returns `{cursor, paths}`: the sorted paths events
+// were received for from |cursor| on, or null when that is no longer known,
+// and the cursor to ask with next time. Without a cursor the paths are empty.
+NAN_METHOD(ChangesSince);
 
 #endif  // SRC_COMMON_H_
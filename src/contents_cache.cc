@@ -0,0 +1,353 @@
+#include "contents_cache.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// How many bytes are kept unless setContentsCacheLimit() says otherwise. A
+// single file may take up to a quarter of it.
+static const uint64_t kDefaultCacheLimit = 32 * 1024 * 1024;
+static const uint64_t kMaxEntryShare = 4;
+
+// Timestamps are only as fine as the filesystem keeps them, a file modified
+// this recently may be written again without its mtime moving.
+static const int64_t kRacySeconds = 2;
+
+static const size_t kReadChunkSize = 64 * 1024;
+
+typedef std::shared_ptr<const std::vector<char> > Contents;
+
+struct InodeKey {
+  uint64_t dev;
+  uint64_t ino;
+
+  bool operator<(const InodeKey& other) const {
+    return ino != other.ino ? ino < other.ino : dev < other.dev;
+  }
+};
+
+struct CachedContents {
+  uint64_t size;
+  uint64_t mtime_ns;
+  Contents contents;
+  // Every path the contents were read through, hard links and symlinks
+  // included.
+  std::vector<std::string> paths;
+  std::list<InodeKey>::iterator recent;
+};
+
+// Most recently used first, the path index finds what an event invalidates.
+static std::map<InodeKey, CachedContents> g_contents;
+static std::list<InodeKey> g_recent_contents;
+static std::multimap<std::string, InodeKey> g_contents_paths;
+static uint64_t g_cached_bytes = 0;
+static std::atomic<uint64_t> g_cache_limit(kDefaultCacheLimit);
+static std::atomic<size_t> g_contents_count(0);
+// Bumped by every invalidation, a read that saw it move may have raced with a
+// write.
+static std::atomic<uint64_t> g_invalidations(0);
+static uv_mutex_t g_contents_mutex;
+static uv_once_t g_contents_mutex_once = UV_ONCE_INIT;
+
+struct ScopedLocker {
+  explicit ScopedLocker(uv_mutex_t& mutex) : mutex_(&mutex) { uv_mutex_lock(mutex_); }
+  ~ScopedLocker() { uv_mutex_unlock(mutex_); }
+
+  uv_mutex_t* mutex_;
+};
+
+static void InitContentsMutex() {
+  uv_mutex_init(&g_contents_mutex);
+}
+
+// Called with g_contents_mutex held.
+static void EraseContents(std::map<InodeKey, CachedContents>::iterator entry) {
+  const std::vector<std::string>& paths = entry->second.paths;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::pair<std::multimap<std::string, InodeKey>::iterator,
+              std::multimap<std::string, InodeKey>::iterator> range =
+        g_contents_paths.equal_range(paths[i]);
+    for (std::multimap<std::string, InodeKey>::iterator iter = range.first;
+         iter != range.second; ++iter) {
+      if (!(iter->second < entry->first) && !(entry->first < iter->second)) {
+        g_contents_paths.erase(iter);
+        break;
+      }
+    }
+  }
+  g_cached_bytes -= entry->second.size;
+  g_recent_contents.erase(entry->second.recent);
+  g_contents.erase(entry);
+  --g_contents_count;
+}
+
+// Called with g_contents_mutex held.
+static void EvictContents(uint64_t limit) {
+  while (g_cached_bytes > limit && !g_recent_contents.empty())
+    EraseContents(g_contents.find(g_recent_contents.back()));
+}
+
+// Called with g_contents_mutex held.
+static void AddContentsPath(std::map<InodeKey, CachedContents>::iterator entry,
+                            const std::string& path) {
+  std::vector<std::string>& paths = entry->second.paths;
+  if (std::find(paths.begin(), paths.end(), path) != paths.end())
+    return;
+  paths.push_back(path);
+  g_contents_paths.insert(std::make_pair(path, entry->first));
+}
+
+static bool FindContents(const std::string& path,
+                         const InodeKey& key,
+                         uint64_t size,
+                         uint64_t mtime_ns,
+                         Contents* contents) {
+  if (g_contents_count == 0)
+    return false;
+
+  ScopedLocker locker(g_contents_mutex);
+  std::map<InodeKey, CachedContents>::iterator entry = g_contents.find(key);
+  if (entry == g_contents.end())
+    return false;
+  if (entry->second.size != size || entry->second.mtime_ns != mtime_ns) {
+    EraseContents(entry);
+    return false;
+  }
+  g_recent_contents.splice(g_recent_contents.begin(), g_recent_contents, entry->second.recent);
+  AddContentsPath(entry, path);
+  *contents = entry->second.contents;
+  return true;
+}
+
+static void StoreContents(const std::string& path,
+                          const InodeKey& key,
+                          uint64_t mtime_ns,
+                          const Contents& contents) {
+  ScopedLocker locker(g_contents_mutex);
+  uint64_t size = contents->size();
+  uint64_t limit = g_cache_limit;
+  if (size > limit / kMaxEntryShare)
+    return;
+
+  std::map<InodeKey, CachedContents>::iterator entry = g_contents.find(key);
+  if (entry != g_contents.end())
+    EraseContents(entry);
+  EvictContents(limit - size);
+
+  g_recent_contents.push_front(key);
+  entry = g_contents.insert(std::make_pair(key, CachedContents())).first;
+  entry->second.size = size;
+  entry->second.mtime_ns = mtime_ns;
+  entry->second.contents = contents;
+  entry->second.recent = g_recent_contents.begin();
+  AddContentsPath(entry, path);
+  g_cached_bytes += size;
+  ++g_contents_count;
+}
+
+void InvalidateContents(const char* path, size_t length) {
+  ++g_invalidations;
+  if (g_contents_count == 0)
+    return;
+
+  ScopedLocker locker(g_contents_mutex);
+  std::string key(path, length);
+  std::multimap<std::string, InodeKey>::iterator indexed;
+  // Erasing an entry takes all its paths out of the index, this one included.
+  while ((indexed = g_contents_paths.find(key)) != g_contents_paths.end())
+    EraseContents(g_contents.find(indexed->second));
+}
+
+void ClearContents() {
+  ++g_invalidations;
+  if (g_contents_count == 0)
+    return;
+
+  ScopedLocker locker(g_contents_mutex);
+  g_contents.clear();
+  g_recent_contents.clear();
+  g_contents_paths.clear();
+  g_cached_bytes = 0;
+  g_contents_count = 0;
+}
+
+// Returns 0 or a negative errno.
+static int StatFile(uv_file fd, InodeKey* key, uint64_t* size, uint64_t* mtime_ns, int64_t* mtime_sec) {
+  uv_fs_t req;
+  int r = uv_fs_fstat(uv_default_loop(), &req, fd, NULL);
+  if (r == 0) {
+    key->dev = req.statbuf.st_dev;
+    key->ino = req.statbuf.st_ino;
+    *size = req.statbuf.st_size;
+    *mtime_ns = req.statbuf.st_mtim.tv_sec * 1000000000ULL + req.statbuf.st_mtim.tv_nsec;
+    *mtime_sec = req.statbuf.st_mtim.tv_sec;
+  }
+  uv_fs_req_cleanup(&req);
+  return r;
+}
+
+// Reads all of |fd|, |size| being what a stat said it had. Returns 0 or a
+// negative errno.
+static int ReadAll(uv_file fd, uint64_t size, std::vector<char>* contents) {
+  contents->resize(size > 0 ? size : kReadChunkSize);
+  size_t offset = 0;
+  while (true) {
+    if (offset == contents->size())
+      contents->resize(offset + kReadChunkSize);
+    uv_buf_t buf = uv_buf_init(contents->data() + offset,
+                               static_cast<unsigned int>(std::min(contents->size() - offset, kReadChunkSize * 16)));
+    uv_fs_t req;
+    int r = uv_fs_read(uv_default_loop(), &req, fd, &buf, 1, offset, NULL);
+    uv_fs_req_cleanup(&req);
+    if (r < 0)
+      return r;
+    if (r == 0)
+      break;
+    offset += r;
+  }
+  contents->resize(offset);
+  return 0;
+}
+
+// Gets the contents of |path| from the cache or the file, on any thread.
+// Returns 0 or a negative errno.
+static int ReadContents(const std::string& path, bool fresh, Contents* contents) {
+  uv_fs_t req;
+  uv_file fd = uv_fs_open(uv_default_loop(), &req, path.c_str(), O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0)
+    return fd;
+
+  InodeKey key;
+  uint64_t size, mtime_ns;
+  int64_t mtime_sec;
+  int error = StatFile(fd, &key, &size, &mtime_ns, &mtime_sec);
+  if (error == 0 && (fresh || !FindContents(path, key, size, mtime_ns, contents))) {
+    // A write in the same tick as the last one leaves the mtime as it was,
+    // only a watch of the path can tell about it then.
+    bool racy = mtime_sec + kRacySeconds >= static_cast<int64_t>(time(NULL));
+    bool cacheable = !racy || IsPathWatched(path.c_str());
+    uint64_t invalidations = g_invalidations;
+
+    std::shared_ptr<std::vector<char> > read(new std::vector<char>());
+    error = ReadAll(fd, size, read.get());
+    if (error == 0) {
+      *contents = read;
+      InodeKey after_key;
+      uint64_t after_size, after_mtime_ns;
+      int64_t after_mtime_sec;
+      if (cacheable && g_cache_limit > 0 &&
+          (!racy || invalidations == g_invalidations) &&
+          StatFile(fd, &after_key, &after_size, &after_mtime_ns, &after_mtime_sec) == 0 &&
+          after_size == read->size() && after_size == size && after_mtime_ns == mtime_ns)
+        StoreContents(path, key, mtime_ns, read);
+    }
+  }
+
+  uv_fs_close(uv_default_loop(), &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  return error;
+}
+
+static Local<Value> ReadError(int error_number, const std::string& path) {
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Object> error = Nan::Error(uv_strerror(error_number)).As<Object>();
+  error->Set(context, Nan::New("errno").ToLocalChecked(),
+             Nan::New<Integer>(-error_number)).FromJust();
+  error->Set(context, Nan::New("code").ToLocalChecked(),
+             Nan::New(uv_err_name(error_number)).ToLocalChecked()).FromJust();
+  error->Set(context, Nan::New("path").ToLocalChecked(),
+             Nan::New(path).ToLocalChecked()).FromJust();
+  return error;
+}
+
+// The buffer is a copy, what is cached stays in native memory where it can be
+// shared and dropped from any thread.
+static Local<Value> ContentsToBuffer(const Contents& contents) {
+  return Nan::CopyBuffer(contents->data(), contents->size()).ToLocalChecked();
+}
+
+class ReadFileWorker : public Nan::AsyncWorker {
+ public:
+  ReadFileWorker(Nan::Callback* callback, const std::string& path, bool fresh)
+      : Nan::AsyncWorker(callback, "pathwatcher:readFile"),
+        path_(path),
+        fresh_(fresh),
+        error_(0) {}
+
+  void Execute() {
+    error_ = ReadContents(path_, fresh_, &contents_);
+  }
+
+ protected:
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    if (error_ != 0) {
+      Local<Value> argv[] = { ReadError(error_, path_) };
+      callback->Call(1, argv, async_resource);
+      return;
+    }
+
+    Local<Value> argv[] = { Nan::Null(), ContentsToBuffer(contents_) };
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  std::string path_;
+  bool fresh_;
+  int error_;
+  Contents contents_;
+};
+
+NAN_METHOD(ReadFile) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+  if (!info[2]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  uv_once(&g_contents_mutex_once, InitContentsMutex);
+  String::Utf8Value path(v8::Isolate::GetCurrent(), info[0]);
+  Nan::Callback* callback = new Nan::Callback(info[2].As<Function>());
+  Nan::AsyncQueueWorker(new ReadFileWorker(callback, *path, Nan::To<bool>(info[1]).FromJust()));
+}
+
+NAN_METHOD(ReadFileSync) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+
+  uv_once(&g_contents_mutex_once, InitContentsMutex);
+  String::Utf8Value path_value(v8::Isolate::GetCurrent(), info[0]);
+  std::string path(*path_value);
+  Contents contents;
+  int error = ReadContents(path, Nan::To<bool>(info[1]).FromJust(), &contents);
+  if (error != 0)
+    return Nan::ThrowError(ReadError(error, path));
+
+  info.GetReturnValue().Set(ContentsToBuffer(contents));
+}
+
+NAN_METHOD(SetContentsCacheLimit) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsNumber() || info[0]->NumberValue(Nan::GetCurrentContext()).FromJust() < 0)
+    return Nan::ThrowTypeError("Number of bytes required");
+
+  uv_once(&g_contents_mutex_once, InitContentsMutex);
+  ScopedLocker locker(g_contents_mutex);
+  g_cache_limit = static_cast<uint64_t>(info[0]->NumberValue(Nan::GetCurrentContext()).FromJust());
+  EvictContents(g_cache_limit);
+}
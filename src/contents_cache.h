@@ -0,0 +1,26 @@
+#ifndef SRC_CONTENTS_CACHE_H_
+#define SRC_CONTENTS_CACHE_H_
+
+#include "common.h"
+
+// The contents of files read through the module, kept once per inode however
+// many paths or File objects ask for them. An entry is only handed out while
+// the size and modification time of the file still match, and events posted
+// for any of its paths drop it.
+
+// Drops what is cached for |path|. Cheap while nothing is cached, called on
+// whichever thread posts an event.
+void InvalidateContents(const char* path, size_t length);
+
+// Drops everything, for when events were lost.
+void ClearContents();
+
+// readFile(path, fresh, callback) calls back with `(error, buffer)`. A fresh
+// read skips the cache but still refreshes it.
+NAN_METHOD(ReadFile);
+// readFileSync(path, fresh) returns the buffer or throws.
+NAN_METHOD(ReadFileSync);
+// Sets how many bytes of contents are kept, 0 turns the cache off.
+NAN_METHOD(SetContentsCacheLimit);
+
+#endif  // SRC_CONTENTS_CACHE_H_
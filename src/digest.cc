@@ -0,0 +1,516 @@
+#include "digest.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// How many digests are kept, the least recently used go first.
+static const size_t kMaxCachedDigests = 4096;
+
+// Files are read in chunks of this size, or mapped when they are at least
+// this large and the platform can.
+static const size_t kReadChunkSize = 64 * 1024;
+static const uint64_t kMinMappedSize = 1024 * 1024;
+
+enum DigestAlgorithm {
+  DIGEST_SHA1,
+  DIGEST_XXH64,
+};
+
+// What a digest is cached under. Any write moves the modification time or the
+// size, unless it lands within the timestamp granularity of the filesystem,
+// and those are caught by the events.
+struct DigestKey {
+  uint64_t dev;
+  uint64_t ino;
+  uint64_t size;
+  uint64_t mtime_ns;
+  DigestAlgorithm algorithm;
+
+  bool operator<(const DigestKey& other) const {
+    if (ino != other.ino)
+      return ino < other.ino;
+    if (dev != other.dev)
+      return dev < other.dev;
+    if (size != other.size)
+      return size < other.size;
+    if (mtime_ns != other.mtime_ns)
+      return mtime_ns < other.mtime_ns;
+    return algorithm < other.algorithm;
+  }
+
+  bool operator==(const DigestKey& other) const {
+    return !(*this < other) && !(other < *this);
+  }
+};
+
+struct CachedDigest {
+  std::string hex;
+  std::string path;
+  std::list<DigestKey>::iterator recent;
+};
+
+// Most recently used first. The path index finds what an event invalidates.
+static std::map<DigestKey, CachedDigest> g_digests;
+static std::list<DigestKey> g_recent_digests;
+static std::multimap<std::string, DigestKey> g_digest_paths;
+static std::atomic<size_t> g_digest_count(0);
+static uv_mutex_t g_digests_mutex;
+static uv_once_t g_digests_mutex_once = UV_ONCE_INIT;
+
+struct ScopedLocker {
+  explicit ScopedLocker(uv_mutex_t& mutex) : mutex_(&mutex) { uv_mutex_lock(mutex_); }
+  ~ScopedLocker() { uv_mutex_unlock(mutex_); }
+
+  uv_mutex_t* mutex_;
+};
+
+static const char kHexDigits[] = "0123456789abcdef";
+
+static inline uint32_t RotateLeft32(uint32_t value, int bits) {
+  return (value << bits) | (value >> (32 - bits));
+}
+
+static inline uint64_t RotateLeft64(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+// SHA-1 as in FIPS 180-4, the digest File has always reported.
+class Sha1 {
+ public:
+  Sha1() : length_(0), buffered_(0) {
+    state_[0] = 0x67452301;
+    state_[1] = 0xEFCDAB89;
+    state_[2] = 0x98BADCFE;
+    state_[3] = 0x10325476;
+    state_[4] = 0xC3D2E1F0;
+  }
+
+  void Update(const uint8_t* data, size_t size) {
+    length_ += size;
+    if (buffered_ > 0) {
+      size_t taken = std::min(sizeof(buffer_) - buffered_, size);
+      memcpy(buffer_ + buffered_, data, taken);
+      buffered_ += taken;
+      data += taken;
+      size -= taken;
+      if (buffered_ < sizeof(buffer_))
+        return;
+      Block(buffer_);
+      buffered_ = 0;
+    }
+    for (; size >= sizeof(buffer_); data += sizeof(buffer_), size -= sizeof(buffer_))
+      Block(data);
+    memcpy(buffer_, data, size);
+    buffered_ = size;
+  }
+
+  std::string HexDigest() {
+    uint64_t bits = length_ * 8;
+    static const uint8_t kPadding[64] = { 0x80 };
+    Update(kPadding, buffered_ < 56 ? 56 - buffered_ : 120 - buffered_);
+    uint8_t length[8];
+    for (int i = 0; i < 8; ++i)
+      length[i] = static_cast<uint8_t>(bits >> (56 - 8 * i));
+    Update(length, sizeof(length));
+
+    std::string hex;
+    for (int i = 0; i < 5; ++i) {
+      for (int shift = 28; shift >= 0; shift -= 4)
+        hex.push_back(kHexDigits[(state_[i] >> shift) & 0xf]);
+    }
+    return hex;
+  }
+
+ private:
+  void Block(const uint8_t* block) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = (static_cast<uint32_t>(block[4 * i]) << 24) |
+             (static_cast<uint32_t>(block[4 * i + 1]) << 16) |
+             (static_cast<uint32_t>(block[4 * i + 2]) << 8) |
+             static_cast<uint32_t>(block[4 * i + 3]);
+    }
+    for (int i = 16; i < 80; ++i)
+      w[i] = RotateLeft32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3], e = state_[4];
+    for (int i = 0; i < 80; ++i) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t temp = RotateLeft32(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = RotateLeft32(b, 30);
+      b = a;
+      a = temp;
+    }
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+  }
+
+  uint32_t state_[5];
+  uint64_t length_;
+  uint8_t buffer_[64];
+  size_t buffered_;
+};
+
+// XXH64 with a seed of 0, several times faster than SHA-1 for telling whether
+// contents changed. The digest is written big endian, as xxhsum does.
+class Xxh64 {
+ public:
+  Xxh64() : length_(0), buffered_(0) {
+    v_[0] = kPrime1 + kPrime2;
+    v_[1] = kPrime2;
+    v_[2] = 0;
+    v_[3] = 0 - kPrime1;
+  }
+
+  void Update(const uint8_t* data, size_t size) {
+    length_ += size;
+    if (buffered_ > 0) {
+      size_t taken = std::min(sizeof(buffer_) - buffered_, size);
+      memcpy(buffer_ + buffered_, data, taken);
+      buffered_ += taken;
+      data += taken;
+      size -= taken;
+      if (buffered_ < sizeof(buffer_))
+        return;
+      Stripe(buffer_);
+      buffered_ = 0;
+    }
+    for (; size >= sizeof(buffer_); data += sizeof(buffer_), size -= sizeof(buffer_))
+      Stripe(data);
+    memcpy(buffer_, data, size);
+    buffered_ = size;
+  }
+
+  std::string HexDigest() {
+    uint64_t h;
+    if (length_ >= sizeof(buffer_)) {
+      h = RotateLeft64(v_[0], 1) + RotateLeft64(v_[1], 7) +
+          RotateLeft64(v_[2], 12) + RotateLeft64(v_[3], 18);
+      for (int i = 0; i < 4; ++i) {
+        h ^= Round(0, v_[i]);
+        h = h * kPrime1 + kPrime4;
+      }
+    } else {
+      h = kPrime5;
+    }
+    h += length_;
+
+    const uint8_t* p = buffer_;
+    const uint8_t* end = buffer_ + buffered_;
+    for (; p + 8 <= end; p += 8) {
+      h ^= Round(0, Read64(p));
+      h = RotateLeft64(h, 27) * kPrime1 + kPrime4;
+    }
+    if (p + 4 <= end) {
+      h ^= static_cast<uint64_t>(Read32(p)) * kPrime1;
+      h = RotateLeft64(h, 23) * kPrime2 + kPrime3;
+      p += 4;
+    }
+    for (; p < end; ++p) {
+      h ^= *p * kPrime5;
+      h = RotateLeft64(h, 11) * kPrime1;
+    }
+
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+
+    std::string hex;
+    for (int shift = 60; shift >= 0; shift -= 4)
+      hex.push_back(kHexDigits[(h >> shift) & 0xf]);
+    return hex;
+  }
+
+ private:
+  static const uint64_t kPrime1 = 11400714785074694791ULL;
+  static const uint64_t kPrime2 = 14029467366897019727ULL;
+  static const uint64_t kPrime3 = 1609587929392839161ULL;
+  static const uint64_t kPrime4 = 9650029242287828579ULL;
+  static const uint64_t kPrime5 = 2870177450012600261ULL;
+
+  static uint64_t Read64(const uint8_t* p) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; --i)
+      value = (value << 8) | p[i];
+    return value;
+  }
+
+  static uint32_t Read32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+
+  static uint64_t Round(uint64_t accumulator, uint64_t input) {
+    accumulator += input * kPrime2;
+    return RotateLeft64(accumulator, 31) * kPrime1;
+  }
+
+  void Stripe(const uint8_t* stripe) {
+    for (int i = 0; i < 4; ++i)
+      v_[i] = Round(v_[i], Read64(stripe + 8 * i));
+  }
+
+  uint64_t v_[4];
+  uint64_t length_;
+  uint8_t buffer_[32];
+  size_t buffered_;
+};
+
+static void InitDigestsMutex() {
+  uv_mutex_init(&g_digests_mutex);
+}
+
+// Called with g_digests_mutex held.
+static void EraseDigest(std::map<DigestKey, CachedDigest>::iterator digest) {
+  std::pair<std::multimap<std::string, DigestKey>::iterator,
+            std::multimap<std::string, DigestKey>::iterator> paths =
+      g_digest_paths.equal_range(digest->second.path);
+  for (std::multimap<std::string, DigestKey>::iterator iter = paths.first;
+       iter != paths.second; ++iter) {
+    if (iter->second == digest->first) {
+      g_digest_paths.erase(iter);
+      break;
+    }
+  }
+  g_recent_digests.erase(digest->second.recent);
+  g_digests.erase(digest);
+  --g_digest_count;
+}
+
+static bool FindDigest(const DigestKey& key, std::string* hex) {
+  if (g_digest_count == 0)
+    return false;
+
+  ScopedLocker locker(g_digests_mutex);
+  std::map<DigestKey, CachedDigest>::iterator digest = g_digests.find(key);
+  if (digest == g_digests.end())
+    return false;
+  g_recent_digests.splice(g_recent_digests.begin(), g_recent_digests, digest->second.recent);
+  *hex = digest->second.hex;
+  return true;
+}
+
+static void StoreDigest(const std::string& path, const DigestKey& key, const std::string& hex) {
+  ScopedLocker locker(g_digests_mutex);
+  if (g_digests.count(key) > 0)
+    return;
+
+  // What was cached for an older version of the file is of no use anymore.
+  std::pair<std::multimap<std::string, DigestKey>::iterator,
+            std::multimap<std::string, DigestKey>::iterator> paths =
+      g_digest_paths.equal_range(path);
+  for (std::multimap<std::string, DigestKey>::iterator iter = paths.first;
+       iter != paths.second;) {
+    std::map<DigestKey, CachedDigest>::iterator stale = g_digests.find((iter++)->second);
+    if (stale->first.algorithm == key.algorithm)
+      EraseDigest(stale);
+  }
+
+  if (g_digests.size() >= kMaxCachedDigests)
+    EraseDigest(g_digests.find(g_recent_digests.back()));
+
+  g_recent_digests.push_front(key);
+  CachedDigest& digest = g_digests[key];
+  digest.hex = hex;
+  digest.path = path;
+  digest.recent = g_recent_digests.begin();
+  g_digest_paths.insert(std::make_pair(path, key));
+  ++g_digest_count;
+}
+
+void InvalidateDigests(const char* path, size_t length) {
+  if (g_digest_count == 0)
+    return;
+
+  ScopedLocker locker(g_digests_mutex);
+  std::pair<std::multimap<std::string, DigestKey>::iterator,
+            std::multimap<std::string, DigestKey>::iterator> paths =
+      g_digest_paths.equal_range(std::string(path, length));
+  while (paths.first != paths.second)
+    EraseDigest(g_digests.find((paths.first++)->second));
+}
+
+void ClearDigests() {
+  if (g_digest_count == 0)
+    return;
+
+  ScopedLocker locker(g_digests_mutex);
+  g_digests.clear();
+  g_recent_digests.clear();
+  g_digest_paths.clear();
+  g_digest_count = 0;
+}
+
+// Returns 0 or a negative errno.
+static int StatKey(uv_file fd, DigestAlgorithm algorithm, DigestKey* key) {
+  uv_fs_t req;
+  int r = uv_fs_fstat(uv_default_loop(), &req, fd, NULL);
+  if (r == 0) {
+    key->dev = req.statbuf.st_dev;
+    key->ino = req.statbuf.st_ino;
+    key->size = req.statbuf.st_size;
+    key->mtime_ns = req.statbuf.st_mtim.tv_sec * 1000000000ULL + req.statbuf.st_mtim.tv_nsec;
+    key->algorithm = algorithm;
+  }
+  uv_fs_req_cleanup(&req);
+  return r;
+}
+
+// Hashes what |fd| has to offer, |size| being what a stat said it had.
+// Returns 0 or a negative errno.
+template <typename Hash>
+static int HashFile(uv_file fd, uint64_t size, std::string* hex) {
+  Hash hash;
+
+#ifndef _WIN32
+  // Large files are mapped, which spares copying them through a buffer.
+  if (size >= kMinMappedSize && size <= SIZE_MAX) {
+    void* contents = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (contents != MAP_FAILED) {
+      madvise(contents, size, MADV_SEQUENTIAL);
+      hash.Update(static_cast<const uint8_t*>(contents), size);
+      munmap(contents, size);
+      *hex = hash.HexDigest();
+      return 0;
+    }
+  }
+#endif
+
+  std::vector<char> buffer(kReadChunkSize);
+  int64_t offset = 0;
+  while (true) {
+    uv_buf_t buf = uv_buf_init(buffer.data(), static_cast<unsigned int>(buffer.size()));
+    uv_fs_t req;
+    int r = uv_fs_read(uv_default_loop(), &req, fd, &buf, 1, offset, NULL);
+    uv_fs_req_cleanup(&req);
+    if (r < 0)
+      return r;
+    if (r == 0)
+      break;
+    hash.Update(reinterpret_cast<const uint8_t*>(buffer.data()), r);
+    offset += r;
+  }
+  *hex = hash.HexDigest();
+  return 0;
+}
+
+// Looks the digest of a file up or computes it on the thread pool, and
+// reports it or the error to a callback.
+class DigestWorker : public Nan::AsyncWorker {
+ public:
+  DigestWorker(Nan::Callback* callback, const std::string& path, DigestAlgorithm algorithm)
+      : Nan::AsyncWorker(callback, "pathwatcher:digest"),
+        path_(path),
+        algorithm_(algorithm),
+        error_(0) {}
+
+  void Execute() {
+    uv_fs_t req;
+    uv_file fd = uv_fs_open(uv_default_loop(), &req, path_.c_str(), O_RDONLY, 0, NULL);
+    uv_fs_req_cleanup(&req);
+    if (fd < 0) {
+      error_ = fd;
+      return;
+    }
+
+    DigestKey key;
+    error_ = StatKey(fd, algorithm_, &key);
+    if (error_ == 0 && !FindDigest(key, &hex_)) {
+      error_ = algorithm_ == DIGEST_SHA1 ? HashFile<Sha1>(fd, key.size, &hex_)
+                                         : HashFile<Xxh64>(fd, key.size, &hex_);
+
+      // A file written to while it was read may have given a mix of both
+      // versions, that is not worth keeping.
+      DigestKey after;
+      if (error_ == 0 && StatKey(fd, algorithm_, &after) == 0 && after == key)
+        StoreDigest(path_, key, hex_);
+    }
+
+    uv_fs_close(uv_default_loop(), &req, fd, NULL);
+    uv_fs_req_cleanup(&req);
+  }
+
+ protected:
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    if (error_ != 0) {
+      Local<v8::Context> context = Nan::GetCurrentContext();
+      Local<Object> error = Nan::Error(uv_strerror(error_)).As<Object>();
+      error->Set(context, Nan::New("errno").ToLocalChecked(),
+                 Nan::New<Integer>(-error_)).FromJust();
+      error->Set(context, Nan::New("code").ToLocalChecked(),
+                 Nan::New(uv_err_name(error_)).ToLocalChecked()).FromJust();
+      error->Set(context, Nan::New("path").ToLocalChecked(),
+                 Nan::New(path_).ToLocalChecked()).FromJust();
+      Local<Value> argv[] = { error };
+      callback->Call(1, argv, async_resource);
+      return;
+    }
+
+    Local<Value> argv[] = { Nan::Null(), Nan::New(hex_).ToLocalChecked() };
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  std::string path_;
+  DigestAlgorithm algorithm_;
+  int error_;
+  std::string hex_;
+};
+
+NAN_METHOD(Digest) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString() || !info[1]->IsString())
+    return Nan::ThrowTypeError("String required");
+  if (!info[2]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  String::Utf8Value algorithm_value(v8::Isolate::GetCurrent(), info[1]);
+  DigestAlgorithm algorithm;
+  if (strcmp(*algorithm_value, "sha1") == 0)
+    algorithm = DIGEST_SHA1;
+  else if (strcmp(*algorithm_value, "xxh64") == 0)
+    algorithm = DIGEST_XXH64;
+  else
+    return Nan::ThrowTypeError("Algorithm must be sha1 or xxh64");
+
+  uv_once(&g_digests_mutex_once, InitDigestsMutex);
+  String::Utf8Value path(v8::Isolate::GetCurrent(), info[0]);
+  Nan::Callback* callback = new Nan::Callback(info[2].As<Function>());
+  Nan::AsyncQueueWorker(new DigestWorker(callback, *path, algorithm));
+}
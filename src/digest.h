@@ -0,0 +1,25 @@
+#ifndef SRC_DIGEST_H_
+#define SRC_DIGEST_H_
+
+#include <string>
+
+#include "common.h"
+
+// Digests of file contents are computed on the thread pool and cached by the
+// device, inode, size and modification time of the file, so asking again for
+// an unchanged file costs an open and a stat. Events posted for a path drop
+// what is cached for it, which catches rewrites that keep the size within the
+// timestamp granularity of the filesystem.
+
+// Drops the cached digests of |path|. Cheap while nothing is cached, called
+// on whichever thread posts an event.
+void InvalidateDigests(const char* path, size_t length);
+
+// Drops every cached digest, for when events were lost.
+void ClearDigests();
+
+// digest(path, algorithm, callback) calls back with `(error, hex)`, the
+// algorithm being "sha1" or "xxh64".
+NAN_METHOD(Digest);
+
+#endif  // SRC_DIGEST_H_
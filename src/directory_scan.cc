@@ -0,0 +1,367 @@
+#include "directory_scan.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+static const char kSeparator = '\\';
+#else
+static const char kSeparator = '/';
+#endif
+
+// Entries stat'ed by one job on the thread pool, and how many jobs a scan may
+// have queued at once.
+static const size_t kStatChunkSize = 512;
+static const size_t kMaxStatJobs = 8;
+
+#ifdef __linux__
+// getdents64() fills this much at a time, enough for a few thousand names.
+static const size_t kDirentBufferSize = 256 * 1024;
+
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+#endif
+
+struct ScanEntry {
+  std::string name;
+  uint8_t kind;
+  // Whether the directory didn't tell enough about the entry.
+  bool unknown;
+  double size;
+  double mtime;
+
+  bool operator<(const ScanEntry& other) const { return name < other.name; }
+};
+
+struct ScanRequest;
+
+struct StatJob {
+  uv_work_t req;
+  ScanRequest* scan;
+  size_t begin;
+  size_t end;
+};
+
+struct ScanRequest {
+  ScanRequest() : fd(-1), error(0), jobs(0), next(0) {}
+
+  uv_work_t req;
+  std::string path;
+  bool stat;
+  Nan::Callback callback;
+  Nan::AsyncResource* resource;
+
+  // The directory stays open while its entries are stat'ed relative to it.
+  int fd;
+  int error;
+  std::vector<ScanEntry> entries;
+  std::vector<size_t> pending;
+  size_t jobs;
+  size_t next;
+};
+
+static uint8_t KindOfMode(uint64_t mode) {
+  switch (mode & S_IFMT) {
+    case S_IFREG:
+      return SCAN_KIND_FILE;
+    case S_IFDIR:
+      return SCAN_KIND_DIRECTORY;
+    default:
+      return SCAN_KIND_OTHER;
+  }
+}
+
+#ifdef __linux__
+static uint8_t KindOfDirentType(unsigned char type, bool* unknown) {
+  *unknown = false;
+  switch (type) {
+    case DT_REG:
+      return SCAN_KIND_FILE;
+    case DT_DIR:
+      return SCAN_KIND_DIRECTORY;
+    case DT_LNK:
+      *unknown = true;
+      return SCAN_KIND_SYMLINK;
+    case DT_UNKNOWN:
+      *unknown = true;
+      return SCAN_KIND_MISSING;
+    default:
+      return SCAN_KIND_OTHER;
+  }
+}
+
+// Reads the names of the directory in large batches, which is what readdir()
+// does too but without a call per entry. Returns 0 or a negative errno.
+static int ListDirectory(ScanRequest* scan) {
+  scan->fd = open(scan->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (scan->fd == -1)
+    return -errno;
+
+  std::vector<char> buffer(kDirentBufferSize);
+  while (true) {
+    long bytes = syscall(SYS_getdents64, scan->fd, buffer.data(), buffer.size());
+    if (bytes == -1)
+      return -errno;
+    if (bytes == 0)
+      return 0;
+
+    for (long offset = 0; offset < bytes;) {
+      LinuxDirent64* dirent = reinterpret_cast<LinuxDirent64*>(buffer.data() + offset);
+      offset += dirent->d_reclen;
+      if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+        continue;
+
+      ScanEntry entry;
+      entry.name = dirent->d_name;
+      entry.kind = KindOfDirentType(dirent->d_type, &entry.unknown);
+      entry.size = 0;
+      entry.mtime = 0;
+      scan->entries.push_back(entry);
+    }
+  }
+}
+
+// Stats an entry relative to the open directory, following symlinks as the
+// kind of a symlink is that of what it points to.
+static void StatEntry(ScanRequest* scan, ScanEntry* entry) {
+  struct stat st;
+  if (entry->kind == SCAN_KIND_MISSING) {
+    if (fstatat(scan->fd, entry->name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+      return;
+    entry->kind = S_ISLNK(st.st_mode) ? static_cast<uint8_t>(SCAN_KIND_SYMLINK) : KindOfMode(st.st_mode);
+  }
+  if (entry->kind == SCAN_KIND_SYMLINK || scan->stat) {
+    if (fstatat(scan->fd, entry->name.c_str(), &st, 0) == -1)
+      return;
+    entry->kind = (entry->kind & SCAN_KIND_SYMLINK) | KindOfMode(st.st_mode);
+  }
+  entry->size = static_cast<double>(st.st_size);
+  entry->mtime = st.st_mtim.tv_sec * 1e3 + st.st_mtim.tv_nsec / 1e6;
+}
+
+static void CloseDirectory(ScanRequest* scan) {
+  if (scan->fd != -1)
+    close(scan->fd);
+}
+#else
+static uint8_t KindOfDirentType(uv_dirent_type_t type, bool* unknown) {
+  *unknown = false;
+  switch (type) {
+    case UV_DIRENT_FILE:
+      return SCAN_KIND_FILE;
+    case UV_DIRENT_DIR:
+      return SCAN_KIND_DIRECTORY;
+    case UV_DIRENT_LINK:
+      *unknown = true;
+      return SCAN_KIND_SYMLINK;
+    case UV_DIRENT_UNKNOWN:
+      *unknown = true;
+      return SCAN_KIND_MISSING;
+    default:
+      return SCAN_KIND_OTHER;
+  }
+}
+
+// Returns 0 or a negative errno.
+static int ListDirectory(ScanRequest* scan) {
+  uv_fs_t req;
+  int r = uv_fs_scandir(uv_default_loop(), &req, scan->path.c_str(), 0, NULL);
+  if (r >= 0) {
+    uv_dirent_t dirent;
+    while (uv_fs_scandir_next(&req, &dirent) != UV_EOF) {
+      ScanEntry entry;
+      entry.name = dirent.name;
+      entry.kind = KindOfDirentType(dirent.type, &entry.unknown);
+      entry.size = 0;
+      entry.mtime = 0;
+      scan->entries.push_back(entry);
+    }
+  }
+  uv_fs_req_cleanup(&req);
+  return r < 0 ? r : 0;
+}
+
+static void StatEntry(ScanRequest* scan, ScanEntry* entry) {
+  std::string path = scan->path + kSeparator + entry->name;
+  uv_fs_t req;
+  if (entry->kind == SCAN_KIND_MISSING) {
+    int r = uv_fs_lstat(uv_default_loop(), &req, path.c_str(), NULL);
+    if (r == 0) {
+      entry->kind = (req.statbuf.st_mode & S_IFMT) == S_IFLNK ? static_cast<uint8_t>(SCAN_KIND_SYMLINK)
+                                                               : KindOfMode(req.statbuf.st_mode);
+      entry->size = static_cast<double>(req.statbuf.st_size);
+      entry->mtime = req.statbuf.st_mtim.tv_sec * 1e3 + req.statbuf.st_mtim.tv_nsec / 1e6;
+    }
+    uv_fs_req_cleanup(&req);
+    if (r != 0)
+      return;
+  }
+  if (entry->kind == SCAN_KIND_SYMLINK || scan->stat) {
+    int r = uv_fs_stat(uv_default_loop(), &req, path.c_str(), NULL);
+    if (r == 0) {
+      entry->kind = (entry->kind & SCAN_KIND_SYMLINK) | KindOfMode(req.statbuf.st_mode);
+      entry->size = static_cast<double>(req.statbuf.st_size);
+      entry->mtime = req.statbuf.st_mtim.tv_sec * 1e3 + req.statbuf.st_mtim.tv_nsec / 1e6;
+    }
+    uv_fs_req_cleanup(&req);
+  }
+}
+
+static void CloseDirectory(ScanRequest* scan) {}
+#endif
+
+static Local<Value> ScanError(int error_number, const std::string& path) {
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Object> error = Nan::Error(uv_strerror(error_number)).As<Object>();
+  error->Set(context, Nan::New("errno").ToLocalChecked(),
+             Nan::New<Integer>(-error_number)).FromJust();
+  error->Set(context, Nan::New("code").ToLocalChecked(),
+             Nan::New(uv_err_name(error_number)).ToLocalChecked()).FromJust();
+  error->Set(context, Nan::New("path").ToLocalChecked(),
+             Nan::New(path).ToLocalChecked()).FromJust();
+  return error;
+}
+
+static void FinishScan(ScanRequest* scan) {
+  Nan::HandleScope scope;
+  CloseDirectory(scan);
+
+  if (scan->error != 0) {
+    Local<Value> argv[] = { ScanError(scan->error, scan->path) };
+    scan->callback.Call(1, argv, scan->resource);
+    delete scan->resource;
+    delete scan;
+    return;
+  }
+
+  // One string and a few buffers, however many entries there are.
+  std::string names;
+  std::vector<char> kinds(scan->entries.size());
+  std::vector<double> sizes, mtimes;
+  for (size_t i = 0; i < scan->entries.size(); ++i) {
+    const ScanEntry& entry = scan->entries[i];
+    if (i > 0)
+      names.push_back('\0');
+    names.append(entry.name);
+    kinds[i] = static_cast<char>(entry.kind);
+    if (scan->stat) {
+      sizes.push_back(entry.size);
+      mtimes.push_back(entry.mtime);
+    }
+  }
+
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Object> result = Nan::New<Object>();
+  result->Set(context, Nan::New("names").ToLocalChecked(),
+              Nan::New(names.data(), static_cast<int>(names.size())).ToLocalChecked()).FromJust();
+  result->Set(context, Nan::New("kinds").ToLocalChecked(),
+              Nan::CopyBuffer(kinds.data(), kinds.size()).ToLocalChecked()).FromJust();
+  if (scan->stat) {
+    result->Set(context, Nan::New("sizes").ToLocalChecked(),
+                Nan::CopyBuffer(reinterpret_cast<const char*>(sizes.data()),
+                                sizes.size() * sizeof(double)).ToLocalChecked()).FromJust();
+    result->Set(context, Nan::New("mtimes").ToLocalChecked(),
+                Nan::CopyBuffer(reinterpret_cast<const char*>(mtimes.data()),
+                                mtimes.size() * sizeof(double)).ToLocalChecked()).FromJust();
+  }
+
+  Local<Value> argv[] = { Nan::Null(), result };
+  scan->callback.Call(2, argv, scan->resource);
+  delete scan->resource;
+  delete scan;
+}
+
+static void StatWork(uv_work_t* req) {
+  StatJob* job = static_cast<StatJob*>(req->data);
+  ScanRequest* scan = job->scan;
+  for (size_t i = job->begin; i < job->end; ++i)
+    StatEntry(scan, &scan->entries[scan->pending[i]]);
+}
+
+static void QueueStatJobs(uv_loop_t* loop, ScanRequest* scan);
+
+static void StatDone(uv_work_t* req, int status) {
+  StatJob* job = static_cast<StatJob*>(req->data);
+  ScanRequest* scan = job->scan;
+  delete job;
+
+  --scan->jobs;
+  QueueStatJobs(req->loop, scan);
+  if (scan->jobs == 0)
+    FinishScan(scan);
+}
+
+// Keeps up to kMaxStatJobs chunks of the entries left to stat on the thread
+// pool, so a large directory doesn't hold every thread of it at once.
+static void QueueStatJobs(uv_loop_t* loop, ScanRequest* scan) {
+  while (scan->jobs < kMaxStatJobs && scan->next < scan->pending.size()) {
+    StatJob* job = new StatJob;
+    job->req.data = job;
+    job->scan = scan;
+    job->begin = scan->next;
+    job->end = std::min(scan->pending.size(), scan->next + kStatChunkSize);
+    scan->next = job->end;
+    ++scan->jobs;
+    uv_queue_work(loop, &job->req, StatWork, StatDone);
+  }
+}
+
+static void ListWork(uv_work_t* req) {
+  ScanRequest* scan = static_cast<ScanRequest*>(req->data);
+  scan->error = ListDirectory(scan);
+  if (scan->error != 0)
+    return;
+
+  // The order fs.readdir() gives.
+  std::sort(scan->entries.begin(), scan->entries.end());
+  for (size_t i = 0; i < scan->entries.size(); ++i) {
+    if (scan->entries[i].unknown || scan->stat)
+      scan->pending.push_back(i);
+  }
+
+  // A few entries are not worth another trip through the thread pool.
+  if (scan->pending.size() <= kStatChunkSize) {
+    for (size_t i = 0; i < scan->pending.size(); ++i)
+      StatEntry(scan, &scan->entries[scan->pending[i]]);
+    scan->pending.clear();
+  }
+}
+
+static void ListDone(uv_work_t* req, int status) {
+  ScanRequest* scan = static_cast<ScanRequest*>(req->data);
+  QueueStatJobs(req->loop, scan);
+  if (scan->jobs == 0)
+    FinishScan(scan);
+}
+
+NAN_METHOD(ScanDirectory) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+  if (!info[2]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  ScanRequest* scan = new ScanRequest;
+  scan->req.data = scan;
+  scan->path = *String::Utf8Value(v8::Isolate::GetCurrent(), info[0]);
+  scan->stat = Nan::To<bool>(info[1]).FromJust();
+  scan->callback.Reset(info[2].As<Function>());
+  scan->resource = new Nan::AsyncResource("pathwatcher:scanDirectory");
+  uv_queue_work(Nan::GetCurrentEventLoop(), &scan->req, ListWork, ListDone);
+}
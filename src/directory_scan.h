@@ -0,0 +1,25 @@
+#ifndef SRC_DIRECTORY_SCAN_H_
+#define SRC_DIRECTORY_SCAN_H_
+
+#include "common.h"
+
+// What scanDirectory() reports for each entry. The low bits tell what the
+// entry is, or what it points to for a symlink, SCAN_KIND_MISSING being a
+// dangling symlink or an entry gone before it could be looked at.
+enum SCAN_KIND {
+  SCAN_KIND_MISSING = 0,
+  SCAN_KIND_FILE = 1,
+  SCAN_KIND_DIRECTORY = 2,
+  SCAN_KIND_OTHER = 3,
+  SCAN_KIND_SYMLINK = 4,
+};
+
+// scanDirectory(path, stat, callback) lists a directory on the thread pool and
+// calls back with `(error, {names, kinds, sizes, mtimes})`: the names joined
+// by '\0' in the order of their bytes, a Buffer of SCAN_KIND values, and when
+// |stat| is true Buffers of doubles with the size and the modification time
+// in milliseconds of each entry. Only entries whose kind the directory doesn't
+// tell are stat'ed unless |stat| is true, spread over the thread pool.
+NAN_METHOD(ScanDirectory);
+
+#endif  // SRC_DIRECTORY_SCAN_H_
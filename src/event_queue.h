@@ -0,0 +1,110 @@
+#ifndef SRC_EVENT_QUEUE_H_
+#define SRC_EVENT_QUEUE_H_
+
+#include <stddef.h>
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free queue in the style of Dmitry Vyukov's MPMC queue. Any
+// number of threads may push, the main thread pops. Every cell carries a
+// sequence number which tells both sides whether the cell is ready for them,
+// so neither side ever takes a lock.
+template<typename T>
+class BoundedQueue {
+ public:
+  // |capacity| must be a power of two.
+  explicit BoundedQueue(size_t capacity)
+      : cells_(capacity),
+        mask_(capacity - 1),
+        head_(0),
+        tail_(0) {
+    for (size_t i = 0; i < capacity; ++i)
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  size_t capacity() const { return mask_ + 1; }
+
+  // Returns false when the queue is full, |value| is left untouched then.
+  bool TryPush(T& value) {
+    Cell* cell;
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+
+    cell->value = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Returns false when the queue is empty.
+  bool TryPop(T* value) {
+    Cell* cell;
+    size_t pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+
+    *value = std::move(cell->value);
+    cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Only a hint, the answer may be stale by the time it is used.
+  bool IsFull() const {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    const Cell& cell = cells_[pos & mask_];
+    return cell.sequence.load(std::memory_order_acquire) < pos;
+  }
+
+ private:
+  struct Cell {
+    Cell() : sequence(0) {}
+    Cell(const Cell& other)
+        : sequence(other.sequence.load(std::memory_order_relaxed)) {}
+
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  std::vector<Cell> cells_;
+  const size_t mask_;
+
+  // Keep the two ends on separate cache lines so producers and the consumer
+  // don't fight over the same line.
+  char pad0_[64];
+  std::atomic<size_t> head_;
+  char pad1_[64];
+  std::atomic<size_t> tail_;
+  char pad2_[64];
+
+  BoundedQueue(const BoundedQueue&);
+  BoundedQueue& operator=(const BoundedQueue&);
+};
+
+#endif  // SRC_EVENT_QUEUE_H_
@@ -1,32 +1,144 @@
 #include "handle_map.h"
 
-#include <algorithm>
+#include <stdint.h>
 
-HandleMap::HandleMap() {
+#include <utility>
+
+static const int32_t kEmptySlot = -1;
+static const size_t kMinSlots = 16;
+
+static inline uint64_t HandleBits(int32_t handle) {
+  return static_cast<uint32_t>(handle);
+}
+
+static inline uint64_t HandleBits(void* handle) {
+  return reinterpret_cast<uintptr_t>(handle);
+}
+
+HandleMap::HandleMap() : slots_(kMinSlots, kEmptySlot), next_sequence_(0) {
 }
 
 HandleMap::~HandleMap() {
   Clear();
 }
 
+size_t HandleMap::SlotOf(WatcherHandle key) const {
+  // Handles are mostly small consecutive integers, multiplying spreads them
+  // over the whole table.
+  uint64_t hash = HandleBits(key) * 0x9E3779B97F4A7C15ull;
+  return static_cast<size_t>(hash >> 32) & (slots_.size() - 1);
+}
+
+int32_t HandleMap::Find(WatcherHandle key) const {
+  size_t mask = slots_.size() - 1;
+  for (size_t slot = SlotOf(key); slots_[slot] != kEmptySlot; slot = (slot + 1) & mask) {
+    if (entries_[slots_[slot]].key == key)
+      return slots_[slot];
+  }
+  return -1;
+}
+
+void HandleMap::Rehash(size_t capacity) {
+  slots_.assign(capacity, kEmptySlot);
+  size_t mask = capacity - 1;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    size_t slot = SlotOf(entries_[i].key);
+    while (slots_[slot] != kEmptySlot)
+      slot = (slot + 1) & mask;
+    slots_[slot] = static_cast<int32_t>(i);
+  }
+}
+
+void HandleMap::Insert(WatcherHandle key, Local<Value> value) {
+  // Keep the table at most half full so probes stay short.
+  if ((entries_.size() + 1) * 2 > slots_.size())
+    Rehash(slots_.size() * 2);
+
+  size_t mask = slots_.size() - 1;
+  size_t slot = SlotOf(key);
+  while (slots_[slot] != kEmptySlot)
+    slot = (slot + 1) & mask;
+
+  slots_[slot] = static_cast<int32_t>(entries_.size());
+  entries_.push_back(Entry(key, value, next_sequence_++));
+}
+
 bool HandleMap::Has(WatcherHandle key) const {
-  return map_.find(key) != map_.end();
+  return Find(key) != -1;
 }
 
 bool HandleMap::Erase(WatcherHandle key) {
-  Map::iterator iter = map_.find(key);
-  if (iter == map_.end())
+  size_t mask = slots_.size() - 1;
+  size_t hole = SlotOf(key);
+  for (; slots_[hole] != kEmptySlot; hole = (hole + 1) & mask) {
+    if (entries_[slots_[hole]].key == key)
+      break;
+  }
+  if (slots_[hole] == kEmptySlot)
     return false;
 
-  NanDisposeUnsafePersistent(iter->second);
-  map_.erase(iter);
+  int32_t index = slots_[hole];
+
+  // Shift back the entries that probed past the hole, so lookups never need
+  // to skip over deleted slots.
+  for (size_t next = (hole + 1) & mask; slots_[next] != kEmptySlot; next = (next + 1) & mask) {
+    size_t home = SlotOf(entries_[slots_[next]].key);
+    bool stays = hole <= next ? (home > hole && home <= next)
+                              : (home > hole || home <= next);
+    if (!stays) {
+      slots_[hole] = slots_[next];
+      hole = next;
+    }
+  }
+  slots_[hole] = kEmptySlot;
+
+  Entry& entry = entries_[index];
+  if (!entry.path.empty()) {
+    PathIndex::iterator indexed = paths_.find(entry.path);
+    if (--indexed->second.count == 0)
+      paths_.erase(indexed);
+    else if (indexed->second.key == key)
+      indexed->second.key = LatestWithPath(entry.path, key);
+  }
+
+  // Fill the gap with the last entry and point its slot at the new place.
+  int32_t last = static_cast<int32_t>(entries_.size() - 1);
+  if (index != last) {
+    entry = std::move(entries_[last]);
+    size_t slot = SlotOf(entry.key);
+    while (slots_[slot] != last)
+      slot = (slot + 1) & mask;
+    slots_[slot] = index;
+  }
+  entries_.pop_back();
+  return true;
+}
+
+// Only walks the entries when several share |path|, which is rare.
+WatcherHandle HandleMap::LatestWithPath(const std::string& path, WatcherHandle except) const {
+  const Entry* latest = NULL;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    const Entry& entry = entries_[i];
+    if (entry.key != except && entry.path == path &&
+        (!latest || entry.sequence > latest->sequence))
+      latest = &entry;
+  }
+  return latest->key;
+}
+
+bool HandleMap::FindPath(const std::string& path, WatcherHandle* key) const {
+  PathIndex::const_iterator iter = paths_.find(path);
+  if (iter == paths_.end())
+    return false;
+
+  *key = iter->second.key;
   return true;
 }
 
 void HandleMap::Clear() {
-  for (Map::iterator iter = map_.begin(); iter != map_.end(); ++iter)
-    NanDisposeUnsafePersistent(iter->second);
-  map_.clear();
+  entries_.clear();
+  slots_.assign(kMinSlots, kEmptySlot);
+  paths_.clear();
 }
 
 // static
@@ -49,7 +161,15 @@ NAN_METHOD(HandleMap::Add) {
   if (obj->Has(key))
     return Nan::ThrowError("Duplicate key");
 
-  NanAssignUnsafePersistent(obj->map_[key], info[1]);
+  obj->Insert(key, info[1]);
+
+  if (info[2]->IsString()) {
+    String::Utf8Value path(v8::Isolate::GetCurrent(), info[2]);
+    obj->entries_.back().path = *path;
+    IndexedPath& indexed = obj->paths_[*path];
+    indexed.key = key;
+    ++indexed.count;
+  }
   return;
 }
 
@@ -61,11 +181,11 @@ NAN_METHOD(HandleMap::Get) {
     return Nan::ThrowTypeError("Bad argument");
 
   HandleMap* obj = Nan::ObjectWrap::Unwrap<HandleMap>(info.This());
-  WatcherHandle key = V8ValueToWatcherHandle(info[0]);
-  if (!obj->Has(key))
+  int32_t index = obj->Find(V8ValueToWatcherHandle(info[0]));
+  if (index == -1)
     return Nan::ThrowError("Invalid key");
 
-  info.GetReturnValue().Set(NanUnsafePersistentToLocal(obj->map_[key]));
+  info.GetReturnValue().Set(Nan::New(obj->entries_[index].value));
 }
 
 // static
@@ -79,24 +199,73 @@ NAN_METHOD(HandleMap::Has) {
   info.GetReturnValue().Set(Nan::New<Boolean>(obj->Has(V8ValueToWatcherHandle(info[0]))));
 }
 
+// static
+NAN_METHOD(HandleMap::GetByPath) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+
+  HandleMap* obj = Nan::ObjectWrap::Unwrap<HandleMap>(info.This());
+  String::Utf8Value path(v8::Isolate::GetCurrent(), info[0]);
+  WatcherHandle key;
+  if (obj->FindPath(*path, &key))
+    info.GetReturnValue().Set(Nan::New(obj->entries_[obj->Find(key)].value));
+}
+
+// static
+NAN_METHOD(HandleMap::HasPath) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+
+  HandleMap* obj = Nan::ObjectWrap::Unwrap<HandleMap>(info.This());
+  String::Utf8Value path(v8::Isolate::GetCurrent(), info[0]);
+  WatcherHandle key;
+  info.GetReturnValue().Set(Nan::New<Boolean>(obj->FindPath(*path, &key)));
+}
+
 // static
 NAN_METHOD(HandleMap::Values) {
   Nan::HandleScope scope;
 
   HandleMap* obj = Nan::ObjectWrap::Unwrap<HandleMap>(info.This());
 
-  int i = 0;
   v8::Local<v8::Context> context = Nan::GetCurrentContext();
-  v8::Local<Array> keys = Nan::New<Array>(obj->map_.size());
-  for (Map::const_iterator iter = obj->map_.begin();
-       iter != obj->map_.end();
-       ++iter, ++i) {
-    keys->Set(context, i, NanUnsafePersistentToLocal(iter->second)).FromJust();
-  }
+  v8::Local<Array> keys = Nan::New<Array>(obj->entries_.size());
+  for (size_t i = 0; i < obj->entries_.size(); ++i)
+    keys->Set(context, i, Nan::New(obj->entries_[i].value)).FromJust();
 
   info.GetReturnValue().Set(keys);
 }
 
+// static
+NAN_METHOD(HandleMap::ForEach) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsFunction())
+    return Nan::ThrowTypeError("Function required");
+
+  HandleMap* obj = Nan::ObjectWrap::Unwrap<HandleMap>(info.This());
+  Local<Function> callback = Local<Function>::Cast(info[0]);
+  Local<Object> receiver = Nan::GetCurrentContext()->Global();
+
+  // Walk backwards, so the callback can remove the entry it is given without
+  // another one being skipped: only visited entries move into the hole.
+  for (size_t i = obj->entries_.size(); i-- > 0;) {
+    if (i >= obj->entries_.size())
+      continue;
+
+    Local<Value> argv[] = {
+      Nan::New(obj->entries_[i].value),
+      WatcherHandleToV8Value(obj->entries_[i].key),
+    };
+    if (Nan::Call(callback, receiver, 2, argv).IsEmpty())
+      return;
+  }
+}
+
 // static
 NAN_METHOD(HandleMap::Remove) {
   Nan::HandleScope scope;
@@ -132,7 +301,10 @@ void HandleMap::Initialize(Local<Object> target) {
   Nan::SetPrototypeMethod(t, "add", Add);
   Nan::SetPrototypeMethod(t, "get", Get);
   Nan::SetPrototypeMethod(t, "has", Has);
+  Nan::SetPrototypeMethod(t, "getByPath", GetByPath);
+  Nan::SetPrototypeMethod(t, "hasPath", HasPath);
   Nan::SetPrototypeMethod(t, "values", Values);
+  Nan::SetPrototypeMethod(t, "forEach", ForEach);
   Nan::SetPrototypeMethod(t, "remove", Remove);
   Nan::SetPrototypeMethod(t, "clear", Clear);
 
@@ -1,36 +1,74 @@
 #ifndef SRC_HANDLE_MAP_H_
 #define SRC_HANDLE_MAP_H_
 
-#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 #include "common.h"
-#include "unsafe_persistent.h"
 
 class HandleMap : public Nan::ObjectWrap {
  public:
   static void Initialize(Local<Object> target);
 
  private:
-  typedef std::map<WatcherHandle, NanUnsafePersistent<Value> > Map;
+  struct Entry {
+    Entry(WatcherHandle key, Local<Value> value, uint64_t sequence)
+        : key(key), value(value), sequence(sequence) {}
+
+    WatcherHandle key;
+    Nan::Global<Value> value;
+    // The path it was added with, empty when it isn't indexed.
+    std::string path;
+    // When it was added, the latest of several entries with a path wins.
+    uint64_t sequence;
+  };
+
+  // The entry a path finds, and how many entries have the path.
+  struct IndexedPath {
+    WatcherHandle key;
+    size_t count;
+  };
+
+  typedef std::unordered_map<std::string, IndexedPath> PathIndex;
 
   HandleMap();
   virtual ~HandleMap();
 
+  // Returns the position of |key| in entries_, or -1.
+  int32_t Find(WatcherHandle key) const;
+  void Insert(WatcherHandle key, Local<Value> value);
   bool Has(WatcherHandle key) const;
   bool Erase(WatcherHandle key);
+  bool FindPath(const std::string& path, WatcherHandle* key) const;
+  // The most recently added entry with |path| other than |except|.
+  WatcherHandle LatestWithPath(const std::string& path, WatcherHandle except) const;
   void Clear();
 
-  static void DisposeHandle(NanUnsafePersistent<Value>& value);
+  size_t SlotOf(WatcherHandle key) const;
+  void Rehash(size_t capacity);
 
   static NAN_METHOD(New);
   static NAN_METHOD(Add);
   static NAN_METHOD(Get);
   static NAN_METHOD(Has);
+  static NAN_METHOD(GetByPath);
+  static NAN_METHOD(HasPath);
   static NAN_METHOD(Values);
+  static NAN_METHOD(ForEach);
   static NAN_METHOD(Remove);
   static NAN_METHOD(Clear);
 
-  Map map_;
+  // The values are kept packed in entries_, found through an open addressing
+  // table of positions in it. Lookups on the event path touch two arrays
+  // instead of a tree, and removing swaps the last entry into the hole.
+  std::vector<Entry> entries_;
+  std::vector<int32_t> slots_;
+  uint64_t next_sequence_;
+
+  // Values added with a path can be found by it without walking the map, the
+  // most recently added value wins when several share a path.
+  PathIndex paths_;
 };
 
 #endif  // SRC_HANDLE_MAP_H_
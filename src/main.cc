@@ -1,19 +1,47 @@
 #include "common.h"
+#include "contents_cache.h"
+#include "digest.h"
+#include "directory_scan.h"
 #include "handle_map.h"
+#include "path_router.h"
 
 namespace {
 
-void Init(Local<Object> exports) {
+uv_once_t g_init_once = UV_ONCE_INIT;
+
+// The watcher threads are shared by every environment the module is loaded
+// in, the first one starts them.
+void InitProcess() {
   CommonInit();
   PlatformInit();
+}
+
+void Init(Local<Object> exports) {
+  uv_once(&g_init_once, InitProcess);
+  Local<Value> data = CommonInitEnvironment();
 
-  Nan::SetMethod(exports, "setCallback", SetCallback);
-  Nan::SetMethod(exports, "watch", Watch);
-  Nan::SetMethod(exports, "unwatch", Unwatch);
+  Nan::SetMethod(exports, "setCallback", SetCallback, data);
+  Nan::SetMethod(exports, "setCoalesceWindow", SetCoalesceWindow, data);
+  Nan::SetMethod(exports, "setEventRing", SetEventRing, data);
+  Nan::SetMethod(exports, "watch", Watch, data);
+  Nan::SetMethod(exports, "watchTree", WatchTree, data);
+  Nan::SetMethod(exports, "watchMany", WatchMany, data);
+  Nan::SetMethod(exports, "watchAsync", WatchAsync, data);
+  Nan::SetMethod(exports, "watchTreeAsync", WatchTreeAsync, data);
+  Nan::SetMethod(exports, "unwatch", Unwatch, data);
+  Nan::SetMethod(exports, "getQueueStats", GetQueueStats, data);
+  Nan::SetMethod(exports, "getStats", GetStats, data);
+  Nan::SetMethod(exports, "changesSince", ChangesSince, data);
+  Nan::SetMethod(exports, "digest", Digest, data);
+  Nan::SetMethod(exports, "readFile", ReadFile, data);
+  Nan::SetMethod(exports, "readFileSync", ReadFileSync, data);
+  Nan::SetMethod(exports, "setContentsCacheLimit", SetContentsCacheLimit, data);
+  Nan::SetMethod(exports, "scanDirectory", ScanDirectory, data);
 
   HandleMap::Initialize(exports);
+  PathRouter::Initialize(exports);
 }
 
 }  // namespace
 
-NODE_MODULE(pathwatcher, Init)
+NAN_MODULE_WORKER_ENABLED(pathwatcher, Init)
@@ -0,0 +1,249 @@
+#include "path_filter.h"
+
+#include <string.h>
+
+static bool IsSeparator(char c) {
+  return c == '/' || c == '\\';
+}
+
+static void SplitPath(const std::string& path, std::vector<std::string>* segments) {
+  size_t start = 0;
+  while (start <= path.size()) {
+    size_t end = path.find('/', start);
+    if (end == std::string::npos)
+      end = path.size();
+    if (end > start)
+      segments->push_back(path.substr(start, end - start));
+    start = end + 1;
+  }
+}
+
+static bool HasWildcards(const std::string& segment) {
+  return segment.find_first_of("*?[\\") != std::string::npos;
+}
+
+// Matches a `[...]` class starting at |pattern|[*p] against |c|. Leaves *p
+// after the closing bracket, or returns false with *p untouched when the
+// class is unterminated and the bracket has to be taken literally.
+static bool MatchClass(const std::string& pattern, size_t* p, char c, bool* matched) {
+  size_t i = *p + 1;
+  bool negated = false;
+  if (i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^')) {
+    negated = true;
+    ++i;
+  }
+
+  bool found = false;
+  bool first = true;
+  for (; i < pattern.size(); ++i) {
+    if (pattern[i] == ']' && !first)
+      break;
+    first = false;
+
+    char low = pattern[i];
+    if (low == '\\' && i + 1 < pattern.size())
+      low = pattern[++i];
+    char high = low;
+    if (i + 2 < pattern.size() && pattern[i + 1] == '-' && pattern[i + 2] != ']') {
+      high = pattern[i + 2];
+      if (high == '\\' && i + 3 < pattern.size())
+        high = pattern[++i + 2];
+      i += 2;
+    }
+    if (c >= low && c <= high)
+      found = true;
+  }
+
+  if (i >= pattern.size())
+    return false;
+  *p = i + 1;
+  *matched = found != negated;
+  return true;
+}
+
+// Matches one path segment against one pattern segment.
+static bool MatchSegment(const std::string& pattern, const std::string& name) {
+  size_t p = 0;
+  size_t n = 0;
+  size_t star = std::string::npos;
+  size_t star_n = 0;
+
+  while (n < name.size()) {
+    if (p < pattern.size()) {
+      char c = pattern[p];
+      if (c == '*') {
+        star = ++p;
+        star_n = n;
+        continue;
+      }
+      if (c == '?') {
+        ++p;
+        ++n;
+        continue;
+      }
+      if (c == '[') {
+        size_t next = p;
+        bool matched;
+        if (MatchClass(pattern, &next, name[n], &matched)) {
+          if (matched) {
+            p = next;
+            ++n;
+            continue;
+          }
+        } else if (name[n] == '[') {
+          ++p;
+          ++n;
+          continue;
+        }
+      } else {
+        if (c == '\\' && p + 1 < pattern.size())
+          c = pattern[++p];
+        if (c == name[n]) {
+          ++p;
+          ++n;
+          continue;
+        }
+      }
+    }
+
+    // Mismatch, let the last `*` swallow one more character.
+    if (star == std::string::npos)
+      return false;
+    p = star;
+    n = ++star_n;
+  }
+
+  while (p < pattern.size() && pattern[p] == '*')
+    ++p;
+  return p == pattern.size();
+}
+
+static bool MatchSegments(const std::vector<std::string>& pattern,
+                          size_t p,
+                          const std::vector<std::string>& path,
+                          size_t n) {
+  for (; p < pattern.size(); ++p, ++n) {
+    if (pattern[p] == "**") {
+      // Try to have `**` stand for as few segments as possible first.
+      for (size_t skip = n; skip <= path.size(); ++skip) {
+        if (MatchSegments(pattern, p + 1, path, skip))
+          return true;
+      }
+      return false;
+    }
+    if (n >= path.size() || !MatchSegment(pattern[p], path[n]))
+      return false;
+  }
+  return n == path.size();
+}
+
+PathMatcher::PathMatcher() : has_negations_(false) {
+}
+
+void PathMatcher::Add(const std::string& line) {
+  std::string pattern(line);
+  while (!pattern.empty() && (pattern[pattern.size() - 1] == ' ' ||
+                              pattern[pattern.size() - 1] == '\r'))
+    pattern.erase(pattern.size() - 1);
+  if (pattern.empty() || pattern[0] == '#')
+    return;
+
+  Pattern compiled;
+  compiled.negated = pattern[0] == '!';
+  if (compiled.negated)
+    pattern.erase(0, 1);
+  else if (pattern[0] == '\\' && pattern.size() > 1 &&
+           (pattern[1] == '!' || pattern[1] == '#'))
+    pattern.erase(0, 1);
+
+  compiled.directory_only = !pattern.empty() && pattern[pattern.size() - 1] == '/';
+  if (compiled.directory_only)
+    pattern.erase(pattern.size() - 1);
+
+  // A slash anywhere but at the end anchors the pattern to the watched
+  // directory, otherwise it matches at any depth.
+  bool anchored = pattern.find('/') != std::string::npos;
+  if (!anchored)
+    compiled.segments.push_back("**");
+  SplitPath(pattern, &compiled.segments);
+  if (compiled.segments.empty() ||
+      (compiled.segments.size() == 1 && compiled.segments[0] == "**" && !anchored))
+    return;
+
+  if (!anchored && !compiled.negated && !HasWildcards(compiled.segments[1])) {
+    if (compiled.directory_only)
+      directory_names_.insert(compiled.segments[1]);
+    else
+      names_.insert(compiled.segments[1]);
+  }
+
+  has_negations_ = has_negations_ || compiled.negated;
+  patterns_.push_back(compiled);
+}
+
+bool PathMatcher::Matches(const std::string& path, bool is_dir) const {
+  if (patterns_.empty())
+    return false;
+
+  // Without negations any match decides, so a plain name is enough.
+  if (!has_negations_) {
+    size_t slash = path.rfind('/');
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    if (names_.count(name) > 0 || (is_dir && directory_names_.count(name) > 0))
+      return true;
+    if (names_.size() + directory_names_.size() == patterns_.size())
+      return false;
+  }
+
+  std::vector<std::string> segments;
+  SplitPath(path, &segments);
+  for (size_t i = patterns_.size(); i > 0; --i) {
+    const Pattern& pattern = patterns_[i - 1];
+    if (pattern.directory_only && !is_dir)
+      continue;
+    if (MatchSegments(pattern.segments, 0, segments, 0))
+      return !pattern.negated;
+  }
+  return false;
+}
+
+bool PathFilter::IsIgnored(const std::string& path, bool is_dir) const {
+  if (ignore.empty())
+    return false;
+
+  // Nothing inside an ignored directory can be brought back.
+  for (size_t slash = path.find('/'); slash != std::string::npos;
+       slash = path.find('/', slash + 1)) {
+    if (ignore.Matches(path.substr(0, slash), true))
+      return true;
+  }
+  return ignore.Matches(path, is_dir);
+}
+
+bool PathFilter::ShouldDescend(const std::string& path) const {
+  return !IsIgnored(path, true);
+}
+
+bool PathFilter::ShouldReport(const std::string& path, bool is_dir) const {
+  if (IsIgnored(path, is_dir))
+    return false;
+  return include.empty() || include.Matches(path, is_dir);
+}
+
+bool RelativePath(const std::string& root, const std::string& path, std::string* relative) {
+  // A root like "/" or "C:\\" already ends in the separator.
+  size_t prefix = root.size();
+  if (root.empty() || !IsSeparator(root[root.size() - 1]))
+    ++prefix;
+  if (path.size() <= prefix ||
+      path.compare(0, root.size(), root) != 0 ||
+      !IsSeparator(path[prefix - 1]))
+    return false;
+
+  relative->assign(path, prefix, std::string::npos);
+  for (size_t i = 0; i < relative->size(); ++i) {
+    if ((*relative)[i] == '\\')
+      (*relative)[i] = '/';
+  }
+  return true;
+}
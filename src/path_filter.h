@@ -0,0 +1,69 @@
+#ifndef SRC_PATH_FILTER_H_
+#define SRC_PATH_FILTER_H_
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+// A list of gitignore style patterns: `*`, `?` and `[...]` match within a path
+// segment, `**` matches any number of segments, a leading `!` negates, a
+// trailing `/` only matches directories, and a pattern without any other `/`
+// matches the name at any depth. The last matching pattern wins.
+class PathMatcher {
+ public:
+  PathMatcher();
+
+  void Add(const std::string& pattern);
+  bool empty() const { return patterns_.empty(); }
+
+  // |path| is relative to the watched directory and separated by '/'.
+  bool Matches(const std::string& path, bool is_dir) const;
+
+ private:
+  struct Pattern {
+    std::vector<std::string> segments;
+    bool negated;
+    bool directory_only;
+  };
+
+  std::vector<Pattern> patterns_;
+
+  // Plain names like `node_modules` or `.git`, which make up most ignore
+  // lists, are looked up here instead of being matched one by one.
+  std::set<std::string> names_;
+  std::set<std::string> directory_names_;
+  bool has_negations_;
+};
+
+// What a watch reports: paths matched by |ignore|, or inside a directory
+// matched by it, are dropped; when |include| is not empty only the paths it
+// matches are reported. Evaluated on the watcher threads, so it is immutable
+// once handed to a backend.
+class PathFilter {
+ public:
+  PathMatcher ignore;
+  PathMatcher include;
+
+  // Whether a directory below the watched one has to be watched at all.
+  bool ShouldDescend(const std::string& path) const;
+  bool ShouldReport(const std::string& path, bool is_dir) const;
+
+ private:
+  bool IsIgnored(const std::string& path, bool is_dir) const;
+};
+
+typedef std::shared_ptr<const PathFilter> PathFilterPtr;
+
+// Returns |path| relative to |root| when it is below it, used by backends to
+// turn the full path of an event into what the patterns are matched against.
+bool RelativePath(const std::string& root, const std::string& path, std::string* relative);
+
+// Helper for the backends, a missing filter reports everything.
+inline bool FilterAccepts(const PathFilterPtr& filter,
+                          const std::string& relative,
+                          bool is_dir) {
+  return !filter || filter->ShouldReport(relative, is_dir);
+}
+
+#endif  // SRC_PATH_FILTER_H_
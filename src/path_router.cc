@@ -0,0 +1,185 @@
+#include "path_router.h"
+
+#include <algorithm>
+#include <utility>
+
+static inline bool IsSeparator(char c) {
+#ifdef _WIN32
+  return c == '/' || c == '\\';
+#else
+  return c == '/';
+#endif
+}
+
+PathRouter::PathRouter() : next_id_(1) {
+}
+
+PathRouter::~PathRouter() {
+}
+
+PathRouter::Node* PathRouter::Walk(const std::string& path, bool create) {
+  Node* node = &root_;
+  size_t start = 0;
+  while (start < path.size()) {
+    size_t end = start;
+    while (end < path.size() && !IsSeparator(path[end]))
+      ++end;
+    if (end > start) {
+      std::string name(path, start, end - start);
+      std::unordered_map<std::string, std::unique_ptr<Node> >::iterator child =
+          node->children.find(name);
+      if (child == node->children.end()) {
+        if (!create)
+          return NULL;
+        Node* added = new Node;
+        added->parent = node;
+        added->name = name;
+        child = node->children.insert(std::make_pair(name, std::unique_ptr<Node>(added))).first;
+      }
+      node = child->second.get();
+    }
+    start = end + 1;
+  }
+  return node;
+}
+
+uint32_t PathRouter::Insert(const std::string& path, Local<Value> value) {
+  uint32_t id = next_id_++;
+  Node* node = Walk(path, true);
+  node->subscriptions.push_back(id);
+  subscriptions_.insert(std::make_pair(id, Subscription(value, node)));
+  return id;
+}
+
+bool PathRouter::Erase(uint32_t id) {
+  std::unordered_map<uint32_t, Subscription>::iterator iter = subscriptions_.find(id);
+  if (iter == subscriptions_.end())
+    return false;
+
+  Node* node = iter->second.node;
+  subscriptions_.erase(iter);
+  node->subscriptions.erase(std::find(node->subscriptions.begin(), node->subscriptions.end(), id));
+
+  // Drop the nodes nothing is subscribed to or below anymore.
+  while (node != &root_ && node->subscriptions.empty() && node->children.empty()) {
+    Node* parent = node->parent;
+    parent->children.erase(node->name);
+    node = parent;
+  }
+  return true;
+}
+
+void PathRouter::Collect(const std::string& path, std::vector<uint32_t>* ids) {
+  Node* node = Walk(path, false);
+  if (!node)
+    return;
+  for (size_t i = 0; i < node->subscriptions.size(); ++i) {
+    if (std::find(ids->begin(), ids->end(), node->subscriptions[i]) == ids->end())
+      ids->push_back(node->subscriptions[i]);
+  }
+}
+
+// static
+NAN_METHOD(PathRouter::New) {
+  Nan::HandleScope scope;
+  PathRouter* obj = new PathRouter();
+  obj->Wrap(info.This());
+  return;
+}
+
+// static
+NAN_METHOD(PathRouter::Add) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsString())
+    return Nan::ThrowTypeError("String required");
+
+  PathRouter* obj = Nan::ObjectWrap::Unwrap<PathRouter>(info.This());
+  String::Utf8Value path(v8::Isolate::GetCurrent(), info[0]);
+  uint32_t id = obj->Insert(std::string(*path, path.length()), info[1]);
+  info.GetReturnValue().Set(Nan::New<Uint32>(id));
+}
+
+// static
+NAN_METHOD(PathRouter::Remove) {
+  Nan::HandleScope scope;
+
+  if (!info[0]->IsUint32())
+    return Nan::ThrowTypeError("Bad argument");
+
+  PathRouter* obj = Nan::ObjectWrap::Unwrap<PathRouter>(info.This());
+  if (!obj->Erase(Nan::To<uint32_t>(info[0]).FromJust()))
+    return Nan::ThrowError("Invalid subscription");
+
+  return;
+}
+
+// static
+NAN_METHOD(PathRouter::Match) {
+  Nan::HandleScope scope;
+
+  // The paths of an event, the second one only for a rename. Each subscriber
+  // is returned once, in the order it subscribed in for a single path.
+  PathRouter* obj = Nan::ObjectWrap::Unwrap<PathRouter>(info.This());
+  std::vector<uint32_t> ids;
+  for (int i = 0; i < 2 && i < info.Length(); ++i) {
+    if (!info[i]->IsString())
+      continue;
+    String::Utf8Value path(v8::Isolate::GetCurrent(), info[i]);
+    obj->Collect(std::string(*path, path.length()), &ids);
+  }
+
+  // Nothing to allocate for the events nobody subscribed to.
+  if (ids.empty())
+    return;
+
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Array> values = Nan::New<Array>(ids.size());
+  for (size_t i = 0; i < ids.size(); ++i)
+    values->Set(context, i, Nan::New(obj->subscriptions_.find(ids[i])->second.value)).FromJust();
+  info.GetReturnValue().Set(values);
+}
+
+// static
+NAN_METHOD(PathRouter::Values) {
+  Nan::HandleScope scope;
+
+  PathRouter* obj = Nan::ObjectWrap::Unwrap<PathRouter>(info.This());
+
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  Local<Array> values = Nan::New<Array>(obj->subscriptions_.size());
+  uint32_t index = 0;
+  std::unordered_map<uint32_t, Subscription>::const_iterator iter = obj->subscriptions_.begin();
+  for (; iter != obj->subscriptions_.end(); ++iter)
+    values->Set(context, index++, Nan::New(iter->second.value)).FromJust();
+
+  info.GetReturnValue().Set(values);
+}
+
+// static
+NAN_METHOD(PathRouter::Size) {
+  Nan::HandleScope scope;
+
+  PathRouter* obj = Nan::ObjectWrap::Unwrap<PathRouter>(info.This());
+  info.GetReturnValue().Set(Nan::New<Uint32>(static_cast<uint32_t>(obj->subscriptions_.size())));
+}
+
+// static
+void PathRouter::Initialize(Local<Object> target) {
+  Nan::HandleScope scope;
+
+  Local<FunctionTemplate> t = Nan::New<FunctionTemplate>(PathRouter::New);
+  t->InstanceTemplate()->SetInternalFieldCount(1);
+  t->SetClassName(Nan::New<String>("PathRouter").ToLocalChecked());
+
+  Nan::SetPrototypeMethod(t, "add", Add);
+  Nan::SetPrototypeMethod(t, "remove", Remove);
+  Nan::SetPrototypeMethod(t, "match", Match);
+  Nan::SetPrototypeMethod(t, "values", Values);
+  Nan::SetPrototypeMethod(t, "size", Size);
+
+  Local<v8::Context> context = Nan::GetCurrentContext();
+  target->Set(context,
+              Nan::New<String>("PathRouter").ToLocalChecked(),
+              t->GetFunction(context).ToLocalChecked()).FromJust();
+}
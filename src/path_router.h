@@ -0,0 +1,60 @@
+#ifndef SRC_PATH_ROUTER_H_
+#define SRC_PATH_ROUTER_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+// Values subscribed to paths, kept in a trie of path components. Finding the
+// subscribers of an event's path takes one step per component however many
+// there are, instead of comparing the path against every one of them.
+class PathRouter : public Nan::ObjectWrap {
+ public:
+  static void Initialize(Local<Object> target);
+
+ private:
+  struct Node {
+    Node() : parent(NULL) {}
+
+    Node* parent;
+    // The component it is found under in its parent.
+    std::string name;
+    std::unordered_map<std::string, std::unique_ptr<Node> > children;
+    std::vector<uint32_t> subscriptions;
+  };
+
+  struct Subscription {
+    Subscription(Local<Value> value, Node* node) : value(value), node(node) {}
+
+    Nan::Global<Value> value;
+    Node* node;
+  };
+
+  PathRouter();
+  virtual ~PathRouter();
+
+  // Returns the node of |path|, creating what is missing with |create|.
+  Node* Walk(const std::string& path, bool create);
+  uint32_t Insert(const std::string& path, Local<Value> value);
+  bool Erase(uint32_t id);
+  // Adds the subscriptions of |path| that aren't in |ids| yet.
+  void Collect(const std::string& path, std::vector<uint32_t>* ids);
+
+  static NAN_METHOD(New);
+  static NAN_METHOD(Add);
+  static NAN_METHOD(Remove);
+  static NAN_METHOD(Match);
+  static NAN_METHOD(Values);
+  static NAN_METHOD(Size);
+
+  Node root_;
+  std::unordered_map<uint32_t, Subscription> subscriptions_;
+  uint32_t next_id_;
+};
+
+#endif  // SRC_PATH_ROUTER_H_
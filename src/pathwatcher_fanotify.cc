@@ -0,0 +1,693 @@
+#include "pathwatcher_fanotify.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+
+// FAN_RENAME reports both ends of a rename in one event, which spares us the
+// guesswork of pairing moves without cookies. It needs Linux 5.17, on older
+// kernels marking fails and inotify is used.
+#if defined(FAN_REPORT_DFID_NAME) && defined(FAN_RENAME)
+
+// Resolved directory handles are cached, the cache is simply dropped when it
+// grows past this or when a directory is moved or deleted.
+static const size_t kDirectoryCacheLimit = 16384;
+
+static const uint64_t kMarkMask = FAN_CREATE | FAN_DELETE | FAN_MODIFY |
+    FAN_ATTRIB | FAN_RENAME | FAN_ONDIR;
+
+static int g_fanotify = -1;
+// Written to stop the reader thread.
+static int g_fanotify_stop = -1;
+static uv_thread_t g_fanotify_thread;
+static uv_mutex_t g_fanotify_mutex;
+
+struct Subscription {
+  // The path as it was asked for, events are reported under it.
+  std::string path;
+  // The same path with symlinks resolved, the paths of events are always
+  // canonical since they come from the kernel's view of the directories.
+  std::string real_path;
+  bool recursive;
+  PathFilterPtr filter;
+  // What it added to g_watched_directories, empty for trees and when the
+  // handles of its directories couldn't be taken.
+  std::vector<std::string> directory_keys;
+};
+
+// Every filesystem we hold a mark on, keyed by fsid, with a descriptor to
+// pass to open_by_handle_at() and the number of subscriptions using it.
+struct Filesystem {
+  int mount_fd;
+  int users;
+};
+
+static std::map<WatcherHandle, Subscription> g_subscriptions;
+static std::multimap<std::string, WatcherHandle> g_paths;
+static std::multimap<std::string, WatcherHandle> g_tree_roots;
+static std::map<WatcherHandle, std::string> g_subscription_fsids;
+static std::map<std::string, Filesystem> g_filesystems;
+static WatcherHandle g_next_handle = kFanotifyHandleBase;
+
+// The marks cover whole filesystems, so most events are about directories
+// nobody watches. The handles of the directories a watch gets events from
+// are kept here, keyed like g_directory_cache, and events from any other
+// directory are dropped before anything is resolved. Trees, and watches
+// whose directories have no handle, need every event resolved and are
+// counted in g_unkeyed_subscriptions instead.
+static std::multiset<std::string> g_watched_directories;
+static int g_unkeyed_subscriptions = 0;
+
+// Only touched by the reader thread.
+static std::map<std::string, std::string> g_directory_cache;
+
+struct ScopedLocker {
+  explicit ScopedLocker(uv_mutex_t& mutex) : mutex_(&mutex) { uv_mutex_lock(mutex_); }
+  ~ScopedLocker() { uv_mutex_unlock(mutex_); }
+
+  uv_mutex_t* mutex_;
+};
+
+static std::string FsidKey(const __kernel_fsid_t& fsid) {
+  return std::string(reinterpret_cast<const char*>(&fsid), sizeof(fsid));
+}
+
+static std::string ParentOf(const std::string& path) {
+  size_t slash = path.rfind('/');
+  if (slash == std::string::npos)
+    return std::string();
+  if (slash == 0)
+    return "/";
+  return path.substr(0, slash);
+}
+
+static std::vector<char> ToVector(const std::string& path) {
+  return std::vector<char>(path.begin(), path.end());
+}
+
+static bool Contains(const std::vector<WatcherHandle>& handles,
+                     WatcherHandle handle) {
+  return std::find(handles.begin(), handles.end(), handle) != handles.end();
+}
+
+static std::string HandleKey(const __kernel_fsid_t& fsid, const file_handle* handle) {
+  std::string key = FsidKey(fsid);
+  key.append(reinterpret_cast<const char*>(handle),
+             sizeof(*handle) + handle->handle_bytes);
+  return key;
+}
+
+// The key the events about the entries of the directory |path| carry.
+static bool DirectoryKey(const std::string& path, std::string* key) {
+  struct statfs fs;
+  if (statfs(path.c_str(), &fs) == -1)
+    return false;
+
+  struct {
+    file_handle handle;
+    unsigned char bytes[MAX_HANDLE_SZ];
+  } storage;
+  storage.handle.handle_bytes = MAX_HANDLE_SZ;
+  int mount_id;
+  if (name_to_handle_at(AT_FDCWD, path.c_str(), &storage.handle, &mount_id, 0) == -1)
+    return false;
+
+  __kernel_fsid_t fsid;
+  memcpy(&fsid, &fs.f_fsid, sizeof(fsid));
+  *key = HandleKey(fsid, &storage.handle);
+  return true;
+}
+
+static bool ResolveDirectory(const __kernel_fsid_t& fsid,
+                             file_handle* handle,
+                             std::string* path) {
+  std::string key = HandleKey(fsid, handle);
+
+  std::map<std::string, std::string>::const_iterator cached =
+      g_directory_cache.find(key);
+  if (cached != g_directory_cache.end()) {
+    *path = cached->second;
+    return true;
+  }
+
+  int mount_fd;
+  {
+    ScopedLocker locker(g_fanotify_mutex);
+    std::map<std::string, Filesystem>::const_iterator fs =
+        g_filesystems.find(FsidKey(fsid));
+    if (fs == g_filesystems.end())
+      return false;
+    mount_fd = fs->second.mount_fd;
+  }
+
+  int fd = open_by_handle_at(mount_fd, handle, O_PATH | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+
+  char proc_path[64];
+  char buffer[PATH_MAX];
+  snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+  ssize_t length = readlink(proc_path, buffer, sizeof(buffer));
+  close(fd);
+  if (length <= 0 || length == sizeof(buffer))
+    return false;
+
+  static const char kDeleted[] = " (deleted)";
+  std::string resolved(buffer, length);
+  if (resolved.size() > sizeof(kDeleted) - 1 &&
+      resolved.compare(resolved.size() - (sizeof(kDeleted) - 1),
+                       std::string::npos, kDeleted) == 0)
+    return false;
+
+  if (g_directory_cache.size() >= kDirectoryCacheLimit)
+    g_directory_cache.clear();
+  g_directory_cache[key] = resolved;
+  *path = resolved;
+  return true;
+}
+
+// A subscription that is interested in a path, either because it watches
+// the path itself or because it watches a directory above it.
+struct Target {
+  WatcherHandle handle;
+  bool self;
+  // The path to report for a child, under the path that was watched.
+  std::string path;
+};
+
+// Must be called with g_fanotify_mutex held.
+static std::string ReportedPath(WatcherHandle handle, const std::string& path) {
+  std::map<WatcherHandle, Subscription>::const_iterator iter = g_subscriptions.find(handle);
+  if (iter == g_subscriptions.end() || iter->second.path == iter->second.real_path)
+    return path;
+  const std::string& real_path = iter->second.real_path;
+  return iter->second.path + path.substr(real_path == "/" ? real_path.size() - 1 : real_path.size());
+}
+
+// Must be called with g_fanotify_mutex held.
+static bool SubscriptionAccepts(WatcherHandle handle, const std::string& path, bool is_dir) {
+  std::map<WatcherHandle, Subscription>::const_iterator iter = g_subscriptions.find(handle);
+  std::string relative;
+  if (iter == g_subscriptions.end() || !iter->second.filter ||
+      !RelativePath(iter->second.real_path, path, &relative))
+    return true;
+  return iter->second.filter->ShouldReport(relative, is_dir);
+}
+
+// Collects the subscriptions that care about |path|: direct subscriptions of
+// the path itself or of its parent directory, and trees rooted at or above it
+// whose filters accept it.
+static void CollectTargets(const std::string& path,
+                           bool is_dir,
+                           std::vector<Target>* targets) {
+  typedef std::multimap<std::string, WatcherHandle>::const_iterator Iter;
+  ScopedLocker locker(g_fanotify_mutex);
+
+  Target target;
+  target.self = true;
+  std::pair<Iter, Iter> range = g_paths.equal_range(path);
+  for (Iter iter = range.first; iter != range.second; ++iter) {
+    target.handle = iter->second;
+    targets->push_back(target);
+  }
+  range = g_tree_roots.equal_range(path);
+  for (Iter iter = range.first; iter != range.second; ++iter) {
+    target.handle = iter->second;
+    targets->push_back(target);
+  }
+
+  target.self = false;
+  std::string dir = ParentOf(path);
+  range = g_paths.equal_range(dir);
+  for (Iter iter = range.first; iter != range.second; ++iter) {
+    target.handle = iter->second;
+    target.path = ReportedPath(target.handle, path);
+    if (SubscriptionAccepts(target.handle, path, is_dir))
+      targets->push_back(target);
+  }
+  for (; !dir.empty(); dir = dir == "/" ? std::string() : ParentOf(dir)) {
+    range = g_tree_roots.equal_range(dir);
+    for (Iter iter = range.first; iter != range.second; ++iter) {
+      target.handle = iter->second;
+      target.path = ReportedPath(target.handle, path);
+      if (SubscriptionAccepts(target.handle, path, is_dir))
+        targets->push_back(target);
+    }
+  }
+}
+
+static bool HasTargets(const std::string& path, bool is_dir) {
+  std::vector<Target> targets;
+  CollectTargets(path, is_dir, &targets);
+  return !targets.empty();
+}
+
+static void Dispatch(EVENT_TYPE self_type,
+                     EVENT_TYPE child_type,
+                     const std::string& path,
+                     bool is_dir) {
+  std::vector<Target> targets;
+  CollectTargets(path, is_dir, &targets);
+
+  for (size_t i = 0; i < targets.size(); ++i) {
+    if (targets[i].self)
+      PostEvent(self_type, targets[i].handle, std::vector<char>());
+    else
+      PostEvent(child_type, targets[i].handle, ToVector(targets[i].path));
+  }
+}
+
+// A move is reported as a rename to the subscriptions that see both ends of
+// it, everybody else sees a delete or a create.
+static void DispatchMove(const std::string& old_path,
+                         const std::string& path,
+                         bool is_dir) {
+  std::vector<Target> old_targets;
+  std::vector<Target> new_targets;
+  CollectTargets(old_path, is_dir, &old_targets);
+  CollectTargets(path, is_dir, &new_targets);
+
+  std::vector<WatcherHandle> renamed;
+  for (size_t i = 0; i < old_targets.size(); ++i) {
+    if (old_targets[i].self)
+      continue;
+    for (size_t j = 0; j < new_targets.size(); ++j) {
+      if (!new_targets[j].self && new_targets[j].handle == old_targets[i].handle) {
+        renamed.push_back(old_targets[i].handle);
+        PostEvent(EVENT_CHILD_RENAME, old_targets[i].handle,
+                  ToVector(new_targets[j].path), ToVector(old_targets[i].path));
+        break;
+      }
+    }
+  }
+
+  for (size_t i = 0; i < old_targets.size(); ++i) {
+    if (old_targets[i].self)
+      PostEvent(EVENT_DELETE, old_targets[i].handle, std::vector<char>());
+    else if (!Contains(renamed, old_targets[i].handle))
+      PostEvent(EVENT_CHILD_DELETE, old_targets[i].handle, ToVector(old_targets[i].path));
+  }
+  for (size_t i = 0; i < new_targets.size(); ++i) {
+    if (new_targets[i].self)
+      PostEvent(EVENT_CHANGE, new_targets[i].handle, std::vector<char>());
+    else if (!Contains(renamed, new_targets[i].handle))
+      PostEvent(EVENT_CHILD_CREATE, new_targets[i].handle, ToVector(new_targets[i].path));
+  }
+}
+
+// Reads the path of a DFID_NAME style record, returns false when its
+// directory is gone.
+static bool ResolveRecord(const fanotify_event_info_fid* fid, std::string* path) {
+  file_handle* handle = reinterpret_cast<file_handle*>(
+      const_cast<unsigned char*>(fid->handle));
+  const char* name = reinterpret_cast<const char*>(
+      fid->handle + sizeof(*handle) + handle->handle_bytes);
+
+  if (!ResolveDirectory(fid->fsid, handle, path))
+    return false;
+  if (strcmp(name, ".") != 0) {
+    if (*path != "/")
+      *path += '/';
+    *path += name;
+  }
+  return true;
+}
+
+// Whether a watch may care about an event from the directory of |fid|,
+// told without resolving it.
+static bool IsWatchedDirectory(const fanotify_event_info_fid* fid) {
+  std::string key = HandleKey(fid->fsid, reinterpret_cast<const file_handle*>(fid->handle));
+  ScopedLocker locker(g_fanotify_mutex);
+  return g_unkeyed_subscriptions > 0 || g_watched_directories.count(key) > 0;
+}
+
+static void ProcessEvent(const fanotify_event_metadata* metadata) {
+  const char* end = reinterpret_cast<const char*>(metadata) + metadata->event_len;
+  const char* info = reinterpret_cast<const char*>(metadata) + metadata->metadata_len;
+
+  const fanotify_event_info_fid* record = NULL;
+  const fanotify_event_info_fid* old_record = NULL;
+  while (info + sizeof(fanotify_event_info_header) <= end) {
+    const fanotify_event_info_fid* fid =
+        reinterpret_cast<const fanotify_event_info_fid*>(info);
+    if (fid->hdr.len == 0)
+      break;
+    info += fid->hdr.len;
+
+    switch (fid->hdr.info_type) {
+      case FAN_EVENT_INFO_TYPE_DFID_NAME:
+      case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+        record = fid;
+        break;
+      case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+        old_record = fid;
+        break;
+    }
+  }
+
+  uint64_t mask = metadata->mask;
+  bool is_dir = (mask & FAN_ONDIR) != 0;
+
+  // The paths of everything below a directory that moves or goes away
+  // change, so forget what we know about them.
+  if (is_dir && (mask & (FAN_RENAME | FAN_DELETE)))
+    g_directory_cache.clear();
+
+  // Activity elsewhere on the filesystem stops here, before any syscall.
+  bool watched = record != NULL && IsWatchedDirectory(record);
+  bool old_watched = old_record != NULL && IsWatchedDirectory(old_record);
+  if (!watched && !old_watched)
+    return;
+
+  std::string path;
+  std::string old_path;
+  bool has_path = watched && ResolveRecord(record, &path);
+  bool has_old_path = old_watched && ResolveRecord(old_record, &old_path);
+
+  if (mask & FAN_RENAME) {
+    if (has_old_path && has_path)
+      DispatchMove(old_path, path, is_dir);
+    else if (has_old_path)
+      Dispatch(EVENT_DELETE, EVENT_CHILD_DELETE, old_path, is_dir);
+    else if (has_path)
+      Dispatch(EVENT_CHANGE, EVENT_CHILD_CREATE, path, is_dir);
+    return;
+  }
+
+  if (!has_path || !HasTargets(path, is_dir))
+    return;
+
+  // Queued events about the same name are merged by the kernel, so one event
+  // can carry a creation, changes and a deletion. If the path still exists it
+  // went away before it came back, otherwise the other way round.
+  struct stat st;
+  bool exists = lstat(path.c_str(), &st) == 0;
+  if (exists && (mask & FAN_DELETE))
+    Dispatch(EVENT_DELETE, EVENT_CHILD_DELETE, path, is_dir);
+  if (mask & FAN_CREATE)
+    Dispatch(EVENT_CHANGE, EVENT_CHILD_CREATE, path, is_dir);
+  if (mask & (FAN_MODIFY | FAN_ATTRIB))
+    Dispatch(EVENT_CHANGE, EVENT_CHILD_CHANGE, path, is_dir);
+  if (!exists && (mask & FAN_DELETE))
+    Dispatch(EVENT_DELETE, EVENT_CHILD_DELETE, path, is_dir);
+}
+
+static void HandleOverflow() {
+  // Whatever was renamed or deleted meanwhile went unnoticed.
+  g_directory_cache.clear();
+
+  std::vector<WatcherHandle> handles;
+  {
+    ScopedLocker locker(g_fanotify_mutex);
+    for (std::map<WatcherHandle, Subscription>::const_iterator iter =
+             g_subscriptions.begin();
+         iter != g_subscriptions.end();
+         ++iter)
+      handles.push_back(iter->first);
+  }
+  for (size_t i = 0; i < handles.size(); ++i)
+    PostEvent(EVENT_OVERFLOW, handles[i], std::vector<char>());
+}
+
+static void FanotifyThread(void* arg) {
+  // fanotify events carry a file handle and a name, so leave room for a
+  // good number of them per read.
+  static char buf[64 * 1024];
+
+  while (true) {
+    pollfd fds[2];
+    fds[0].fd = g_fanotify;
+    fds[0].events = POLLIN;
+    fds[1].fd = g_fanotify_stop;
+    fds[1].events = POLLIN;
+    int ready = poll(fds, 2, -1);
+    if (ready == -1 && errno == EINTR)
+      continue;
+    if (ready == -1 || fds[1].revents != 0)
+      break;
+
+    ssize_t size;
+    do {
+      size = read(g_fanotify, buf, sizeof(buf));
+    } while (size == -1 && errno == EINTR);
+
+    if (size == -1 && errno == EAGAIN)
+      continue;
+    if (size <= 0)
+      break;
+    SetEventReadTime(uv_hrtime());
+
+    const fanotify_event_metadata* metadata =
+        reinterpret_cast<const fanotify_event_metadata*>(buf);
+    int remaining = static_cast<int>(size);
+    for (; FAN_EVENT_OK(metadata, remaining);
+         metadata = FAN_EVENT_NEXT(metadata, remaining)) {
+      if (metadata->vers != FANOTIFY_METADATA_VERSION)
+        return;
+      uint64_t posted = PostedEvents();
+      if (metadata->mask & FAN_Q_OVERFLOW)
+        HandleOverflow();
+      else
+        ProcessEvent(metadata);
+      CountRawEvent(posted);
+    }
+  }
+}
+
+// Resolving the handles in events needs CAP_DAC_READ_SEARCH on top of the
+// CAP_SYS_ADMIN fanotify_init() checks for, try it on the root directory.
+static bool CanOpenByHandle() {
+  struct {
+    file_handle handle;
+    unsigned char bytes[MAX_HANDLE_SZ];
+  } storage;
+  storage.handle.handle_bytes = MAX_HANDLE_SZ;
+  int mount_id;
+  if (name_to_handle_at(AT_FDCWD, "/", &storage.handle, &mount_id, 0) == -1)
+    return false;
+
+  int root = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root == -1)
+    return false;
+  int fd = open_by_handle_at(root, &storage.handle, O_PATH | O_CLOEXEC);
+  close(root);
+  if (fd == -1)
+    return false;
+  close(fd);
+  return true;
+}
+
+#if NODE_VERSION_AT_LEAST(10, 2, 0)
+static void StopFanotify(void* arg) {
+  uint64_t message = 1;
+  ssize_t r;
+  do {
+    r = write(g_fanotify_stop, &message, sizeof(message));
+  } while (r == -1 && errno == EINTR);
+  uv_thread_join(&g_fanotify_thread);
+
+  // Closing the group drops every mark it holds.
+  close(g_fanotify);
+  close(g_fanotify_stop);
+  g_fanotify = -1;
+  g_fanotify_stop = -1;
+  for (std::map<std::string, Filesystem>::const_iterator iter = g_filesystems.begin();
+       iter != g_filesystems.end();
+       ++iter)
+    close(iter->second.mount_fd);
+  g_filesystems.clear();
+}
+#endif
+
+bool FanotifyInit() {
+  const char* backend = getenv("PATHWATCHER_BACKEND");
+  if (backend != NULL && strcmp(backend, "inotify") == 0)
+    return false;
+
+  g_fanotify = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK |
+                             FAN_REPORT_DFID_NAME,
+                             O_RDONLY | O_CLOEXEC);
+  if (g_fanotify == -1)
+    return false;
+
+  g_fanotify_stop = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (g_fanotify_stop == -1 || !CanOpenByHandle()) {
+    if (g_fanotify_stop != -1)
+      close(g_fanotify_stop);
+    close(g_fanotify);
+    g_fanotify = -1;
+    g_fanotify_stop = -1;
+    return false;
+  }
+
+  uv_mutex_init(&g_fanotify_mutex);
+  uv_thread_create(&g_fanotify_thread, &FanotifyThread, NULL);
+
+#if NODE_VERSION_AT_LEAST(10, 2, 0)
+  // Stop reading before the process goes away, rather than posting events
+  // from a thread nobody waits for.
+  AddExitHook(StopFanotify, NULL);
+#endif
+  return true;
+}
+
+WatcherHandle FanotifyWatch(const char* path,
+                            bool recursive,
+                            const PathFilterPtr& filter) {
+  struct stat st;
+  if (stat(path, &st) == -1)
+    return -errno;
+  if (recursive && !S_ISDIR(st.st_mode))
+    return -ENOTDIR;
+
+  // Events only ever match the canonical path, one that can't be resolved
+  // is left to inotify rather than never seeing anything.
+  char real_path[PATH_MAX];
+  if (realpath(path, real_path) == NULL)
+    return -EOPNOTSUPP;
+
+  struct statfs fs;
+  if (statfs(path, &fs) == -1)
+    return -errno;
+  __kernel_fsid_t kernel_fsid;
+  memcpy(&kernel_fsid, &fs.f_fsid, sizeof(kernel_fsid));
+  std::string fsid = FsidKey(kernel_fsid);
+
+  // Events about a path come with the handle of its directory, those about
+  // the entries of a directory with its own.
+  std::vector<std::string> directory_keys;
+  if (!recursive) {
+    std::string key;
+    bool keyed = DirectoryKey(ParentOf(real_path), &key);
+    if (keyed)
+      directory_keys.push_back(key);
+    if (keyed && S_ISDIR(st.st_mode)) {
+      keyed = DirectoryKey(real_path, &key);
+      if (keyed)
+        directory_keys.push_back(key);
+    }
+    if (!keyed)
+      directory_keys.clear();
+  }
+
+  ScopedLocker locker(g_fanotify_mutex);
+
+  // A filesystem nobody watches any more keeps its entry but lost its mark.
+  std::map<std::string, Filesystem>::iterator filesystem = g_filesystems.find(fsid);
+  if (filesystem == g_filesystems.end() || filesystem->second.users == 0) {
+    if (fanotify_mark(g_fanotify, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                      kMarkMask, AT_FDCWD, path) == -1) {
+      // Filesystems that can't encode file handles, or that fanotify can't
+      // mark as a whole, are left to inotify.
+      if (errno == EOPNOTSUPP || errno == EXDEV || errno == ENODEV ||
+          errno == EINVAL)
+        return -EOPNOTSUPP;
+      return -errno;
+    }
+  }
+  if (filesystem == g_filesystems.end()) {
+    std::string dir = S_ISDIR(st.st_mode) ? std::string(path) : ParentOf(path);
+    Filesystem entry;
+    entry.mount_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    entry.users = 0;
+    if (entry.mount_fd == -1) {
+      int error = errno;
+      fanotify_mark(g_fanotify, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+                    kMarkMask, AT_FDCWD, path);
+      return -error;
+    }
+    filesystem = g_filesystems.insert(std::make_pair(fsid, entry)).first;
+  }
+  filesystem->second.users++;
+
+  WatcherHandle handle = g_next_handle++;
+  Subscription& subscription = g_subscriptions[handle];
+  subscription.path = path;
+  subscription.real_path = real_path;
+  subscription.recursive = recursive;
+  subscription.filter = filter;
+  subscription.directory_keys = directory_keys;
+  if (directory_keys.empty())
+    g_unkeyed_subscriptions++;
+  g_watched_directories.insert(directory_keys.begin(), directory_keys.end());
+  g_subscription_fsids[handle] = fsid;
+  if (recursive)
+    g_tree_roots.insert(std::make_pair(subscription.real_path, handle));
+  else
+    g_paths.insert(std::make_pair(subscription.real_path, handle));
+  return handle;
+}
+
+static void EraseHandle(std::multimap<std::string, WatcherHandle>* map,
+                        const std::string& path,
+                        WatcherHandle handle) {
+  typedef std::multimap<std::string, WatcherHandle>::iterator Iter;
+  std::pair<Iter, Iter> range = map->equal_range(path);
+  for (Iter iter = range.first; iter != range.second; ++iter) {
+    if (iter->second == handle) {
+      map->erase(iter);
+      return;
+    }
+  }
+}
+
+void FanotifyUnwatch(WatcherHandle handle) {
+  ScopedLocker locker(g_fanotify_mutex);
+
+  std::map<WatcherHandle, Subscription>::iterator subscription =
+      g_subscriptions.find(handle);
+  if (subscription == g_subscriptions.end())
+    return;
+  EraseHandle(subscription->second.recursive ? &g_tree_roots : &g_paths,
+              subscription->second.real_path, handle);
+  const std::vector<std::string>& keys = subscription->second.directory_keys;
+  if (keys.empty())
+    g_unkeyed_subscriptions--;
+  for (size_t i = 0; i < keys.size(); ++i)
+    g_watched_directories.erase(g_watched_directories.find(keys[i]));
+  g_subscriptions.erase(subscription);
+
+  std::string fsid = g_subscription_fsids[handle];
+  g_subscription_fsids.erase(handle);
+  std::map<std::string, Filesystem>::iterator filesystem = g_filesystems.find(fsid);
+  if (filesystem == g_filesystems.end() || --filesystem->second.users > 0)
+    return;
+
+  // Nobody watches anything on this filesystem any more, drop the mark. The
+  // descriptor is kept since events may still be in flight.
+  fanotify_mark(g_fanotify, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+                kMarkMask, filesystem->second.mount_fd, NULL);
+}
+
+#else  // FAN_REPORT_DFID_NAME && FAN_RENAME
+
+// Built against headers without directory file handle or rename reporting.
+bool FanotifyInit() {
+  return false;
+}
+
+WatcherHandle FanotifyWatch(const char* path,
+                            bool recursive,
+                            const PathFilterPtr& filter) {
+  return -EOPNOTSUPP;
+}
+
+void FanotifyUnwatch(WatcherHandle handle) {
+}
+
+#endif  // FAN_REPORT_DFID_NAME && FAN_RENAME
@@ -0,0 +1,27 @@
+#ifndef SRC_PATHWATCHER_FANOTIFY_H_
+#define SRC_PATHWATCHER_FANOTIFY_H_
+
+#include "common.h"
+
+// Handles given out by the fanotify backend start here, below the range used
+// for inotify trees and above any watch descriptor.
+static const WatcherHandle kFanotifyHandleBase = 0x20000000;
+
+// Returns true and starts the reader thread when the process is allowed to
+// use fanotify with directory file handles, false when inotify has to be used.
+bool FanotifyInit();
+
+// Subscribe to |path| (and everything below it when |recursive|), reporting
+// only the children |filter| accepts. Returns a negative errno on failure,
+// -EOPNOTSUPP meaning the filesystem can't report file handles and should be
+// watched with inotify instead.
+WatcherHandle FanotifyWatch(const char* path,
+                            bool recursive,
+                            const PathFilterPtr& filter);
+void FanotifyUnwatch(WatcherHandle handle);
+
+inline bool IsFanotifyHandle(WatcherHandle handle) {
+  return handle >= kFanotifyHandleBase && handle < 2 * kFanotifyHandleBase;
+}
+
+#endif  // SRC_PATHWATCHER_FANOTIFY_H_
@@ -1,82 +1,1092 @@
+#include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/inotify.h>
 #include <linux/limits.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <map>
+#include <set>
+#include <string>
 
 #include "common.h"
+#include "pathwatcher_fanotify.h"
 
-static int g_inotify;
+// How long to wait for the IN_MOVED_TO half of a rename when the IN_MOVED_FROM
+// half was the last event of a read.
+static const int kMoveCookieTimeoutMs = 10;
+
+// Handles of recursive watches are allocated from here so they never collide
+// with watch descriptors.
+static const WatcherHandle kTreeHandleBase = 0x40000000;
+
+static const uint32_t kWatchMask = IN_ATTRIB | IN_CREATE | IN_DELETE |
+    IN_MODIFY | IN_MOVE | IN_MOVE_SELF | IN_DELETE_SELF;
+
+// The parent directory of a watched file only has to tell us when something
+// takes the file's name.
+static const uint32_t kGuardMask = IN_CREATE | IN_MOVED_TO | IN_MASK_ADD;
+
+// The read buffer starts out large enough for any single event and grows
+// with the backlog the kernel reports, up to this.
+static const size_t kMinReadBufferSize = 4096;
+static const size_t kMaxReadBufferSize = 1 << 20;
+
+// Messages for the reader threads, written to g_control.
+static const uint64_t kControlStop = 1;
+
+// Watches can be spread over several inotify instances, each with a reader
+// thread of its own, so trees that change at the same time don't queue up
+// behind one another. PATHWATCHER_INOTIFY_SHARDS sets how many.
+static const int kMaxShards = 16;
+
+// With more than one shard the ids of watches carry the shard above the watch
+// descriptor, so they stay unique. The first shard's ids are its descriptors.
+static const int kShardShift = 24;
+static const int kDescriptorMask = (1 << kShardShift) - 1;
+
+struct Shard {
+  Shard() : inotify(-1), epoll(-1), lane(0), queue_bytes(0), queue_events(0),
+            queue_peak_bytes(0), queue_peak_events(0) {}
+
+  int inotify;
+  // The reader waits on both the inotify descriptor and g_control.
+  int epoll;
+  size_t lane;
+  uv_thread_t thread;
+
+  // The inotify queue as last sampled by the reader, and its peak since the
+  // last time somebody asked.
+  std::atomic<uint32_t> queue_bytes;
+  std::atomic<uint32_t> queue_events;
+  std::atomic<uint32_t> queue_peak_bytes;
+  std::atomic<uint32_t> queue_peak_events;
+};
+
+static Shard g_shards[kMaxShards];
+static int g_shard_count;
 static int g_init_errno;
+static int g_control;
+static uint32_t g_max_queued_events;
+
+// Whether watches go to the fanotify backend first, see pathwatcher_fanotify.h.
+static bool g_fanotify_enabled;
+
+// A watch descriptor can be shared by a direct watch and any number of
+// recursive watches, it is removed from the kernel once nobody uses it.
+struct WatchEntry {
+  WatchEntry() : direct(false), handle(-1), guard(-1) {}
+
+  std::vector<char> path;
+  bool direct;
+  // The handle of the direct watch. It is the id of the watch, unless the
+  // watched file was replaced and the watch moved on to the new one.
+  WatcherHandle handle;
+  PathFilterPtr filter;
+  std::vector<WatcherHandle> trees;
+
+  // For a watched file, the watch of its parent directory. For a directory,
+  // the watched files in it.
+  int guard;
+  std::vector<int> guarded;
+};
+
+struct Tree {
+  Tree() : shard(0), root_wd(-1) {}
+
+  // Every directory of a tree is watched through the same shard.
+  int shard;
+  int root_wd;
+  std::set<int> wds;
+  PathFilterPtr filter;
+};
+
+static std::map<int, WatchEntry> g_watches;
+// Maps the handles of replaced files to the watches of their replacements.
+static std::map<WatcherHandle, int> g_replaced;
+static std::map<WatcherHandle, Tree> g_trees;
+static WatcherHandle g_next_tree_handle = kTreeHandleBase;
+static int g_next_shard;
+static uv_mutex_t g_watches_mutex;
+
+struct PendingMove {
+  int wd;
+  uint32_t cookie;
+  bool is_dir;
+  std::vector<char> path;
+  // When the IN_MOVED_FROM was read.
+  uint64_t read_at;
+};
+
+// Where an event has to be delivered: to the direct watch of the descriptor
+// and to every tree it belongs to.
+struct Owners {
+  Owners() : direct(false), handle(-1) {}
+
+  bool direct;
+  WatcherHandle handle;
+  std::vector<WatcherHandle> trees;
+  std::vector<char> path;
+};
+
+struct ScopedLocker {
+  explicit ScopedLocker(uv_mutex_t& mutex) : mutex_(&mutex) { uv_mutex_lock(mutex_); }
+  ~ScopedLocker() { uv_mutex_unlock(mutex_); }
+
+  uv_mutex_t* mutex_;
+};
+
+static int WatchId(int shard, int wd) {
+  return (shard << kShardShift) | wd;
+}
+
+static int ShardOf(int id) {
+  return g_shard_count == 1 ? 0 : id >> kShardShift;
+}
+
+static int DescriptorOf(int id) {
+  return g_shard_count == 1 ? id : id & kDescriptorMask;
+}
+
+// Adds a kernel watch on |shard|, returns its id or a negative errno.
+static int AddWatch(int shard, const char* path, uint32_t mask) {
+  int wd = inotify_add_watch(g_shards[shard].inotify, path, mask);
+  if (wd == -1)
+    return -errno;
+  if (g_shard_count > 1 && wd > kDescriptorMask) {
+    inotify_rm_watch(g_shards[shard].inotify, wd);
+    return -ENOSPC;
+  }
+  return WatchId(shard, wd);
+}
+
+static void RemoveWatch(int id) {
+  inotify_rm_watch(g_shards[ShardOf(id)].inotify, DescriptorOf(id));
+}
+
+// Must be called with g_watches_mutex held.
+static int NextShard() {
+  int shard = g_next_shard;
+  g_next_shard = (g_next_shard + 1) % g_shard_count;
+  return shard;
+}
+
+static std::vector<char> JoinPath(const std::vector<char>& dir, const char* name) {
+  size_t name_length = strlen(name);
+  std::vector<char> path(dir.size() + 1 + name_length);
+  std::vector<char>::iterator out = std::copy(dir.begin(), dir.end(), path.begin());
+  *(out++) = '/';
+  std::copy(name, name + name_length, out);
+  return path;
+}
+
+static bool IsSameOrDescendant(const std::vector<char>& path,
+                               const std::vector<char>& ancestor) {
+  if (path.size() < ancestor.size() ||
+      !std::equal(ancestor.begin(), ancestor.end(), path.begin()))
+    return false;
+  return path.size() == ancestor.size() || path[ancestor.size()] == '/';
+}
+
+static bool Contains(const std::vector<WatcherHandle>& handles, WatcherHandle handle) {
+  return std::find(handles.begin(), handles.end(), handle) != handles.end();
+}
+
+// Whether the direct watch |wd| reports its child |path|.
+static bool DirectAccepts(int wd, const std::vector<char>& path, bool is_dir) {
+  ScopedLocker locker(g_watches_mutex);
+  std::map<int, WatchEntry>::const_iterator iter = g_watches.find(wd);
+  if (iter == g_watches.end() || !iter->second.filter)
+    return true;
+  std::vector<char>::const_iterator name =
+      std::find(path.rbegin(), path.rend(), '/').base();
+  return iter->second.filter->ShouldReport(std::string(name, path.end()), is_dir);
+}
+
+// Must be called with g_watches_mutex held.
+static bool TreeFilterAccepts(const Tree& tree,
+                              const std::vector<char>& path,
+                              bool is_dir,
+                              bool descend) {
+  std::map<int, WatchEntry>::const_iterator root = g_watches.find(tree.root_wd);
+  std::string relative;
+  if (!tree.filter || root == g_watches.end() ||
+      !RelativePath(std::string(root->second.path.begin(), root->second.path.end()),
+                    std::string(path.begin(), path.end()),
+                    &relative))
+    return true;
+  if (descend)
+    return tree.filter->ShouldDescend(relative);
+  return tree.filter->ShouldReport(relative, is_dir);
+}
+
+// Whether |tree| reports |path|, or with |descend| whether it watches the
+// directory |path| at all.
+static bool TreeAccepts(WatcherHandle tree,
+                        const std::vector<char>& path,
+                        bool is_dir,
+                        bool descend = false) {
+  ScopedLocker locker(g_watches_mutex);
+  std::map<WatcherHandle, Tree>::const_iterator iter = g_trees.find(tree);
+  return iter == g_trees.end() || TreeFilterAccepts(iter->second, path, is_dir, descend);
+}
+
+// Must be called with g_watches_mutex held.
+static void ReleaseWatchIfUnused(int wd) {
+  std::map<int, WatchEntry>::iterator iter = g_watches.find(wd);
+  if (iter == g_watches.end() || iter->second.direct || !iter->second.trees.empty() ||
+      !iter->second.guarded.empty())
+    return;
+  RemoveWatch(wd);
+  g_watches.erase(iter);
+}
+
+// Must be called with g_watches_mutex held.
+static void ReleaseGuard(int wd, int guard) {
+  std::map<int, WatchEntry>::iterator iter = g_watches.find(guard);
+  if (iter == g_watches.end())
+    return;
+  std::vector<int>& guarded = iter->second.guarded;
+  guarded.erase(std::remove(guarded.begin(), guarded.end(), wd), guarded.end());
+  ReleaseWatchIfUnused(guard);
+}
+
+// Watches the parent directory of the file watched by |wd|, so an editor
+// saving it by renaming a new file over it can be told from a deletion. Must
+// be called with g_watches_mutex held.
+static void GuardFile(int wd) {
+  WatchEntry& file = g_watches[wd];
+  if (file.guard != -1)
+    return;
+
+  std::vector<char>::iterator slash = std::find(file.path.rbegin(), file.path.rend(), '/').base();
+  if (slash == file.path.begin())
+    return;
+  std::string dir(file.path.begin(), slash - 1);
+  if (dir.empty())
+    dir = "/";
+
+  int guard = AddWatch(ShardOf(wd), dir.c_str(), kGuardMask);
+  if (guard < 0)
+    return;
+  WatchEntry& entry = g_watches[guard];
+  if (entry.path.empty())
+    entry.path.assign(dir.begin(), dir.end());
+  entry.guarded.push_back(wd);
+  file.guard = guard;
+}
+
+// Something took the name |name| in the directory watched by |dir|. When that
+// is a watched file, the watch moves on to the new file and keeps its handle,
+// which is told about a change. Events still queued for the old file are
+// dropped along with its watch.
+static void RearmReplacedFiles(int dir, const char* name) {
+  std::vector<WatcherHandle> changed;
+  {
+    ScopedLocker locker(g_watches_mutex);
+    std::map<int, WatchEntry>::iterator iter = g_watches.find(dir);
+    if (iter == g_watches.end() || iter->second.guarded.empty())
+      return;
+
+    size_t name_length = strlen(name);
+    std::vector<int> guarded = iter->second.guarded;
+    for (size_t i = 0; i < guarded.size(); ++i) {
+      int wd = guarded[i];
+      std::map<int, WatchEntry>::iterator file = g_watches.find(wd);
+      if (file == g_watches.end() || !file->second.direct)
+        continue;
+      const std::vector<char>& path = file->second.path;
+      if (path.size() <= name_length ||
+          path[path.size() - name_length - 1] != '/' ||
+          !std::equal(name, name + name_length, path.end() - name_length))
+        continue;
+
+      std::string path_string(path.begin(), path.end());
+      int replacement = AddWatch(ShardOf(wd), path_string.c_str(), kWatchMask);
+      if (replacement < 0 || replacement == wd)
+        continue;
+      if (g_watches.count(replacement) != 0 && g_watches[replacement].direct) {
+        // Somebody watches the new file already, leave the old watch to run
+        // its course.
+        continue;
+      }
+
+      WatchEntry& entry = g_watches[replacement];
+      entry.path = path;
+      entry.direct = true;
+      entry.handle = file->second.handle;
+      entry.filter = file->second.filter;
+      entry.guard = dir;
+      std::replace(iter->second.guarded.begin(), iter->second.guarded.end(), wd, replacement);
+      if (entry.handle == replacement)
+        g_replaced.erase(entry.handle);
+      else
+        g_replaced[entry.handle] = replacement;
+      changed.push_back(entry.handle);
+
+      file->second.direct = false;
+      file->second.guard = -1;
+      ReleaseWatchIfUnused(wd);
+    }
+  }
+
+  for (size_t i = 0; i < changed.size(); ++i)
+    PostEvent(EVENT_CHANGE, changed[i], std::vector<char>());
+}
+
+// Must be called with g_watches_mutex held.
+static void RemoveWatchFromTree(int wd, WatcherHandle tree) {
+  std::map<int, WatchEntry>::iterator iter = g_watches.find(wd);
+  if (iter != g_watches.end()) {
+    std::vector<WatcherHandle>& trees = iter->second.trees;
+    trees.erase(std::remove(trees.begin(), trees.end(), tree), trees.end());
+  }
+  std::map<WatcherHandle, Tree>::iterator tree_iter = g_trees.find(tree);
+  if (tree_iter != g_trees.end())
+    tree_iter->second.wds.erase(wd);
+  ReleaseWatchIfUnused(wd);
+}
+
+// Must be called with g_watches_mutex held.
+static void RemoveSubtreeFromTree(WatcherHandle tree, const std::vector<char>& dir) {
+  std::map<WatcherHandle, Tree>::iterator tree_iter = g_trees.find(tree);
+  if (tree_iter == g_trees.end())
+    return;
+
+  std::vector<int> removed;
+  for (std::set<int>::const_iterator iter = tree_iter->second.wds.begin();
+       iter != tree_iter->second.wds.end();
+       ++iter) {
+    std::map<int, WatchEntry>::const_iterator entry = g_watches.find(*iter);
+    if (entry != g_watches.end() && IsSameOrDescendant(entry->second.path, dir))
+      removed.push_back(*iter);
+  }
+  for (size_t i = 0; i < removed.size(); ++i)
+    RemoveWatchFromTree(removed[i], tree);
+}
+
+// Must be called with g_watches_mutex held.
+static void RenameWatchedPaths(const std::vector<char>& old_dir,
+                               const std::vector<char>& new_dir) {
+  for (std::map<int, WatchEntry>::iterator iter = g_watches.begin();
+       iter != g_watches.end();
+       ++iter) {
+    std::vector<char>& path = iter->second.path;
+    if (!IsSameOrDescendant(path, old_dir))
+      continue;
+    std::vector<char> renamed(new_dir);
+    renamed.insert(renamed.end(), path.begin() + old_dir.size(), path.end());
+    path.swap(renamed);
+  }
+}
+
+// Watches |dir| and every directory below it as part of |tree|, skipping the
+// directories its filter ignores. When |events| is given, everything found
+// below |dir| is appended to it as created, which covers whatever appeared in
+// a new directory before its watch was added. Returns the watch descriptor of
+// |dir|, or a negative errno.
+static int AddTreeDirectory(WatcherHandle tree,
+                            const std::vector<char>& dir,
+                            std::vector<WatcherEvent>* events) {
+  std::vector<std::vector<char> > pending(1, dir);
+  int root_wd = -1;
+  Tree tree_state;
+  {
+    ScopedLocker locker(g_watches_mutex);
+    std::map<WatcherHandle, Tree>::const_iterator tree_iter = g_trees.find(tree);
+    if (tree_iter == g_trees.end())
+      return -ENOENT;
+    tree_state = tree_iter->second;
+  }
+
+  while (!pending.empty()) {
+    std::vector<char> path;
+    path.swap(pending.back());
+    pending.pop_back();
+
+    std::string path_string(path.begin(), path.end());
+    int wd = AddWatch(tree_state.shard, path_string.c_str(),
+                      kWatchMask | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+      if (root_wd == -1)
+        return wd;
+      continue;
+    }
+    if (root_wd == -1)
+      root_wd = wd;
+
+    {
+      ScopedLocker locker(g_watches_mutex);
+      std::map<WatcherHandle, Tree>::iterator tree_iter = g_trees.find(tree);
+      WatchEntry& entry = g_watches[wd];
+      if (entry.path.empty())
+        entry.path = path;
+      if (tree_iter == g_trees.end()) {
+        // The tree was unwatched while we were crawling it.
+        ReleaseWatchIfUnused(wd);
+        return root_wd;
+      }
+      if (!Contains(entry.trees, tree))
+        entry.trees.push_back(tree);
+      tree_iter->second.wds.insert(wd);
+      if (tree_iter->second.root_wd == -1)
+        tree_iter->second.root_wd = wd;
+      tree_state = tree_iter->second;
+    }
+
+    DIR* handle = opendir(path_string.c_str());
+    if (handle == NULL)
+      continue;
+    while (dirent* child = readdir(handle)) {
+      if (strcmp(child->d_name, ".") == 0 || strcmp(child->d_name, "..") == 0)
+        continue;
+
+      std::vector<char> child_path = JoinPath(path, child->d_name);
+      bool is_dir = child->d_type == DT_DIR;
+      if (child->d_type == DT_UNKNOWN) {
+        struct stat st;
+        std::string child_string(child_path.begin(), child_path.end());
+        is_dir = lstat(child_string.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+      }
+
+      bool descend;
+      bool report;
+      {
+        ScopedLocker locker(g_watches_mutex);
+        descend = is_dir && TreeFilterAccepts(tree_state, child_path, true, true);
+        report = TreeFilterAccepts(tree_state, child_path, is_dir, false);
+      }
+
+      if (events != NULL && report) {
+        events->push_back(WatcherEvent());
+        events->back().type = EVENT_CHILD_CREATE;
+        events->back().handle = tree;
+        events->back().new_path = child_path;
+      }
+      if (descend)
+        pending.push_back(child_path);
+    }
+    closedir(handle);
+  }
+
+  return root_wd;
+}
+
+static void AddNewTreeDirectory(WatcherHandle tree, const std::vector<char>& dir) {
+  std::vector<WatcherEvent> events;
+  AddTreeDirectory(tree, dir, &events);
+  for (size_t i = 0; i < events.size(); ++i)
+    PostEvent(events[i].type, events[i].handle, events[i].new_path);
+}
+
+static bool GetOwners(int wd, Owners* owners) {
+  ScopedLocker locker(g_watches_mutex);
+  std::map<int, WatchEntry>::const_iterator iter = g_watches.find(wd);
+  if (iter == g_watches.end())
+    return false;
+  owners->direct = iter->second.direct;
+  owners->handle = iter->second.handle;
+  owners->trees = iter->second.trees;
+  owners->path = iter->second.path;
+  return true;
+}
+
+// A rename out of a watched directory has no matching IN_MOVED_TO, so as far
+// as that directory is concerned the child was deleted.
+static void FlushPendingMove(PendingMove* move) {
+  if (move->cookie == 0)
+    return;
+  move->cookie = 0;
+
+  Owners owners;
+  if (!GetOwners(move->wd, &owners))
+    return;
+  if (owners.direct && DirectAccepts(move->wd, move->path, move->is_dir))
+    PostEvent(EVENT_CHILD_DELETE, move->wd, move->path);
+  for (size_t i = 0; i < owners.trees.size(); ++i) {
+    bool report = TreeAccepts(owners.trees[i], move->path, move->is_dir);
+    if (move->is_dir) {
+      ScopedLocker locker(g_watches_mutex);
+      RemoveSubtreeFromTree(owners.trees[i], move->path);
+    }
+    if (report)
+      PostEvent(EVENT_CHILD_DELETE, owners.trees[i], move->path);
+  }
+}
+
+// Posts what a move looks like to a watch that reports |old_reported| of the
+// old path and |new_reported| of the new one.
+static void PostMove(WatcherHandle handle,
+                     bool old_reported,
+                     bool new_reported,
+                     const std::vector<char>& old_path,
+                     const std::vector<char>& path) {
+  if (old_reported && new_reported)
+    PostEvent(EVENT_CHILD_RENAME, handle, path, old_path);
+  else if (old_reported)
+    PostEvent(EVENT_CHILD_DELETE, handle, old_path);
+  else if (new_reported)
+    PostEvent(EVENT_CHILD_CREATE, handle, path);
+}
+
+static void HandleMovedTo(PendingMove* move,
+                          int wd,
+                          uint32_t cookie,
+                          bool is_dir,
+                          const std::vector<char>& path) {
+  Owners to;
+  GetOwners(wd, &to);
+
+  if (move->cookie == 0 || move->cookie != cookie) {
+    // Moved in from outside of everything we watch.
+    if (to.direct && DirectAccepts(wd, path, is_dir))
+      PostEvent(EVENT_CHILD_CREATE, wd, path);
+    for (size_t i = 0; i < to.trees.size(); ++i) {
+      if (TreeAccepts(to.trees[i], path, is_dir))
+        PostEvent(EVENT_CHILD_CREATE, to.trees[i], path);
+      if (is_dir && TreeAccepts(to.trees[i], path, true, true))
+        AddNewTreeDirectory(to.trees[i], path);
+    }
+    return;
+  }
+
+  move->cookie = 0;
+  Owners from;
+  GetOwners(move->wd, &from);
+
+  // Watches below a renamed directory follow it, only their paths change.
+  if (is_dir) {
+    ScopedLocker locker(g_watches_mutex);
+    RenameWatchedPaths(move->path, path);
+  }
+
+  if (from.direct && to.direct && move->wd == wd) {
+    PostMove(wd, DirectAccepts(wd, move->path, is_dir), DirectAccepts(wd, path, is_dir),
+             move->path, path);
+  } else {
+    if (from.direct && DirectAccepts(move->wd, move->path, is_dir))
+      PostEvent(EVENT_CHILD_DELETE, move->wd, move->path);
+    if (to.direct && DirectAccepts(wd, path, is_dir))
+      PostEvent(EVENT_CHILD_CREATE, wd, path);
+  }
+
+  for (size_t i = 0; i < from.trees.size(); ++i) {
+    WatcherHandle tree = from.trees[i];
+    bool old_reported = TreeAccepts(tree, move->path, is_dir);
+    if (Contains(to.trees, tree)) {
+      PostMove(tree, old_reported, TreeAccepts(tree, path, is_dir), move->path, path);
+
+      // Moving a directory in or out of an ignored place changes what the
+      // tree has to watch.
+      if (is_dir) {
+        bool old_watched = TreeAccepts(tree, move->path, true, true);
+        bool new_watched = TreeAccepts(tree, path, true, true);
+        if (old_watched && !new_watched) {
+          ScopedLocker locker(g_watches_mutex);
+          RemoveSubtreeFromTree(tree, path);
+        } else if (!old_watched && new_watched) {
+          AddNewTreeDirectory(tree, path);
+        }
+      }
+    } else {
+      if (is_dir) {
+        ScopedLocker locker(g_watches_mutex);
+        RemoveSubtreeFromTree(tree, path);
+      }
+      if (old_reported)
+        PostEvent(EVENT_CHILD_DELETE, tree, move->path);
+    }
+  }
+  for (size_t i = 0; i < to.trees.size(); ++i) {
+    WatcherHandle tree = to.trees[i];
+    if (Contains(from.trees, tree))
+      continue;
+    if (TreeAccepts(tree, path, is_dir))
+      PostEvent(EVENT_CHILD_CREATE, tree, path);
+    if (is_dir && TreeAccepts(tree, path, true, true))
+      AddNewTreeDirectory(tree, path);
+  }
+}
+
+static void HandleSelfEvent(int wd, uint32_t mask) {
+  Owners owners;
+  if (!GetOwners(wd, &owners))
+    return;
+
+  EVENT_TYPE type;
+  // Note that inotify won't tell us where the file or directory has been
+  // moved to, so we just treat IN_MOVE_SELF as file being deleted.
+  if (mask & (IN_ATTRIB | IN_MODIFY)) {
+    type = EVENT_CHANGE;
+  } else if (mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+    type = EVENT_DELETE;
+  } else {
+    return;
+  }
+
+  if (owners.direct)
+    PostEvent(type, owners.handle, std::vector<char>());
+
+  // The parent directory reports what happens to the subdirectories of a
+  // tree, only the root has nobody else to speak for it.
+  for (size_t i = 0; i < owners.trees.size(); ++i) {
+    bool is_root;
+    {
+      ScopedLocker locker(g_watches_mutex);
+      std::map<WatcherHandle, Tree>::const_iterator tree = g_trees.find(owners.trees[i]);
+      is_root = tree != g_trees.end() && tree->second.root_wd == wd;
+    }
+    if (is_root)
+      PostEvent(type, owners.trees[i], std::vector<char>());
+  }
+}
+
+static void HandleChildEvent(int wd, uint32_t mask, const char* name) {
+  Owners owners;
+  if (!GetOwners(wd, &owners))
+    return;
+
+  EVENT_TYPE type;
+  if (mask & IN_CREATE) {
+    type = EVENT_CHILD_CREATE;
+  } else if (mask & IN_DELETE) {
+    type = EVENT_CHILD_DELETE;
+  } else if (mask & (IN_ATTRIB | IN_MODIFY)) {
+    type = EVENT_CHILD_CHANGE;
+  } else {
+    return;
+  }
+
+  bool is_dir = (mask & IN_ISDIR) != 0;
+  std::vector<char> path = JoinPath(owners.path, name);
+  if (owners.direct && DirectAccepts(wd, path, is_dir))
+    PostEvent(type, wd, path);
+  for (size_t i = 0; i < owners.trees.size(); ++i) {
+    if (TreeAccepts(owners.trees[i], path, is_dir))
+      PostEvent(type, owners.trees[i], path);
+    if (type == EVENT_CHILD_CREATE && is_dir &&
+        TreeAccepts(owners.trees[i], path, true, true))
+      AddNewTreeDirectory(owners.trees[i], path);
+  }
+}
+
+static void HandleIgnored(int wd) {
+  ScopedLocker locker(g_watches_mutex);
+  std::map<int, WatchEntry>::iterator iter = g_watches.find(wd);
+  if (iter == g_watches.end())
+    return;
+  for (size_t i = 0; i < iter->second.trees.size(); ++i) {
+    std::map<WatcherHandle, Tree>::iterator tree = g_trees.find(iter->second.trees[i]);
+    if (tree != g_trees.end())
+      tree->second.wds.erase(wd);
+  }
+  int guard = iter->second.guard;
+  g_watches.erase(iter);
+  if (guard != -1)
+    ReleaseGuard(wd, guard);
+}
+
+// Filesystems fanotify can't mark as a whole are watched with inotify.
+static bool ShouldFallBackToInotify(WatcherHandle handle) {
+  return handle == -EOPNOTSUPP;
+}
+
+// The queue of |shard| ran full and dropped events, every handle it serves
+// may have missed something.
+static void HandleOverflow(int shard) {
+  std::vector<WatcherHandle> handles;
+  {
+    ScopedLocker locker(g_watches_mutex);
+    for (std::map<int, WatchEntry>::const_iterator iter = g_watches.begin();
+         iter != g_watches.end();
+         ++iter) {
+      if (iter->second.direct && ShardOf(iter->first) == shard)
+        handles.push_back(iter->second.handle);
+    }
+    for (std::map<WatcherHandle, Tree>::const_iterator iter = g_trees.begin();
+         iter != g_trees.end();
+         ++iter) {
+      if (iter->second.shard == shard)
+        handles.push_back(iter->first);
+    }
+  }
+  for (size_t i = 0; i < handles.size(); ++i)
+    PostEvent(EVENT_OVERFLOW, handles[i], std::vector<char>());
+}
+
+static void StorePeak(std::atomic<uint32_t>* peak, uint32_t value) {
+  uint32_t current = peak->load();
+  while (value > current && !peak->compare_exchange_weak(current, value)) {
+  }
+}
+
+static uint32_t ReadMaxQueuedEvents() {
+  uint32_t value = 0;
+  FILE* file = fopen("/proc/sys/fs/inotify/max_queued_events", "r");
+  if (file != NULL) {
+    if (fscanf(file, "%u", &value) != 1)
+      value = 0;
+    fclose(file);
+  }
+  return value;
+}
+
+#if NODE_VERSION_AT_LEAST(10, 2, 0)
+static void StopReaders(void* arg) {
+  uint64_t message = kControlStop;
+  ssize_t r;
+  do {
+    r = write(g_control, &message, sizeof(message));
+  } while (r == -1 && errno == EINTR);
+}
+#endif
+
+static int ShardCountFromEnvironment() {
+  const char* value = getenv("PATHWATCHER_INOTIFY_SHARDS");
+  int count = value != NULL ? atoi(value) : 1;
+  return std::max(1, std::min(count, kMaxShards));
+}
+
+// Returns 0 or the errno of why |shard| can't be used.
+static int InitShard(Shard* shard) {
+  shard->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (shard->inotify == -1)
+    return errno;
+
+  shard->epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (shard->epoll == -1) {
+    int error = errno;
+    close(shard->inotify);
+    shard->inotify = -1;
+    return error;
+  }
+
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = shard->inotify;
+  epoll_ctl(shard->epoll, EPOLL_CTL_ADD, shard->inotify, &event);
+  event.data.fd = g_control;
+  epoll_ctl(shard->epoll, EPOLL_CTL_ADD, g_control, &event);
+  return 0;
+}
+
+static void ReadShard(int index);
+
+static void ShardThread(void* arg) {
+  int index = static_cast<int>(reinterpret_cast<intptr_t>(arg));
+  SetEventLane(g_shards[index].lane);
+  ReadShard(index);
+}
 
 void PlatformInit() {
-  g_inotify = inotify_init();
-  if (g_inotify == -1) {
+  uv_mutex_init(&g_watches_mutex);
+
+  g_fanotify_enabled = FanotifyInit();
+
+  g_shard_count = 1;
+  g_control = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (g_control == -1) {
     g_init_errno = errno;
     return;
   }
+  g_init_errno = InitShard(&g_shards[0]);
+  if (g_init_errno != 0)
+    return;
+
+  g_max_queued_events = ReadMaxQueuedEvents();
+
+  // The first shard is read by the common watcher thread, the others get
+  // threads and lanes of their own.
+  int wanted = ShardCountFromEnvironment();
+  while (g_shard_count < wanted && InitShard(&g_shards[g_shard_count]) == 0) {
+    Shard& shard = g_shards[g_shard_count];
+    shard.lane = AddEventLane();
+    uv_thread_create(&shard.thread, ShardThread,
+                     reinterpret_cast<void*>(static_cast<intptr_t>(g_shard_count)));
+    ++g_shard_count;
+  }
+
+#if NODE_VERSION_AT_LEAST(10, 2, 0)
+  // Don't let the readers touch anything while the process goes away.
+  AddExitHook(StopReaders, NULL);
+#endif
 
   WakeupNewThread();
 }
 
-void PlatformThread() {
-  // Needs to be large enough for sizeof(inotify_event) + strlen(filename).
-  char buf[4096];
+// Reads everything the kernel has queued, sizing |buffer| to the backlog so
+// a burst drains in a few calls. Returns what read() returns.
+static ssize_t ReadEvents(int fd, std::vector<char>* buffer, int* queued) {
+  *queued = 0;
+  if (ioctl(fd, FIONREAD, queued) == 0 && *queued > 0 &&
+      static_cast<size_t>(*queued) > buffer->size() &&
+      buffer->size() < kMaxReadBufferSize) {
+    size_t size = buffer->size();
+    while (size < static_cast<size_t>(*queued) && size < kMaxReadBufferSize)
+      size *= 2;
+    buffer->resize(size);
+  }
+
+  ssize_t size;
+  do {
+    size = read(fd, buffer->data(), buffer->size());
+  } while (size == -1 && errno == EINTR);
+  return size;
+}
+
+// Handles one event read from shard |index|. The first half of a rename is
+// kept in |move| until the second one comes.
+static void HandleEvent(int index, const inotify_event* e, PendingMove* move) {
+  if (e->mask & IN_Q_OVERFLOW) {
+    FlushPendingMove(move);
+    HandleOverflow(index);
+    return;
+  }
+
+  int fd = WatchId(index, e->wd);
+
+  if (e->mask & IN_IGNORED) {
+    HandleIgnored(fd);
+    return;
+  }
+
+  // Events without a name are about the watched path itself.
+  if (e->len == 0) {
+    FlushPendingMove(move);
+    HandleSelfEvent(fd, e->mask);
+    return;
+  }
+
+  Owners owners;
+  if (!GetOwners(fd, &owners))
+    return;
+
+  if (e->mask & IN_MOVED_FROM) {
+    FlushPendingMove(move);
+    move->wd = fd;
+    move->cookie = e->cookie;
+    move->is_dir = (e->mask & IN_ISDIR) != 0;
+    move->path = JoinPath(owners.path, e->name);
+    move->read_at = EventReadTime();
+  } else if (e->mask & IN_MOVED_TO) {
+    if (!(e->mask & IN_ISDIR))
+      RearmReplacedFiles(fd, e->name);
+    if (move->cookie != e->cookie)
+      FlushPendingMove(move);
+    HandleMovedTo(move, fd, e->cookie, (e->mask & IN_ISDIR) != 0,
+                  JoinPath(owners.path, e->name));
+  } else {
+    FlushPendingMove(move);
+    if ((e->mask & IN_CREATE) && !(e->mask & IN_ISDIR))
+      RearmReplacedFiles(fd, e->name);
+    HandleChildEvent(fd, e->mask, e->name);
+  }
+}
+
+static void ReadShard(int index) {
+  Shard& shard = g_shards[index];
+  std::vector<char> buffer(kMinReadBufferSize);
+  PendingMove move;
+  move.cookie = 0;
+  move.read_at = 0;
 
   while (true) {
-    int size;
+    // The two halves of a rename are queued together, so if a read ended
+    // between them the other half is already on its way.
+    epoll_event ready[2];
+    int count;
     do {
-      size = read(g_inotify, buf, sizeof(buf));
-    } while (size == -1 && errno == EINTR);
+      count = epoll_wait(shard.epoll, ready, 2, move.cookie != 0 ? kMoveCookieTimeoutMs : -1);
+    } while (count == -1 && errno == EINTR);
 
-    if (size == -1) {
-      break;
-    } else if (size == 0) {
+    if (count == -1)
       break;
+    if (count == 0) {
+      SetEventReadTime(move.read_at);
+      FlushPendingMove(&move);
+      continue;
+    }
+
+    // The control descriptor is left readable, so every reader sees it.
+    bool readable = false;
+    for (int i = 0; i < count; ++i) {
+      if (ready[i].data.fd == g_control)
+        return;
+      readable = true;
     }
+    if (!readable)
+      continue;
+
+    int queued;
+    ssize_t size = ReadEvents(shard.inotify, &buffer, &queued);
+    if (size == -1 && errno == EAGAIN)
+      continue;
+    if (size <= 0)
+      break;
+    SetEventReadTime(uv_hrtime());
 
+    char* buf = buffer.data();
+    uint32_t events = 0;
     inotify_event* e;
     for (char* p = buf; p < buf + size; p += sizeof(*e) + e->len) {
       e = reinterpret_cast<inotify_event*>(p);
+      ++events;
 
-      int fd = e->wd;
-      EVENT_TYPE type;
-      std::vector<char> path;
-
-      // Note that inotify won't tell us where the file or directory has been
-      // moved to, so we just treat IN_MOVE_SELF as file being deleted.
-      if (e->mask & (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVE)) {
-        type = EVENT_CHANGE;
-      } else if (e->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
-        type = EVENT_DELETE;
-      } else {
-        continue;
-      }
+      uint64_t posted = PostedEvents();
+      HandleEvent(index, e, &move);
+      // The first half of a rename is posted with the second.
+      if (e->mask & IN_MOVED_FROM)
+        CountStat(STAT_EVENTS_READ);
+      else
+        CountRawEvent(posted);
+    }
 
-      PostEventAndWait(type, fd, path);
+    // When the read took everything that was queued, what we just handled is
+    // how deep the queue was.
+    if (queued > 0) {
+      uint32_t depth = size >= queued ? events :
+          static_cast<uint32_t>(static_cast<uint64_t>(events) * queued / size);
+      shard.queue_bytes = queued;
+      shard.queue_events = depth;
+      StorePeak(&shard.queue_peak_bytes, queued);
+      StorePeak(&shard.queue_peak_events, depth);
     }
   }
 }
 
-WatcherHandle PlatformWatch(const char* path) {
-  if (g_inotify == -1) {
+void PlatformThread() {
+  if (g_init_errno == 0)
+    ReadShard(0);
+}
+
+// Every shard has a queue of its own, what matters is the one closest to the
+// limit.
+void PlatformGetQueueStats(QueueStats* stats) {
+  stats->supported = true;
+  stats->limit = g_max_queued_events;
+  for (int i = 0; i < g_shard_count; ++i) {
+    Shard& shard = g_shards[i];
+    stats->bytes = std::max<uint32_t>(stats->bytes, shard.queue_bytes);
+    stats->events = std::max<uint32_t>(stats->events, shard.queue_events);
+    stats->peak_bytes = std::max(stats->peak_bytes, shard.queue_peak_bytes.exchange(0));
+    stats->peak_events = std::max(stats->peak_events, shard.queue_peak_events.exchange(0));
+  }
+}
+
+WatcherHandle PlatformWatch(const char* path, const PathFilterPtr& filter) {
+  if (g_fanotify_enabled) {
+    WatcherHandle handle = FanotifyWatch(path, false, filter);
+    if (!ShouldFallBackToInotify(handle))
+      return handle;
+  }
+
+  if (g_init_errno != 0) {
     return -g_init_errno;
   }
 
-  int fd = inotify_add_watch(g_inotify, path, IN_ATTRIB | IN_CREATE |
-      IN_DELETE | IN_MODIFY | IN_MOVE | IN_MOVE_SELF | IN_DELETE_SELF);
-  if (fd == -1) {
-    return -errno;
+  int shard;
+  {
+    ScopedLocker locker(g_watches_mutex);
+    shard = NextShard();
+  }
+  int fd = AddWatch(shard, path, kWatchMask);
+  if (fd < 0) {
+    return fd;
   }
+
+  struct stat st;
+  bool is_file = stat(path, &st) == 0 && !S_ISDIR(st.st_mode);
+
+  ScopedLocker locker(g_watches_mutex);
+  WatchEntry& entry = g_watches[fd];
+  entry.path.assign(path, path + strlen(path));
+  entry.direct = true;
+  entry.handle = fd;
+  entry.filter = filter;
+  if (is_file)
+    GuardFile(fd);
   return fd;
 }
 
+WatcherHandle PlatformWatchTree(const char* path, const PathFilterPtr& filter) {
+  if (g_fanotify_enabled) {
+    WatcherHandle handle = FanotifyWatch(path, true, filter);
+    if (!ShouldFallBackToInotify(handle))
+      return handle;
+  }
+
+  if (g_init_errno != 0) {
+    return -g_init_errno;
+  }
+
+  WatcherHandle tree;
+  {
+    ScopedLocker locker(g_watches_mutex);
+    tree = g_next_tree_handle++;
+    g_trees[tree].filter = filter;
+    g_trees[tree].shard = NextShard();
+  }
+
+  int root_wd = AddTreeDirectory(tree, std::vector<char>(path, path + strlen(path)), NULL);
+
+  ScopedLocker locker(g_watches_mutex);
+  if (root_wd < 0) {
+    g_trees.erase(tree);
+    return root_wd;
+  }
+  g_trees[tree].root_wd = root_wd;
+  return tree;
+}
+
 void PlatformUnwatch(WatcherHandle fd) {
-  inotify_rm_watch(g_inotify, fd);
+  if (IsFanotifyHandle(fd)) {
+    FanotifyUnwatch(fd);
+    return;
+  }
+
+  ScopedLocker locker(g_watches_mutex);
+
+  if (fd >= kTreeHandleBase) {
+    std::map<WatcherHandle, Tree>::iterator tree = g_trees.find(fd);
+    if (tree == g_trees.end())
+      return;
+    std::set<int> wds;
+    wds.swap(tree->second.wds);
+    g_trees.erase(tree);
+    for (std::set<int>::const_iterator iter = wds.begin(); iter != wds.end(); ++iter)
+      RemoveWatchFromTree(*iter, fd);
+    return;
+  }
+
+  int wd = fd;
+  std::map<WatcherHandle, int>::iterator replaced = g_replaced.find(fd);
+  if (replaced != g_replaced.end()) {
+    wd = replaced->second;
+    g_replaced.erase(replaced);
+  }
+
+  std::map<int, WatchEntry>::iterator iter = g_watches.find(wd);
+  if (iter == g_watches.end()) {
+    if (wd == fd)
+      RemoveWatch(fd);
+    return;
+  }
+  iter->second.direct = false;
+  if (iter->second.guard != -1) {
+    ReleaseGuard(wd, iter->second.guard);
+    iter->second.guard = -1;
+  }
+  ReleaseWatchIfUnused(wd);
 }
 
 bool PlatformIsHandleValid(WatcherHandle handle) {
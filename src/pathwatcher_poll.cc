@@ -0,0 +1,474 @@
+#include "pathwatcher_poll.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#if defined(__linux__)
+#include <sys/vfs.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/mount.h>
+#include <sys/param.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// A path is polled this often right after it changed, and less and less
+// often the longer it stays quiet: every quarter of the time since its last
+// change, up to the maximum.
+static const uint64_t kMinPollIntervalMs = 100;
+static const uint64_t kMaxPollIntervalMs = 2000;
+static const uint64_t kQuietDivisor = 4;
+
+#if defined(__linux__)
+// The statfs() magic numbers of filesystems that can change without the local
+// kernel knowing.
+static const uint32_t kPolledFilesystems[] = {
+  0x6969,      // NFS_SUPER_MAGIC
+  0x517B,      // SMB_SUPER_MAGIC
+  0xFF534D42,  // CIFS_SUPER_MAGIC
+  0xFE534D42,  // SMB2_SUPER_MAGIC
+  0x65735546,  // FUSE_SUPER_MAGIC, which covers sshfs
+  0x01021997,  // V9FS_MAGIC
+  0x5346414F,  // AFS_FS_MAGIC
+  0x6B414653,  // AFS_SUPER_MAGIC
+  0x73757245,  // CODA_SUPER_MAGIC
+};
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+static const char* const kPolledFilesystems[] = {
+  "nfs", "smbfs", "afpfs", "webdav", "osxfuse", "macfuse", "fusefs",
+};
+#endif
+
+// What a poll compares to decide whether a path changed. The records of a
+// snapshot are sorted by path, the paths are relative to the watched one and
+// packed into a buffer of their own.
+struct PollRecord {
+  uint64_t inode;
+  uint64_t size;
+  int64_t mtime;
+  int64_t ctime;
+  uint32_t path_offset;
+  uint32_t path_length;
+  bool is_dir;
+};
+
+// The first record is the watched path itself, its path is empty.
+struct PollSnapshot {
+  std::vector<PollRecord> records;
+  std::vector<char> paths;
+};
+
+struct PolledPath {
+  PolledPath() : recursive(false), last_change(0), due(0), gone(false), cancelled(false) {}
+
+  std::string root;
+  bool recursive;
+  PathFilterPtr filter;
+  PollSnapshot snapshot;
+
+  // Only touched by the polling thread once the watch is added.
+  uint64_t last_change;
+  uint64_t due;
+  bool gone;
+
+  std::atomic<bool> cancelled;
+};
+
+struct ScopedLocker {
+  explicit ScopedLocker(uv_mutex_t& mutex) : mutex_(&mutex) { uv_mutex_lock(mutex_); }
+  ~ScopedLocker() { uv_mutex_unlock(mutex_); }
+
+  uv_mutex_t* mutex_;
+};
+
+static std::map<WatcherHandle, std::shared_ptr<PolledPath> > g_polled;
+static WatcherHandle g_next_handle = kPollHandleBase;
+static uv_mutex_t g_poll_mutex;
+static uv_cond_t g_poll_cond;
+static uv_thread_t g_poll_thread;
+static bool g_poll_thread_started;
+static bool g_poll_stopping;
+static bool g_poll_everything;
+
+static uint64_t NowMs() {
+  return uv_hrtime() / 1000000;
+}
+
+static int64_t Nanoseconds(const struct timespec& time) {
+  return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+static std::string JoinPath(const std::string& root, const std::string& relative) {
+  if (relative.empty())
+    return root;
+  if (root == "/")
+    return root + relative;
+  return root + '/' + relative;
+}
+
+static void AddRecord(PollSnapshot* snapshot, const struct stat& st, const std::string& path) {
+  PollRecord record;
+  record.inode = st.st_ino;
+  record.size = st.st_size;
+#ifdef __APPLE__
+  record.mtime = Nanoseconds(st.st_mtimespec);
+  record.ctime = Nanoseconds(st.st_ctimespec);
+#else
+  record.mtime = Nanoseconds(st.st_mtim);
+  record.ctime = Nanoseconds(st.st_ctim);
+#endif
+  record.path_offset = static_cast<uint32_t>(snapshot->paths.size());
+  record.path_length = static_cast<uint32_t>(path.size());
+  record.is_dir = S_ISDIR(st.st_mode);
+  snapshot->records.push_back(record);
+  snapshot->paths.insert(snapshot->paths.end(), path.begin(), path.end());
+}
+
+static std::string PathOf(const PollSnapshot& snapshot, const PollRecord& record) {
+  const char* path = snapshot.paths.data() + record.path_offset;
+  return std::string(path, path + record.path_length);
+}
+
+static int ComparePaths(const PollSnapshot& a, const PollRecord& x,
+                        const PollSnapshot& b, const PollRecord& y) {
+  int order = memcmp(a.paths.data() + x.path_offset, b.paths.data() + y.path_offset,
+                     std::min(x.path_length, y.path_length));
+  if (order != 0)
+    return order;
+  return x.path_length < y.path_length ? -1 : x.path_length > y.path_length ? 1 : 0;
+}
+
+struct ByPath {
+  explicit ByPath(const PollSnapshot& snapshot) : snapshot_(&snapshot) {}
+
+  bool operator()(const PollRecord& x, const PollRecord& y) const {
+    return ComparePaths(*snapshot_, x, *snapshot_, y) < 0;
+  }
+
+  const PollSnapshot* snapshot_;
+};
+
+// Directories are compared by identity alone, their times change with their
+// children which are compared on their own.
+static bool SameContents(const PollRecord& x, const PollRecord& y) {
+  return x.inode == y.inode && x.size == y.size && x.mtime == y.mtime && x.ctime == y.ctime;
+}
+
+// Stats |root| and, when it is a directory, its children or with |recursive|
+// everything below it that |filter| lets through. Returns 0 or the errno of
+// why |root| can't be polled.
+static int Scan(const std::string& root,
+                bool recursive,
+                const PathFilterPtr& filter,
+                PollSnapshot* snapshot) {
+  struct stat st;
+  if (stat(root.c_str(), &st) == -1)
+    return errno;
+  AddRecord(snapshot, st, std::string());
+  if (!S_ISDIR(st.st_mode))
+    return 0;
+
+  std::vector<std::string> pending(1, std::string());
+  while (!pending.empty()) {
+    std::string dir;
+    dir.swap(pending.back());
+    pending.pop_back();
+
+    DIR* handle = opendir(JoinPath(root, dir).c_str());
+    if (handle == NULL)
+      continue;
+    while (dirent* child = readdir(handle)) {
+      if (strcmp(child->d_name, ".") == 0 || strcmp(child->d_name, "..") == 0)
+        continue;
+
+      std::string relative = dir.empty() ? child->d_name : dir + '/' + child->d_name;
+      if (lstat(JoinPath(root, relative).c_str(), &st) == -1)
+        continue;
+
+      bool is_dir = S_ISDIR(st.st_mode);
+      if (is_dir && filter && !filter->ShouldDescend(relative))
+        continue;
+      if (FilterAccepts(filter, relative, is_dir))
+        AddRecord(snapshot, st, relative);
+      if (is_dir && recursive)
+        pending.push_back(relative);
+    }
+    closedir(handle);
+  }
+
+  std::sort(snapshot->records.begin() + 1, snapshot->records.end(), ByPath(*snapshot));
+  return 0;
+}
+
+static void AddEvent(std::vector<WatcherEvent>* events,
+                     EVENT_TYPE type,
+                     WatcherHandle handle,
+                     const std::string& path = std::string(),
+                     const std::string& old_path = std::string()) {
+  events->push_back(WatcherEvent());
+  events->back().type = type;
+  events->back().handle = handle;
+  events->back().new_path.assign(path.begin(), path.end());
+  events->back().old_path.assign(old_path.begin(), old_path.end());
+}
+
+// Appends the events that turn the children in |before| into those in
+// |after|. A path that went away and one that appeared with the same inode are
+// a rename, and the children of a renamed directory just follow it.
+static void DiffChildren(WatcherHandle handle,
+                         const std::string& root,
+                         const PollSnapshot& before,
+                         const PollSnapshot& after,
+                         std::vector<WatcherEvent>* events) {
+  std::vector<size_t> deleted;
+  std::vector<size_t> created;
+  std::vector<size_t> changed;
+  size_t i = 1;
+  size_t j = 1;
+  while (i < before.records.size() || j < after.records.size()) {
+    int order = i == before.records.size() ? 1 :
+        j == after.records.size() ? -1 :
+        ComparePaths(before, before.records[i], after, after.records[j]);
+    if (order < 0) {
+      deleted.push_back(i++);
+    } else if (order > 0) {
+      created.push_back(j++);
+    } else {
+      const PollRecord& was = before.records[i];
+      const PollRecord& is = after.records[j];
+      if (was.is_dir != is.is_dir) {
+        deleted.push_back(i);
+        created.push_back(j);
+      } else if (!is.is_dir && !SameContents(was, is)) {
+        changed.push_back(j);
+      }
+      ++i;
+      ++j;
+    }
+  }
+
+  std::unordered_map<uint64_t, size_t> deleted_inodes;
+  for (size_t k = 0; k < deleted.size(); ++k)
+    deleted_inodes[before.records[deleted[k]].inode] = k;
+
+  std::vector<bool> moved_from(deleted.size(), false);
+  std::vector<bool> moved_to(created.size(), false);
+  std::vector<std::pair<std::string, std::string> > moved_dirs;
+  for (size_t k = 0; k < created.size(); ++k) {
+    const PollRecord& is = after.records[created[k]];
+    std::unordered_map<uint64_t, size_t>::const_iterator found = deleted_inodes.find(is.inode);
+    if (found == deleted_inodes.end() || moved_from[found->second] ||
+        before.records[deleted[found->second]].is_dir != is.is_dir)
+      continue;
+    moved_from[found->second] = true;
+    moved_to[k] = true;
+
+    // Created paths are sorted, so a directory comes before its children.
+    std::string old_path = PathOf(before, before.records[deleted[found->second]]);
+    std::string path = PathOf(after, is);
+    bool followed = false;
+    for (size_t m = 0; m < moved_dirs.size() && !followed; ++m) {
+      const std::string& old_dir = moved_dirs[m].first;
+      const std::string& new_dir = moved_dirs[m].second;
+      followed = old_path.size() > old_dir.size() &&
+          old_path.compare(0, old_dir.size(), old_dir) == 0 &&
+          old_path[old_dir.size()] == '/' &&
+          path == new_dir + old_path.substr(old_dir.size());
+    }
+    if (followed)
+      continue;
+    if (is.is_dir)
+      moved_dirs.push_back(std::make_pair(old_path, path));
+    AddEvent(events, EVENT_CHILD_RENAME, handle, JoinPath(root, path), JoinPath(root, old_path));
+  }
+
+  // Deepest first, so nothing is reported deleted after its directory.
+  for (size_t k = deleted.size(); k-- > 0;) {
+    if (!moved_from[k])
+      AddEvent(events, EVENT_CHILD_DELETE, handle,
+               JoinPath(root, PathOf(before, before.records[deleted[k]])));
+  }
+  for (size_t k = 0; k < created.size(); ++k) {
+    if (!moved_to[k])
+      AddEvent(events, EVENT_CHILD_CREATE, handle,
+               JoinPath(root, PathOf(after, after.records[created[k]])));
+  }
+  for (size_t k = 0; k < changed.size(); ++k)
+    AddEvent(events, EVENT_CHILD_CHANGE, handle,
+             JoinPath(root, PathOf(after, after.records[changed[k]])));
+}
+
+// Scans |watch| and appends what changed since the last time to |events|.
+static void Poll(WatcherHandle handle, PolledPath* watch, std::vector<WatcherEvent>* events) {
+  PollSnapshot after;
+  int error = Scan(watch->root, watch->recursive, watch->filter, &after);
+  // A flaky network filesystem can fail a poll now and then, only believe it
+  // when it says the path is gone.
+  if (error != 0 && error != ENOENT && error != ENOTDIR && error != ESTALE)
+    return;
+
+  const PollRecord& was = watch->snapshot.records[0];
+  if (error != 0 || after.records[0].is_dir != was.is_dir ||
+      (was.is_dir && after.records[0].inode != was.inode)) {
+    AddEvent(events, EVENT_DELETE, handle);
+    watch->gone = true;
+    return;
+  }
+
+  // A file replaced by another one, as editors save them, is a change like
+  // any other.
+  if (!was.is_dir && !SameContents(was, after.records[0]))
+    AddEvent(events, EVENT_CHANGE, handle);
+  if (was.is_dir)
+    DiffChildren(handle, watch->root, watch->snapshot, after, events);
+  watch->snapshot.records.swap(after.records);
+  watch->snapshot.paths.swap(after.paths);
+}
+
+static void PollThread(void* arg) {
+  uv_mutex_lock(&g_poll_mutex);
+  while (!g_poll_stopping) {
+    uint64_t now = NowMs();
+    uint64_t next = UINT64_MAX;
+    std::vector<std::pair<WatcherHandle, std::shared_ptr<PolledPath> > > due;
+    for (std::map<WatcherHandle, std::shared_ptr<PolledPath> >::const_iterator iter =
+             g_polled.begin();
+         iter != g_polled.end();
+         ++iter) {
+      if (iter->second->gone)
+        continue;
+      if (iter->second->due <= now)
+        due.push_back(*iter);
+      else
+        next = std::min(next, iter->second->due);
+    }
+
+    if (due.empty()) {
+      if (next == UINT64_MAX)
+        uv_cond_wait(&g_poll_cond, &g_poll_mutex);
+      else
+        uv_cond_timedwait(&g_poll_cond, &g_poll_mutex, (next - now) * 1000000);
+      continue;
+    }
+
+    // Scanning can take a while on a slow filesystem, watches can come and
+    // go meanwhile.
+    uv_mutex_unlock(&g_poll_mutex);
+    for (size_t i = 0; i < due.size(); ++i) {
+      PolledPath* watch = due[i].second.get();
+      std::vector<WatcherEvent> events;
+      Poll(due[i].first, watch, &events);
+      SetEventReadTime(uv_hrtime());
+
+      now = NowMs();
+      if (!events.empty())
+        watch->last_change = now;
+      uint64_t interval = (now - watch->last_change) / kQuietDivisor;
+      watch->due = now + std::max(kMinPollIntervalMs, std::min(interval, kMaxPollIntervalMs));
+
+      for (size_t j = 0; j < events.size() && !watch->cancelled; ++j)
+        PostEvent(events[j].type, events[j].handle, events[j].new_path, events[j].old_path);
+    }
+    uv_mutex_lock(&g_poll_mutex);
+  }
+  uv_mutex_unlock(&g_poll_mutex);
+}
+
+#if NODE_VERSION_AT_LEAST(10, 2, 0)
+static void StopPolling(void* arg) {
+  ScopedLocker locker(g_poll_mutex);
+  g_poll_stopping = true;
+  uv_cond_signal(&g_poll_cond);
+}
+#endif
+
+void PollInit() {
+  uv_mutex_init(&g_poll_mutex);
+  uv_cond_init(&g_poll_cond);
+
+  const char* backend = getenv("PATHWATCHER_BACKEND");
+  g_poll_everything = backend != NULL && strcmp(backend, "poll") == 0;
+
+#if NODE_VERSION_AT_LEAST(10, 2, 0)
+  AddExitHook(StopPolling, NULL);
+#endif
+}
+
+bool ShouldPoll(const char* path) {
+  if (g_poll_everything)
+    return true;
+
+#if defined(__linux__)
+  struct statfs fs;
+  if (statfs(path, &fs) == -1)
+    return false;
+  uint32_t type = static_cast<uint32_t>(fs.f_type);
+  for (size_t i = 0; i < sizeof(kPolledFilesystems) / sizeof(kPolledFilesystems[0]); ++i) {
+    if (type == kPolledFilesystems[i])
+      return true;
+  }
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+  struct statfs fs;
+  if (statfs(path, &fs) == -1)
+    return false;
+  for (size_t i = 0; i < sizeof(kPolledFilesystems) / sizeof(kPolledFilesystems[0]); ++i) {
+    if (strcmp(fs.f_fstypename, kPolledFilesystems[i]) == 0)
+      return true;
+  }
+#endif
+  return false;
+}
+
+static WatcherHandle StartPolling(const char* path, bool recursive, const PathFilterPtr& filter) {
+  std::shared_ptr<PolledPath> watch(new PolledPath);
+  watch->root = path;
+  watch->recursive = recursive;
+  watch->filter = filter;
+  int error = Scan(watch->root, recursive, filter, &watch->snapshot);
+  if (error != 0)
+    return -error;
+  if (recursive && !watch->snapshot.records[0].is_dir)
+    return -ENOTDIR;
+
+  watch->last_change = NowMs();
+  watch->due = watch->last_change + kMinPollIntervalMs;
+
+  ScopedLocker locker(g_poll_mutex);
+  if (!g_poll_thread_started) {
+    uv_thread_create(&g_poll_thread, PollThread, NULL);
+    g_poll_thread_started = true;
+  }
+  WatcherHandle handle = g_next_handle++;
+  g_polled[handle] = watch;
+  uv_cond_signal(&g_poll_cond);
+  return handle;
+}
+
+WatcherHandle PollWatch(const char* path, const PathFilterPtr& filter) {
+  return StartPolling(path, false, filter);
+}
+
+WatcherHandle PollWatchTree(const char* path, const PathFilterPtr& filter) {
+  return StartPolling(path, true, filter);
+}
+
+void PollUnwatch(WatcherHandle handle) {
+  ScopedLocker locker(g_poll_mutex);
+  std::map<WatcherHandle, std::shared_ptr<PolledPath> >::iterator iter = g_polled.find(handle);
+  if (iter == g_polled.end())
+    return;
+  iter->second->cancelled = true;
+  g_polled.erase(iter);
+}
@@ -0,0 +1,32 @@
+#ifndef SRC_PATHWATCHER_POLL_H_
+#define SRC_PATHWATCHER_POLL_H_
+
+#include "common.h"
+
+// Changes made by other hosts on network filesystems never reach the kernel
+// backends, so paths there are polled instead. A thread of its own stats them
+// every so often and posts the differences as the same events the kernel
+// backends would, polling the paths that changed recently more often.
+
+// Handles given out by the polling backend start here, above the ranges used
+// by the kernel backends.
+static const WatcherHandle kPollHandleBase = 0x60000000;
+
+// Called once per process, the thread is started with the first watch.
+void PollInit();
+
+// Whether |path| is on a filesystem the kernel backends may miss changes on,
+// or everything is polled because PATHWATCHER_BACKEND=poll.
+bool ShouldPoll(const char* path);
+
+// Same contract as PlatformWatch and PlatformWatchTree, a negative errno on
+// failure.
+WatcherHandle PollWatch(const char* path, const PathFilterPtr& filter);
+WatcherHandle PollWatchTree(const char* path, const PathFilterPtr& filter);
+void PollUnwatch(WatcherHandle handle);
+
+inline bool IsPollHandle(WatcherHandle handle) {
+  return handle >= kPollHandleBase;
+}
+
+#endif  // SRC_PATHWATCHER_POLL_H_
@@ -42,6 +42,8 @@ void PlatformThread() {
     do {
       r = kevent(g_kqueue, NULL, 0, &event, 1, NULL);
     } while ((r == -1 && errno == EINTR) || r == 0);
+    SetEventReadTime(uv_hrtime());
+    CountStat(STAT_EVENTS_READ);
 
     EVENT_TYPE type;
     int fd = static_cast<int>(event.ident);
@@ -65,14 +67,16 @@ void PlatformThread() {
       // some reason.
       type = EVENT_CHANGE;
     } else {
+      CountStat(STAT_EVENTS_IGNORED);
       continue;
     }
 
-    PostEventAndWait(type, fd, path);
+    PostEvent(type, fd, path);
   }
 }
 
-WatcherHandle PlatformWatch(const char* path) {
+// kqueue only reports on the watched path itself, which is never filtered.
+WatcherHandle PlatformWatch(const char* path, const PathFilterPtr&) {
   if (g_kqueue == -1) {
     return -g_init_errno;
   }
@@ -96,6 +100,11 @@ WatcherHandle PlatformWatch(const char* path) {
   return fd;
 }
 
+// kqueue can only watch what we hold a descriptor for.
+WatcherHandle PlatformWatchTree(const char* path, const PathFilterPtr& filter) {
+  return -ENOSYS;
+}
+
 void PlatformUnwatch(WatcherHandle fd) {
   close(fd);
 }
@@ -107,3 +116,8 @@ bool PlatformIsHandleValid(WatcherHandle handle) {
 int PlatformInvalidHandleToErrorNumber(WatcherHandle handle) {
   return -handle;
 }
+
+void PlatformGetQueueStats(QueueStats* stats) {
+  // The kernel doesn't tell how deep its queue is.
+  stats->supported = false;
+}
@@ -7,8 +7,9 @@
 // Size of the buffer to store result of ReadDirectoryChangesW.
 static const unsigned int kDirectoryWatcherBufferSize = 4096;
 
-// Object template to create representation of WatcherHandle.
-static Nan::Persistent<ObjectTemplate> g_object_template;
+// Object template to create representation of WatcherHandle. Templates
+// belong to an isolate, so every environment's thread makes its own.
+static thread_local Nan::Persistent<ObjectTemplate>* t_object_template = NULL;
 
 // Mutex for the HandleWrapper map.
 static uv_mutex_t g_handle_wrap_map_mutex;
@@ -32,9 +33,14 @@ struct ScopedLocker {
 };
 
 struct HandleWrapper {
-  HandleWrapper(WatcherHandle handle, const char* path_str)
+  HandleWrapper(WatcherHandle handle,
+                const char* path_str,
+                bool watch_subtree,
+                const PathFilterPtr& path_filter)
       : dir_handle(handle),
         path(strlen(path_str)),
+        recursive(watch_subtree),
+        filter(path_filter),
         canceled(false) {
     memset(&overlapped, 0, sizeof(overlapped));
     overlapped.hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
@@ -62,6 +68,8 @@ struct HandleWrapper {
 
   WatcherHandle dir_handle;
   std::vector<char> path;
+  bool recursive;
+  PathFilterPtr filter;
   bool canceled;
   OVERLAPPED overlapped;
   char buffer[kDirectoryWatcherBufferSize];
@@ -73,18 +81,11 @@ struct HandleWrapper {
 
 std::map<WatcherHandle, HandleWrapper*> HandleWrapper::map_;
 
-struct WatcherEvent {
-  EVENT_TYPE type;
-  WatcherHandle handle;
-  std::vector<char> new_path;
-  std::vector<char> old_path;
-};
-
 static bool QueueReaddirchanges(HandleWrapper* handle) {
   return ReadDirectoryChangesW(handle->dir_handle,
                                handle->buffer,
                                kDirectoryWatcherBufferSize,
-                               FALSE,
+                               handle->recursive ? TRUE : FALSE,
                                FILE_NOTIFY_CHANGE_FILE_NAME      |
                                  FILE_NOTIFY_CHANGE_DIR_NAME     |
                                  FILE_NOTIFY_CHANGE_ATTRIBUTES   |
@@ -98,9 +99,36 @@ static bool QueueReaddirchanges(HandleWrapper* handle) {
                                NULL) == TRUE;
 }
 
+// Whether |handle| reports the child at |relative|, a path below the watched
+// directory.
+static bool HandleAccepts(HandleWrapper* handle,
+                          const char* relative,
+                          int relative_size,
+                          const std::vector<char>& path) {
+  if (!handle->filter)
+    return true;
+
+  // The notification doesn't tell whether it is about a directory, ask the
+  // file system unless it is already gone.
+  wchar_t wpath[MAX_PATH] = { 0 };
+  std::string path_string(path.begin(), path.end());
+  MultiByteToWideChar(CP_UTF8, 0, path_string.c_str(), -1, wpath, MAX_PATH);
+  DWORD attr = GetFileAttributesW(wpath);
+  bool is_dir = attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY);
+
+  std::string name(relative, relative_size);
+  std::replace(name.begin(), name.end(), '\\', '/');
+  return handle->filter->ShouldReport(name, is_dir);
+}
+
 Local<Value> WatcherHandleToV8Value(WatcherHandle handle) {
+  if (t_object_template == NULL) {
+    t_object_template = new Nan::Persistent<ObjectTemplate>(Nan::New<ObjectTemplate>());
+    Nan::New(*t_object_template)->SetInternalFieldCount(1);
+  }
+
   Local<v8::Context> context = Nan::GetCurrentContext();
-  Local<Value> value = Nan::New(g_object_template)->NewInstance(context).ToLocalChecked();
+  Local<Value> value = Nan::New(*t_object_template)->NewInstance(context).ToLocalChecked();
   Nan::SetInternalFieldPointer(value->ToObject(context).ToLocalChecked(), 0, handle);
   return value;
 }
@@ -122,9 +150,6 @@ void PlatformInit() {
   g_wake_up_event = CreateEvent(NULL, FALSE, FALSE, NULL);
   g_events.push_back(g_wake_up_event);
 
-  g_object_template.Reset(Nan::New<ObjectTemplate>());
-  Nan::New(g_object_template)->SetInternalFieldCount(1);
-
   WakeupNewThread();
 }
 
@@ -158,16 +183,30 @@ void PlatformThread() {
       DWORD bytes_transferred;
       if (!GetOverlappedResult(handle->dir_handle, &handle->overlapped, &bytes_transferred, FALSE))
         continue;
-      if (bytes_transferred == 0)
+      SetEventReadTime(uv_hrtime());
+
+      // Nothing transferred means the changes didn't fit into the buffer and
+      // were thrown away.
+      if (bytes_transferred == 0) {
+        QueueReaddirchanges(handle);
+        WatcherHandle key = handle->overlapped.hEvent;
+        locker.Unlock();
+        CountStat(STAT_EVENTS_READ);
+        PostEvent(EVENT_OVERFLOW, key, std::vector<char>());
         continue;
+      }
 
       std::vector<char> old_path;
+      bool old_path_reported = false;
       std::vector<WatcherEvent> events;
+      uint64_t records = 0;
+      uint64_t rename_halves = 0;
 
       DWORD offset = 0;
       while (true) {
         FILE_NOTIFY_INFORMATION* file_info =
             reinterpret_cast<FILE_NOTIFY_INFORMATION*>(handle->buffer + offset);
+        ++records;
 
         // Emit events for children.
         EVENT_TYPE event = EVENT_NONE;
@@ -213,16 +252,32 @@ void PlatformThread() {
           *(iter++) = '\\';
           std::copy(filename, filename + size, iter);
 
+          bool reported = HandleAccepts(handle, filename, size, path);
           if (file_info->Action == FILE_ACTION_RENAMED_OLD_NAME) {
             // Do not send rename event until the NEW_NAME event, but still keep
             // a record of old name.
             old_path.swap(path);
+            old_path_reported = reported;
+            ++rename_halves;
           } else if (file_info->Action == FILE_ACTION_RENAMED_NEW_NAME) {
-            WatcherEvent e = { event, handle->overlapped.hEvent };
-            e.new_path.swap(path);
-            e.old_path.swap(old_path);
-            events.push_back(e);
-          } else {
+            // A rename from or to a filtered out name is a creation or a
+            // deletion as far as the watcher is concerned.
+            if (reported && old_path_reported) {
+              WatcherEvent e = { event, handle->overlapped.hEvent };
+              e.new_path.swap(path);
+              e.old_path.swap(old_path);
+              events.push_back(e);
+            } else if (reported) {
+              WatcherEvent e = { EVENT_CHILD_CREATE, handle->overlapped.hEvent };
+              e.new_path.swap(path);
+              events.push_back(e);
+            } else if (old_path_reported) {
+              WatcherEvent e = { EVENT_CHILD_DELETE, handle->overlapped.hEvent };
+              e.new_path.swap(old_path);
+              events.push_back(e);
+            }
+            old_path.clear();
+          } else if (reported) {
             WatcherEvent e = { event, handle->overlapped.hEvent };
             e.new_path.swap(path);
             events.push_back(e);
@@ -238,16 +293,21 @@ void PlatformThread() {
 
       locker.Unlock();
 
+      // The first half of a rename is posted with the second.
+      CountStat(STAT_EVENTS_READ, records);
+      CountStat(STAT_EVENTS_IGNORED, records - rename_halves - events.size());
       for (size_t i = 0; i < events.size(); ++i)
-        PostEventAndWait(events[i].type,
-                         events[i].handle,
-                         events[i].new_path,
-                         events[i].old_path);
+        PostEvent(events[i].type,
+                  events[i].handle,
+                  events[i].new_path,
+                  events[i].old_path);
     }
   }
 }
 
-WatcherHandle PlatformWatch(const char* path) {
+static WatcherHandle WatchDirectory(const char* path,
+                                    bool recursive,
+                                    const PathFilterPtr& filter) {
   wchar_t wpath[MAX_PATH] = { 0 };
   MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH);
 
@@ -273,7 +333,7 @@ WatcherHandle PlatformWatch(const char* path) {
   std::unique_ptr<HandleWrapper> handle;
   {
     ScopedLocker locker(g_handle_wrap_map_mutex);
-    handle.reset(new HandleWrapper(dir_handle, path));
+    handle.reset(new HandleWrapper(dir_handle, path, recursive, filter));
   }
 
   if (!QueueReaddirchanges(handle.get())) {
@@ -287,6 +347,17 @@ WatcherHandle PlatformWatch(const char* path) {
   return handle.release()->overlapped.hEvent;
 }
 
+WatcherHandle PlatformWatch(const char* path, const PathFilterPtr& filter) {
+  return WatchDirectory(path, false, filter);
+}
+
+// ReadDirectoryChangesW reports the whole subtree with paths relative to the
+// watched directory, so the events already carry what we need. It can't be
+// told to skip directories, ignored ones are filtered as their events arrive.
+WatcherHandle PlatformWatchTree(const char* path, const PathFilterPtr& filter) {
+  return WatchDirectory(path, true, filter);
+}
+
 void PlatformUnwatch(WatcherHandle key) {
   if (PlatformIsHandleValid(key)) {
     HandleWrapper* handle;
@@ -311,3 +382,8 @@ bool PlatformIsHandleValid(WatcherHandle handle) {
 int PlatformInvalidHandleToErrorNumber(WatcherHandle handle) {
   return 0;
 }
+
+void PlatformGetQueueStats(QueueStats* stats) {
+  // The kernel doesn't tell how deep its queue is.
+  stats->supported = false;
+}
@@ -0,0 +1,930 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+static const char kSeparator = '\\';
+#else
+static const char kSeparator = '/';
+#endif
+
+// What a rescan compares to decide whether a path changed.
+struct StatEntry {
+  uint64_t ino;
+  uint64_t mode;
+  uint64_t size;
+  uv_timespec_t mtime;
+  uv_timespec_t ctime;
+
+  bool IsDirectory() const { return (mode & S_IFMT) == S_IFDIR; }
+
+  // A directory's times change with its children, which are compared on
+  // their own, so only its identity matters.
+  bool SameAs(const StatEntry& other) const {
+    if (ino != other.ino || mode != other.mode)
+      return false;
+    if (IsDirectory())
+      return true;
+    return size == other.size &&
+        mtime.tv_sec == other.mtime.tv_sec && mtime.tv_nsec == other.mtime.tv_nsec &&
+        ctime.tv_sec == other.ctime.tv_sec && ctime.tv_nsec == other.ctime.tv_nsec;
+  }
+};
+
+// Keyed by the path relative to the watched one with '/' separators, the
+// watched path itself is the empty string.
+typedef std::map<std::string, StatEntry> Snapshot;
+
+// A snapshot file is a header followed by records, each padded to 8 bytes so
+// the file can be mapped and walked in place. The records are replayed in
+// order: a put sets a path, an erase drops a path and everything below it.
+// The first records are a complete snapshot, those after it the changes
+// appended since.
+static const char kSnapshotMagic[8] = { 'P', 'W', 'S', 'N', 'A', 'P', '0', '1' };
+
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t recursive;
+  uint32_t root_length;
+};
+
+enum SnapshotRecordKind {
+  RECORD_PUT = 1,
+  RECORD_ERASE = 2,
+};
+
+struct SnapshotRecord {
+  uint32_t kind;
+  uint32_t path_length;
+  uint64_t ino;
+  uint64_t mode;
+  uint64_t size;
+  int64_t mtime_ns;
+  int64_t ctime_ns;
+};
+
+// The appended changes are folded into a complete snapshot again once they
+// take more room than it, or this much for a small one.
+static const uint64_t kMinCompactBytes = 1024 * 1024;
+
+// Restoring a snapshot stats the paths it knows on up to this many threads,
+// each taking at least this many paths.
+static const size_t kVerifyThreads = 8;
+static const size_t kMinPathsPerVerifyThread = 1024;
+
+// An event recorded for a watch, relative to its root.
+struct PendingChange {
+  EVENT_TYPE type;
+  std::string path;
+  std::string old_path;
+};
+
+struct TrackedWatch {
+  TrackedWatch()
+      : journal(-1),
+        journal_bytes(0),
+        snapshot_bytes(0),
+        queued(false),
+        scanning(false),
+        rescan_again(false),
+        cancelled(false) {
+    uv_mutex_init(&io_mutex);
+  }
+  ~TrackedWatch();
+
+  std::string root;
+  bool recursive;
+  PathFilterPtr filter;
+  Snapshot entries;
+
+  // The snapshot file, opened for appending once a scan wrote it. The file
+  // and what is known about it are only touched with io_mutex held, never
+  // with g_tracked_mutex.
+  std::string file;
+  uv_mutex_t io_mutex;
+  uv_file journal;
+  uint64_t journal_bytes;
+  uint64_t snapshot_bytes;
+
+  // The events recorded since the last flush. Watcher threads only add to
+  // them, the paths are stat'ed and the file written on the thread pool.
+  // |queued| while the watch is waiting for a flush or being flushed.
+  std::vector<PendingChange> changes;
+  bool queued;
+
+  // While a scan runs, the paths events touched in the meantime, the scan
+  // may have seen them before or after the change.
+  bool scanning;
+  std::set<std::string> touched;
+
+  bool rescan_again;
+  std::atomic<bool> cancelled;
+};
+
+struct FlushRequest {
+  uv_work_t req;
+  std::shared_ptr<TrackedWatch> watch;
+};
+
+struct ScanRequest {
+  uv_work_t req;
+  WatcherHandle handle;
+  std::shared_ptr<TrackedWatch> watch;
+  bool report;
+  // Whether to start from the snapshot file rather than from nothing.
+  bool restore;
+};
+
+static std::map<WatcherHandle, std::shared_ptr<TrackedWatch> > g_tracked;
+static std::atomic<int> g_tracked_count(0);
+// The number of tracked handles per TrackedBucket(), so the events of the
+// handles that aren't tracked are passed over without taking the lock.
+static const size_t kTrackedBuckets = 64;
+static std::atomic<int> g_tracked_buckets[kTrackedBuckets];
+// The watches with changes that wait for FlushSnapshots().
+static std::vector<std::shared_ptr<TrackedWatch> > g_unflushed;
+static uv_mutex_t g_tracked_mutex;
+static uv_once_t g_tracked_mutex_once = UV_ONCE_INIT;
+
+struct ScopedLocker {
+  explicit ScopedLocker(uv_mutex_t& mutex) : mutex_(&mutex) { uv_mutex_lock(mutex_); }
+  ~ScopedLocker() { uv_mutex_unlock(mutex_); }
+
+  uv_mutex_t* mutex_;
+};
+
+static size_t TrackedBucket(WatcherHandle handle) {
+  return static_cast<size_t>(handle) % kTrackedBuckets;
+}
+
+static bool StatPath(const std::string& path, StatEntry* entry) {
+  uv_fs_t req;
+  int r = uv_fs_lstat(uv_default_loop(), &req, path.c_str(), NULL);
+  if (r == 0) {
+    entry->ino = req.statbuf.st_ino;
+    entry->mode = req.statbuf.st_mode;
+    entry->size = req.statbuf.st_size;
+    entry->mtime = req.statbuf.st_mtim;
+    entry->ctime = req.statbuf.st_ctim;
+  }
+  uv_fs_req_cleanup(&req);
+  return r == 0;
+}
+
+static std::string FullPath(const std::string& root, const std::string& relative) {
+  if (relative.empty())
+    return root;
+  std::string path = root + kSeparator + relative;
+#ifdef _WIN32
+  for (size_t i = root.size(); i < path.size(); ++i) {
+    if (path[i] == '/')
+      path[i] = kSeparator;
+  }
+#endif
+  return path;
+}
+
+static bool InSubtree(const std::string& path, const std::string& dir) {
+  return dir.empty() || path == dir ||
+      (path.size() > dir.size() && path.compare(0, dir.size(), dir) == 0 &&
+       path[dir.size()] == '/');
+}
+
+static void EraseSubtree(Snapshot* snapshot, const std::string& dir) {
+  Snapshot::iterator iter = snapshot->lower_bound(dir);
+  while (iter != snapshot->end() && iter->first.compare(0, dir.size(), dir) == 0) {
+    if (InSubtree(iter->first, dir))
+      snapshot->erase(iter++);
+    else
+      ++iter;
+  }
+}
+
+static void CopySubtree(const Snapshot& from, const std::string& dir, Snapshot* to) {
+  Snapshot::const_iterator iter = from.lower_bound(dir);
+  for (; iter != from.end() && iter->first.compare(0, dir.size(), dir) == 0; ++iter) {
+    if (InSubtree(iter->first, dir))
+      (*to)[iter->first] = iter->second;
+  }
+}
+
+static void MoveSubtree(Snapshot* snapshot,
+                        const std::string& old_dir,
+                        const std::string& new_dir) {
+  Snapshot moved;
+  CopySubtree(*snapshot, old_dir, &moved);
+  EraseSubtree(snapshot, old_dir);
+  EraseSubtree(snapshot, new_dir);
+  for (Snapshot::const_iterator iter = moved.begin(); iter != moved.end(); ++iter)
+    (*snapshot)[new_dir + iter->first.substr(old_dir.size())] = iter->second;
+}
+
+// Lists |dir| and stats its children into |snapshot|, the directories to
+// descend into next are added to |pending|. With |only_new| the children the
+// snapshot already has are left as they are.
+static void ScanChildren(const std::string& root,
+                         const std::string& dir,
+                         bool recursive,
+                         const PathFilterPtr& filter,
+                         bool only_new,
+                         Snapshot* snapshot,
+                         std::vector<std::string>* pending) {
+  uv_fs_t req;
+  if (uv_fs_scandir(uv_default_loop(), &req, FullPath(root, dir).c_str(), 0, NULL) < 0) {
+    uv_fs_req_cleanup(&req);
+    return;
+  }
+
+  StatEntry entry;
+  uv_dirent_t dirent;
+  while (uv_fs_scandir_next(&req, &dirent) == 0) {
+    std::string relative = dir.empty() ? dirent.name : dir + '/' + dirent.name;
+    if (only_new && snapshot->count(relative) > 0)
+      continue;
+    if (!StatPath(FullPath(root, relative), &entry))
+      continue;
+
+    bool is_dir = entry.IsDirectory();
+    if (is_dir && filter && !filter->ShouldDescend(relative))
+      continue;
+    if (!filter || filter->ShouldReport(relative, is_dir))
+      (*snapshot)[relative] = entry;
+    if (is_dir && recursive)
+      pending->push_back(relative);
+  }
+  uv_fs_req_cleanup(&req);
+}
+
+// Stats |root| and, when it is a directory, its children or with |recursive|
+// everything below it that |filter| lets through.
+static void Scan(const std::string& root,
+                 bool recursive,
+                 const PathFilterPtr& filter,
+                 Snapshot* snapshot) {
+  StatEntry entry;
+  if (!StatPath(root, &entry))
+    return;
+  (*snapshot)[std::string()] = entry;
+  if (!entry.IsDirectory())
+    return;
+
+  std::vector<std::string> pending(1, std::string());
+  while (!pending.empty()) {
+    std::string dir;
+    dir.swap(pending.back());
+    pending.pop_back();
+    ScanChildren(root, dir, recursive, filter, false, snapshot, &pending);
+  }
+}
+
+struct VerifyPass {
+  const std::string* root;
+  std::vector<Snapshot::const_iterator> known;
+  std::vector<StatEntry> entries;
+  std::vector<char> found;
+  std::atomic<size_t> next;
+};
+
+static void StatKnownPaths(void* arg) {
+  VerifyPass* pass = static_cast<VerifyPass*>(arg);
+  for (size_t i = pass->next++; i < pass->known.size(); i = pass->next++)
+    pass->found[i] = StatPath(FullPath(*pass->root, pass->known[i]->first), &pass->entries[i]);
+}
+
+// Brings |known|, a snapshot read back from disk, up to date into |snapshot|
+// without scanning everything again. Every path it has is stat'ed, spread
+// over a few threads, and only the directories whose modification time
+// moved are listed for what was created in them. Returns false when |known|
+// has nothing to start from.
+static bool Verify(const std::string& root,
+                   bool recursive,
+                   const PathFilterPtr& filter,
+                   const Snapshot& known,
+                   Snapshot* snapshot) {
+  if (known.count(std::string()) == 0)
+    return false;
+
+  VerifyPass pass;
+  pass.root = &root;
+  for (Snapshot::const_iterator iter = known.begin(); iter != known.end(); ++iter)
+    pass.known.push_back(iter);
+  pass.entries.resize(pass.known.size());
+  pass.found.resize(pass.known.size());
+  pass.next = 0;
+
+  size_t thread_count = std::min(kVerifyThreads, pass.known.size() / kMinPathsPerVerifyThread + 1);
+  std::vector<uv_thread_t> threads(thread_count - 1);
+  for (size_t i = 0; i < threads.size(); ++i)
+    uv_thread_create(&threads[i], StatKnownPaths, &pass);
+  StatKnownPaths(&pass);
+  for (size_t i = 0; i < threads.size(); ++i)
+    uv_thread_join(&threads[i]);
+
+  std::vector<std::string> changed_dirs;
+  for (size_t i = 0; i < pass.known.size(); ++i) {
+    if (!pass.found[i])
+      continue;
+    const std::string& relative = pass.known[i]->first;
+    const StatEntry& before = pass.known[i]->second;
+    const StatEntry& after = pass.entries[i];
+    (*snapshot)[relative] = after;
+    if (after.IsDirectory() && (relative.empty() || recursive) &&
+        (before.ino != after.ino || before.mode != after.mode ||
+         before.mtime.tv_sec != after.mtime.tv_sec || before.mtime.tv_nsec != after.mtime.tv_nsec))
+      changed_dirs.push_back(relative);
+  }
+
+  // What is new in a changed directory is scanned in full.
+  std::vector<std::string> pending;
+  for (size_t i = 0; i < changed_dirs.size(); ++i)
+    ScanChildren(root, changed_dirs[i], recursive, filter, true, snapshot, &pending);
+  while (!pending.empty()) {
+    std::string dir;
+    dir.swap(pending.back());
+    pending.pop_back();
+    ScanChildren(root, dir, recursive, filter, false, snapshot, &pending);
+  }
+  return true;
+}
+
+static int64_t ToNanoseconds(const uv_timespec_t& time) {
+  return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+static uv_timespec_t FromNanoseconds(int64_t nanoseconds) {
+  int64_t seconds = nanoseconds / 1000000000;
+  int64_t rest = nanoseconds % 1000000000;
+  if (rest < 0) {
+    seconds -= 1;
+    rest += 1000000000;
+  }
+  uv_timespec_t time;
+  time.tv_sec = static_cast<long>(seconds);
+  time.tv_nsec = static_cast<long>(rest);
+  return time;
+}
+
+static void AppendPadded(std::string* out, const void* data, size_t size) {
+  out->append(static_cast<const char*>(data), size);
+  out->append((8 - size % 8) % 8, '\0');
+}
+
+static void AppendRecord(std::string* out,
+                         SnapshotRecordKind kind,
+                         const std::string& path,
+                         const StatEntry* entry) {
+  SnapshotRecord record;
+  memset(&record, 0, sizeof(record));
+  record.kind = kind;
+  record.path_length = static_cast<uint32_t>(path.size());
+  if (entry) {
+    record.ino = entry->ino;
+    record.mode = entry->mode;
+    record.size = entry->size;
+    record.mtime_ns = ToNanoseconds(entry->mtime);
+    record.ctime_ns = ToNanoseconds(entry->ctime);
+  }
+  out->append(reinterpret_cast<const char*>(&record), sizeof(record));
+  AppendPadded(out, path.data(), path.size());
+}
+
+static int WriteAll(uv_file fd, const std::string& data) {
+  for (size_t offset = 0; offset < data.size();) {
+    uv_buf_t buf = uv_buf_init(const_cast<char*>(data.data()) + offset,
+                               static_cast<unsigned int>(data.size() - offset));
+    uv_fs_t req;
+    int r = uv_fs_write(uv_default_loop(), &req, fd, &buf, 1, -1, NULL);
+    uv_fs_req_cleanup(&req);
+    if (r < 0)
+      return r;
+    offset += r;
+  }
+  return 0;
+}
+
+static void CloseJournal(TrackedWatch* watch) {
+  if (watch->journal < 0)
+    return;
+  uv_fs_t req;
+  uv_fs_close(uv_default_loop(), &req, watch->journal, NULL);
+  uv_fs_req_cleanup(&req);
+  watch->journal = -1;
+}
+
+TrackedWatch::~TrackedWatch() {
+  CloseJournal(this);
+  uv_mutex_destroy(&io_mutex);
+}
+
+// Replaces the snapshot file with |entries| and opens it for appending.
+// Called with the io_mutex of |watch| held, a failure only means the
+// snapshot isn't kept on disk until the next scan.
+static void WriteSnapshot(TrackedWatch* watch, const Snapshot& entries) {
+  CloseJournal(watch);
+
+  std::string data;
+  SnapshotHeader header;
+  memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+  header.recursive = watch->recursive;
+  header.root_length = static_cast<uint32_t>(watch->root.size());
+  data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  AppendPadded(&data, watch->root.data(), watch->root.size());
+  for (Snapshot::const_iterator iter = entries.begin(); iter != entries.end(); ++iter)
+    AppendRecord(&data, RECORD_PUT, iter->first, &iter->second);
+
+  // Written next to it and renamed over it, so a crash leaves either file.
+  std::string temporary = watch->file + ".tmp";
+  uv_fs_t req;
+  uv_file fd = uv_fs_open(uv_default_loop(), &req, temporary.c_str(),
+                          O_WRONLY | O_CREAT | O_TRUNC, 0644, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0)
+    return;
+  int r = WriteAll(fd, data);
+  uv_fs_close(uv_default_loop(), &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  if (r == 0)
+    r = uv_fs_rename(uv_default_loop(), &req, temporary.c_str(), watch->file.c_str(), NULL);
+  uv_fs_req_cleanup(&req);
+  if (r < 0) {
+    uv_fs_unlink(uv_default_loop(), &req, temporary.c_str(), NULL);
+    uv_fs_req_cleanup(&req);
+    return;
+  }
+
+  watch->journal = uv_fs_open(uv_default_loop(), &req, watch->file.c_str(),
+                              O_WRONLY | O_APPEND, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  watch->snapshot_bytes = data.size();
+  watch->journal_bytes = 0;
+}
+
+// Appends the records in |data| to the snapshot file, and folds them into a
+// complete snapshot once they take too much room. Called with the io_mutex
+// of |watch| held.
+static void AppendJournal(TrackedWatch* watch, const std::string& data) {
+  if (watch->journal < 0 || data.empty() || watch->cancelled)
+    return;
+
+  if (WriteAll(watch->journal, data) < 0) {
+    CloseJournal(watch);
+    return;
+  }
+  watch->journal_bytes += data.size();
+  if (watch->journal_bytes > std::max(kMinCompactBytes, watch->snapshot_bytes)) {
+    Snapshot entries;
+    {
+      ScopedLocker locker(g_tracked_mutex);
+      entries = watch->entries;
+    }
+    WriteSnapshot(watch, entries);
+  }
+}
+
+// Reads the snapshot |file| keeps of |root| into |snapshot|, returns false
+// when there is none or it is of something else. A record cut short by a
+// crash ends it.
+static bool LoadSnapshot(const std::string& file,
+                         const std::string& root,
+                         bool recursive,
+                         Snapshot* snapshot) {
+  uv_fs_t req;
+  uv_file fd = uv_fs_open(uv_default_loop(), &req, file.c_str(), O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0)
+    return false;
+
+  std::vector<char> data;
+  int r = uv_fs_fstat(uv_default_loop(), &req, fd, NULL);
+  if (r == 0)
+    data.resize(req.statbuf.st_size);
+  uv_fs_req_cleanup(&req);
+  size_t length = 0;
+  while (r == 0 && length < data.size()) {
+    uv_buf_t buf = uv_buf_init(data.data() + length, static_cast<unsigned int>(data.size() - length));
+    r = uv_fs_read(uv_default_loop(), &req, fd, &buf, 1, length, NULL);
+    uv_fs_req_cleanup(&req);
+    if (r <= 0)
+      break;
+    length += r;
+    r = 0;
+  }
+  uv_fs_close(uv_default_loop(), &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+
+  SnapshotHeader header;
+  if (length < sizeof(header))
+    return false;
+  memcpy(&header, data.data(), sizeof(header));
+  size_t offset = sizeof(header) + (header.root_length + 7) / 8 * 8;
+  if (memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) != 0 ||
+      header.recursive != static_cast<uint32_t>(recursive) || offset > length ||
+      root.compare(0, std::string::npos, data.data() + sizeof(header), header.root_length) != 0)
+    return false;
+
+  while (offset + sizeof(SnapshotRecord) <= length) {
+    SnapshotRecord record;
+    memcpy(&record, data.data() + offset, sizeof(record));
+    size_t end = offset + sizeof(record) + (record.path_length + 7) / 8 * 8;
+    if (end > length)
+      break;
+    std::string path(data.data() + offset + sizeof(record), record.path_length);
+    if (record.kind == RECORD_PUT) {
+      StatEntry& entry = (*snapshot)[path];
+      entry.ino = record.ino;
+      entry.mode = record.mode;
+      entry.size = record.size;
+      entry.mtime = FromNanoseconds(record.mtime_ns);
+      entry.ctime = FromNanoseconds(record.ctime_ns);
+    } else if (record.kind == RECORD_ERASE) {
+      EraseSubtree(snapshot, path);
+    } else {
+      break;
+    }
+    offset = end;
+  }
+  return true;
+}
+
+// Appends the events that turn |before| into |after| to |events|.
+static void Diff(WatcherHandle handle,
+                 const std::string& root,
+                 const Snapshot& before,
+                 const Snapshot& after,
+                 std::vector<WatcherEvent>* events) {
+  std::string self;
+  bool self_before = before.count(self) > 0;
+  bool self_after = after.count(self) > 0;
+  if (self_before && !self_after) {
+    events->push_back(WatcherEvent());
+    events->back().type = EVENT_DELETE;
+    events->back().handle = handle;
+  } else if (self_after && (!self_before || !before.at(self).SameAs(after.at(self)))) {
+    events->push_back(WatcherEvent());
+    events->back().type = EVENT_CHANGE;
+    events->back().handle = handle;
+  }
+
+  // Deepest first, so nothing is reported deleted after its directory.
+  for (Snapshot::const_reverse_iterator iter = before.rbegin(); iter != before.rend(); ++iter) {
+    if (iter->first.empty() || after.count(iter->first) > 0)
+      continue;
+    std::string path = FullPath(root, iter->first);
+    events->push_back(WatcherEvent());
+    events->back().type = EVENT_CHILD_DELETE;
+    events->back().handle = handle;
+    events->back().new_path.assign(path.begin(), path.end());
+  }
+
+  for (Snapshot::const_iterator iter = after.begin(); iter != after.end(); ++iter) {
+    if (iter->first.empty())
+      continue;
+    Snapshot::const_iterator known = before.find(iter->first);
+    EVENT_TYPE type;
+    if (known == before.end())
+      type = EVENT_CHILD_CREATE;
+    else if (!known->second.SameAs(iter->second))
+      type = EVENT_CHILD_CHANGE;
+    else
+      continue;
+    std::string path = FullPath(root, iter->first);
+    events->push_back(WatcherEvent());
+    events->back().type = type;
+    events->back().handle = handle;
+    events->back().new_path.assign(path.begin(), path.end());
+  }
+}
+
+static void ScanWork(uv_work_t* req) {
+  ScanRequest* request = static_cast<ScanRequest*>(req->data);
+  TrackedWatch* watch = request->watch.get();
+
+  std::string root;
+  bool recursive;
+  PathFilterPtr filter;
+  std::string file;
+  {
+    ScopedLocker locker(g_tracked_mutex);
+    root = watch->root;
+    recursive = watch->recursive;
+    filter = watch->filter;
+    file = watch->file;
+  }
+
+  // Restoring a snapshot reports what changed since it was written, to
+  // which what events recorded since the watch started is added.
+  bool report = request->report;
+  Snapshot restored;
+  Snapshot scanned;
+  if (request->restore && LoadSnapshot(file, root, recursive, &restored) &&
+      Verify(root, recursive, filter, restored, &scanned)) {
+    ScopedLocker locker(g_tracked_mutex);
+    watch->entries.insert(restored.begin(), restored.end());
+    report = true;
+  } else {
+    scanned.clear();
+    Scan(root, recursive, filter, &scanned);
+  }
+
+  std::vector<WatcherEvent> events;
+  {
+    ScopedLocker locker(g_tracked_mutex);
+
+    // What events reported during the scan is more recent than what the scan
+    // may have seen.
+    for (std::set<std::string>::const_iterator iter = watch->touched.begin();
+         iter != watch->touched.end();
+         ++iter) {
+      EraseSubtree(&scanned, *iter);
+      CopySubtree(watch->entries, *iter, &scanned);
+    }
+
+    if (report && !watch->cancelled)
+      Diff(request->handle, root, watch->entries, scanned, &events);
+    watch->entries.swap(scanned);
+    watch->scanning = false;
+    watch->touched.clear();
+    if (!file.empty())
+      scanned = watch->entries;
+  }
+
+  if (!file.empty()) {
+    ScopedLocker locker(watch->io_mutex);
+    if (!watch->cancelled)
+      WriteSnapshot(watch, scanned);
+  }
+
+  // Posted from the thread pool like a watcher thread would, so a full queue
+  // never blocks the main thread.
+  for (size_t i = 0; i < events.size(); ++i)
+    PostEvent(events[i].type, events[i].handle, events[i].new_path);
+}
+
+static void StartScan(uv_loop_t* loop,
+                      WatcherHandle handle,
+                      const std::shared_ptr<TrackedWatch>& watch,
+                      bool report,
+                      bool restore = false);
+
+static void ScanDone(uv_work_t* req, int status) {
+  ScanRequest* request = static_cast<ScanRequest*>(req->data);
+  bool again = false;
+  {
+    ScopedLocker locker(g_tracked_mutex);
+    again = request->watch->rescan_again && !request->watch->cancelled;
+    request->watch->rescan_again = false;
+  }
+  if (again)
+    StartScan(req->loop, request->handle, request->watch, true);
+  delete request;
+}
+
+// Scans run on the thread pool of |loop|, the loop of the environment asking
+// for them.
+static void StartScan(uv_loop_t* loop,
+                      WatcherHandle handle,
+                      const std::shared_ptr<TrackedWatch>& watch,
+                      bool report,
+                      bool restore) {
+  {
+    ScopedLocker locker(g_tracked_mutex);
+    watch->scanning = true;
+    watch->touched.clear();
+  }
+
+  ScanRequest* request = new ScanRequest;
+  request->req.data = request;
+  request->handle = handle;
+  request->watch = watch;
+  request->report = report;
+  request->restore = restore;
+  uv_queue_work(loop, &request->req, ScanWork, ScanDone);
+}
+
+static void InitTrackedMutex() {
+  uv_mutex_init(&g_tracked_mutex);
+}
+
+void TrackWatch(WatcherHandle handle,
+                const char* path,
+                bool recursive,
+                const PathFilterPtr& filter,
+                const std::string& file) {
+  uv_once(&g_tracked_mutex_once, InitTrackedMutex);
+
+  std::shared_ptr<TrackedWatch> watch(new TrackedWatch);
+  watch->root = path;
+  watch->recursive = recursive;
+  watch->filter = filter;
+  watch->file = file;
+  {
+    ScopedLocker locker(g_tracked_mutex);
+    std::shared_ptr<TrackedWatch>& slot = g_tracked[handle];
+    if (slot) {
+      slot->cancelled = true;
+    } else {
+      ++g_tracked_count;
+      ++g_tracked_buckets[TrackedBucket(handle)];
+    }
+    slot = watch;
+  }
+  StartScan(Nan::GetCurrentEventLoop(), handle, watch, false, !file.empty());
+}
+
+void UntrackWatch(WatcherHandle handle) {
+  if (g_tracked_count == 0)
+    return;
+
+  ScopedLocker locker(g_tracked_mutex);
+  std::map<WatcherHandle, std::shared_ptr<TrackedWatch> >::iterator iter =
+      g_tracked.find(handle);
+  if (iter == g_tracked.end())
+    return;
+  // The snapshot file is closed once the work still queued for the watch is
+  // done with it.
+  iter->second->cancelled = true;
+  g_tracked.erase(iter);
+  --g_tracked_count;
+  --g_tracked_buckets[TrackedBucket(handle)];
+}
+
+void RecordEvent(EVENT_TYPE type,
+                 WatcherHandle handle,
+                 const std::vector<char>& new_path,
+                 const std::vector<char>& old_path) {
+  if (type == EVENT_OVERFLOW || g_tracked_buckets[TrackedBucket(handle)] == 0)
+    return;
+
+  std::shared_ptr<TrackedWatch> watch;
+  {
+    ScopedLocker locker(g_tracked_mutex);
+    std::map<WatcherHandle, std::shared_ptr<TrackedWatch> >::const_iterator iter =
+        g_tracked.find(handle);
+    if (iter == g_tracked.end())
+      return;
+    watch = iter->second;
+  }
+
+  PendingChange change;
+  change.type = type;
+  if (type == EVENT_CHILD_CREATE || type == EVENT_CHILD_CHANGE ||
+      type == EVENT_CHILD_DELETE || type == EVENT_CHILD_RENAME) {
+    if (!RelativePath(watch->root, std::string(new_path.begin(), new_path.end()), &change.path))
+      return;
+    if (type == EVENT_CHILD_RENAME &&
+        !RelativePath(watch->root, std::string(old_path.begin(), old_path.end()),
+                      &change.old_path))
+      return;
+  }
+
+  // Nothing but memory is touched here, the watcher threads have better
+  // things to do than stat'ing paths and writing files.
+  ScopedLocker locker(g_tracked_mutex);
+  if (watch->scanning) {
+    watch->touched.insert(change.path);
+    if (type == EVENT_CHILD_RENAME)
+      watch->touched.insert(change.old_path);
+  }
+  watch->changes.push_back(change);
+  if (!watch->queued) {
+    watch->queued = true;
+    g_unflushed.push_back(watch);
+  }
+}
+
+// Brings the snapshot of |watch| up to date with |change|, |entry| being
+// what its path is now or NULL when it is gone, and adds the records for
+// the snapshot file to |journal| unless it is NULL. Called with
+// g_tracked_mutex held.
+static void ApplyChange(TrackedWatch* watch,
+                        const PendingChange& change,
+                        const StatEntry* entry,
+                        std::string* journal) {
+  const std::string& path = change.path;
+  if (change.type == EVENT_CHILD_RENAME) {
+    MoveSubtree(&watch->entries, change.old_path, path);
+    if (watch->scanning)
+      watch->touched.insert(change.old_path);
+    if (journal) {
+      Snapshot moved;
+      CopySubtree(watch->entries, path, &moved);
+      AppendRecord(journal, RECORD_ERASE, change.old_path, NULL);
+      AppendRecord(journal, RECORD_ERASE, path, NULL);
+      for (Snapshot::const_iterator iter = moved.begin(); iter != moved.end(); ++iter)
+        AppendRecord(journal, RECORD_PUT, iter->first, &iter->second);
+    }
+  }
+  if (entry) {
+    // A change of something we don't know means its creation was lost, leave
+    // it to the rescan to report it.
+    bool known = watch->entries.count(path) > 0;
+    if (known || (change.type != EVENT_CHANGE && change.type != EVENT_CHILD_CHANGE)) {
+      watch->entries[path] = *entry;
+      if (journal)
+        AppendRecord(journal, RECORD_PUT, path, entry);
+    }
+  } else {
+    EraseSubtree(&watch->entries, path);
+    if (journal)
+      AppendRecord(journal, RECORD_ERASE, path, NULL);
+  }
+  if (watch->scanning)
+    watch->touched.insert(path);
+}
+
+static void FlushWork(uv_work_t* req) {
+  FlushRequest* request = static_cast<FlushRequest*>(req->data);
+  TrackedWatch* watch = request->watch.get();
+
+  std::vector<PendingChange> changes;
+  {
+    ScopedLocker locker(g_tracked_mutex);
+    changes.swap(watch->changes);
+  }
+  if (watch->cancelled)
+    return;
+
+  std::vector<StatEntry> entries(changes.size());
+  std::vector<char> exists(changes.size());
+  for (size_t i = 0; i < changes.size(); ++i) {
+    EVENT_TYPE type = changes[i].type;
+    exists[i] = type != EVENT_DELETE && type != EVENT_CHILD_DELETE &&
+        StatPath(FullPath(watch->root, changes[i].path), &entries[i]);
+  }
+
+  std::string journal;
+  {
+    ScopedLocker locker(g_tracked_mutex);
+    for (size_t i = 0; i < changes.size(); ++i) {
+      ApplyChange(watch, changes[i], exists[i] ? &entries[i] : NULL,
+                  watch->file.empty() ? NULL : &journal);
+    }
+  }
+
+  ScopedLocker locker(watch->io_mutex);
+  AppendJournal(watch, journal);
+}
+
+static void FlushDone(uv_work_t* req, int status) {
+  FlushRequest* request = static_cast<FlushRequest*>(req->data);
+  bool again = false;
+  {
+    // What was recorded during the flush waits for another one.
+    ScopedLocker locker(g_tracked_mutex);
+    again = !request->watch->changes.empty() && !request->watch->cancelled;
+    request->watch->queued = again;
+  }
+  if (again)
+    uv_queue_work(req->loop, &request->req, FlushWork, FlushDone);
+  else
+    delete request;
+}
+
+void FlushSnapshots() {
+  if (g_tracked_count == 0)
+    return;
+
+  std::vector<std::shared_ptr<TrackedWatch> > watches;
+  {
+    ScopedLocker locker(g_tracked_mutex);
+    watches.swap(g_unflushed);
+  }
+  for (size_t i = 0; i < watches.size(); ++i) {
+    FlushRequest* request = new FlushRequest;
+    request->req.data = request;
+    request->watch = watches[i];
+    uv_queue_work(Nan::GetCurrentEventLoop(), &request->req, FlushWork, FlushDone);
+  }
+}
+
+void RescanWatch(WatcherHandle handle) {
+  if (g_tracked_count == 0)
+    return;
+
+  std::shared_ptr<TrackedWatch> watch;
+  {
+    ScopedLocker locker(g_tracked_mutex);
+    std::map<WatcherHandle, std::shared_ptr<TrackedWatch> >::const_iterator iter =
+        g_tracked.find(handle);
+    if (iter == g_tracked.end())
+      return;
+    watch = iter->second;
+    // A scan already running may have passed over what got lost, so run
+    // another one once it is done.
+    if (watch->scanning) {
+      watch->rescan_again = true;
+      return;
+    }
+  }
+  StartScan(Nan::GetCurrentEventLoop(), handle, watch, true);
+}
@@ -0,0 +1,57 @@
+#ifndef SRC_SNAPSHOT_H_
+#define SRC_SNAPSHOT_H_
+
+#include <string>
+
+#include "common.h"
+
+// Watches created with `rescanOnOverflow` keep a stat snapshot of everything
+// they cover, kept up to date by the events they report. When the kernel
+// queue overflows the watched paths are scanned again on the thread pool and
+// only the differences to the snapshot are posted as events.
+//
+// With `snapshotFile` the snapshot is also kept in that file: written in full
+// after every scan, and between scans the changes are appended in batches on
+// the thread pool. When a watch starts with a snapshot of the same root on disk, its
+// first scan stats the paths it knows about in parallel, only lists the
+// directories whose modification time moved, and posts what changed since
+// the file was written.
+
+// What a watch asked for in its options.
+struct TrackOptions {
+  TrackOptions() : rescan_on_overflow(false) {}
+
+  bool enabled() const { return rescan_on_overflow || !file.empty(); }
+
+  bool rescan_on_overflow;
+  // Where the snapshot is kept between runs, empty when it isn't.
+  std::string file;
+};
+
+// Starts tracking |handle| and takes its first snapshot in the background.
+// On the main thread of an environment, as are UntrackWatch and RescanWatch.
+void TrackWatch(WatcherHandle handle,
+                const char* path,
+                bool recursive,
+                const PathFilterPtr& filter,
+                const std::string& file);
+void UntrackWatch(WatcherHandle handle);
+
+// Records an event that is about to be posted for the snapshot of |handle|,
+// called on whichever thread posts it. Only memory is touched, the snapshot
+// catches up once FlushSnapshots() runs.
+void RecordEvent(EVENT_TYPE type,
+                 WatcherHandle handle,
+                 const std::vector<char>& new_path,
+                 const std::vector<char>& old_path);
+
+// Stats the paths of the events recorded so far and appends them to the
+// snapshot files, on the thread pool of the current loop. On the main thread
+// of an environment, after it took events.
+void FlushSnapshots();
+
+// Schedules a rescan of |handle| after events were lost, does nothing for
+// handles that aren't tracked.
+void RescanWatch(WatcherHandle handle);
+
+#endif  // SRC_SNAPSHOT_H_